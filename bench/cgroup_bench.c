@@ -0,0 +1,148 @@
+/**************************************************************************************
+ cgroup_bench.c
+
+ What placing a fork in a 'cgroup:' directory costs.  Times fork() and waitpid() of a
+ child that exits as soon as it's told to (default 2000 of them, best of 5 rounds), and
+ the same with the child placed in a fresh cgroup v2 directory:
+   cached fd     one write to the directory's cgroup.procs, kept open (shim_cgroup_move())
+   open/write    opening cgroup.procs for each fork, as without the cache
+   clone3        the child created in it (CLONE_INTO_CGROUP, forkshimd_fork_into())
+ Before timing, it checks each way really did put the child there.  Needs root and a
+ cgroup2 mount; without them it says so and does nothing.
+
+ $ make -C bench cgroup_bench && bench/cgroup_bench [N]
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <stdio.h>   // printf()
+
+#define BENCH_ROUNDS 5
+
+enum { BENCH_FORK, BENCH_CACHED, BENCH_OPEN, BENCH_CLONE3, BENCH_MODES };
+
+static char bench_cgroup[PATH_MAX];
+static int bench_go[2]; // a byte per child: placed, it may exit
+
+// A cgroup2 mount to make the bench's directory in, -1 if there is none.
+static int bench_cgroup_make(void){
+    char buf[16384], *line, *save, dev[64], dir[PATH_MAX], type[32], opts[256];
+    if(forkshimd_read_at("self/mounts", buf, sizeof(buf)) <= 0){
+        return(-1);
+    }
+    for(line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)){
+        if(sscanf(line, "%63s %4095s %31s %255s", dev, dir, type, opts) == 4 && !strcmp(type, "cgroup2")){
+            shim_format(bench_cgroup, sizeof(bench_cgroup), "%s/forkshim_cgroup_bench", dir);
+            rmdir(bench_cgroup);
+            if(mkdir(bench_cgroup, 0755) == 0){
+                return(0);
+            }
+        }
+    }
+    return(-1);
+}
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// One child, placed the given way; its pid, -1 if it couldn't be made or placed.
+static pid_t bench_spawn(int mode, int slot){
+    char path[PATH_MAX], num[16];
+    int fd, len, ok = 1;
+    pid_t pid = mode == BENCH_CLONE3 ? forkshimd_fork_into(slot) : fork();
+    if(pid == 0){
+        char byte;
+        while(read(bench_go[0], &byte, 1) == -1 && errno == EINTR){
+        }
+        _exit(0);
+    }
+    if(pid == -1){
+        return(-1);
+    }
+    if(mode == BENCH_CACHED){
+        ok = shim_cgroup_move(slot, pid) == 0;
+    } else if(mode == BENCH_OPEN){
+        shim_format(path, sizeof(path), "%s/cgroup.procs", bench_cgroup);
+        len = shim_format(num, sizeof(num), "%d\n", pid);
+        ok = (fd = open(path, O_WRONLY | O_CLOEXEC)) != -1 && write(fd, num, len) == len;
+        if(fd != -1){
+            close(fd);
+        }
+    }
+    return ok ? pid : -1;
+}
+
+// Let a child exit and reap it.
+static void bench_reap(pid_t pid){
+    char byte = 0;
+    if(write(bench_go[1], &byte, 1) == 1){
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Whether a child placed the given way ends up in the bench's directory.
+static int bench_placed(int mode, int slot){
+    char name[32], buf[4096];
+    pid_t pid = bench_spawn(mode, slot);
+    int in;
+    if(pid == -1){
+        return(0);
+    }
+    shim_format(name, sizeof(name), "%d/cgroup", pid);
+    in = forkshimd_read_at(name, buf, sizeof(buf)) > 0 && strstr(buf, "0::/") != NULL &&
+         strstr(strstr(buf, "0::/"), "/forkshim_cgroup_bench\n") != NULL;
+    bench_reap(pid);
+    return in;
+}
+
+int main(int argc, char **argv){
+    static const char *name[BENCH_MODES] = { "fork", "fork + cached fd", "fork + open/write/close", "clone3 CLONE_INTO_CGROUP" };
+    long n = argc > 1 ? atol(argv[1]) : 2000, i;
+    double t, best[BENCH_MODES];
+    int m, r, slot, failed = 0;
+    pid_t pid;
+    if(geteuid() != 0 || bench_cgroup_make() == -1){
+        printf("cgroup_bench: needs root and a cgroup2 mount, skipped\n");
+        return(0);
+    }
+    if(n <= 0 || pipe2(bench_go, O_CLOEXEC) == -1 || (slot = shim_cgroup_slot(bench_cgroup)) == -1){
+        return(1);
+    }
+    for(m = BENCH_CACHED; m < BENCH_MODES; m++){
+        if(!bench_placed(m, slot)){
+            printf("%s: the child didn't end up in %s\n", name[m], bench_cgroup);
+            failed = 1;
+        }
+    }
+    printf("%ld forks, best of %d rounds, into %s\n", n, BENCH_ROUNDS, bench_cgroup);
+    for(m = 0; m < BENCH_MODES && !failed; m++){
+        best[m] = 1e9;
+        for(r = 0; r < BENCH_ROUNDS; r++){
+            t = bench_now();
+            for(i = 0; i < n; i++){
+                if((pid = bench_spawn(m, slot)) == -1){
+                    failed = 1;
+                    break;
+                }
+                bench_reap(pid);
+            }
+            t = bench_now() - t;
+            best[m] = t < best[m] ? t : best[m];
+        }
+        printf("%-26s %7.1f us per fork", name[m], best[m] / n * 1e6);
+        if(m > BENCH_FORK){
+            printf(", placing %+.1f us", (best[m] - best[BENCH_FORK]) / n * 1e6);
+        }
+        printf("\n");
+    }
+    for(r = 0; r < 100 && rmdir(bench_cgroup) == -1 && errno == EBUSY; r++){
+        usleep(10000); // the last children may still be on their way out
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/**************************************************************************************
+ fork_stress.c
+
+ Many threads of one process forking at once, under the shim, while the whitelist
+ changes underneath them.  A worker process with the shim preloaded runs T threads
+ (1, 2, 4 ... 64) that fork N children between them (default 3200); each child waits
+ until its parent's fork() has returned, reads its own oom_score_adj and exits with
+ what it found.  Each thread count is run with a whitelist fragment naming the worker
+ =300 left alone, then with it rewritten every 2 ms, alternating between =300 and
+ =301; either way every child has to end up with one of those two.  The worker's own
+ score means its decision was lost, anything else that it was corrupted.
+ Every run is made under each shim given.  By default those are the two 'make'
+ builds next to this program, so the per-thread L1 is measured on and off:
+   fork_shim.so        the lean build, remembering SHIM_L1_WAYS decisions per thread
+   fork_shim_nol1.so   the same built with -DSHIM_L1_WAYS=0
+ The runs are interleaved, best of 3 reported as forks per second; fails if any
+ child was lost or wrong.  Needs root (for the fragment in /etc/oom_whitelist.d).
+
+ $ make -C bench fork_stress && bench/fork_stress [N [shim.so...]]
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <spawn.h>   // posix_spawn()
+#include <stdio.h>   // printf()
+#include <sys/wait.h> // waitpid()
+
+#define BENCH_WORKER "--fork-stress-worker"  // argv[1] of the worker, and its whitelist entry
+#define BENCH_FRAGMENT WL_DIR "/zz-fork-stress"
+#define BENCH_REWRITE_US 2000
+#define BENCH_MAX_THREADS 64
+#define BENCH_SHIMS 8
+#define BENCH_ROUNDS 3
+
+enum { BENCH_OK, BENCH_LOST = 10, BENCH_WRONG };
+
+static long bench_per_thread;
+static int bench_inherited; // the worker's own score: a child still has it if the shim never scored it
+static int bench_stop, bench_rewriting;
+static struct { long ok, lost, wrong; } bench_count[BENCH_MAX_THREADS];
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// This process's oom_score_adj, -1 if it can't be read (not a score anyone gets here).
+static int bench_score(void){
+    char buf[16];
+    int fd, n;
+    if((fd = open("/proc/self/oom_score_adj", O_RDONLY | O_CLOEXEC)) == -1){
+        return(-1);
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0x00;
+    return n > 0 ? atoi(buf) : -1;
+}
+
+// A forked child: once the parent says its fork() is done, how the child was scored.
+static int bench_child(int go){
+    char byte;
+    int score;
+    while(read(go, &byte, 1) == -1 && errno == EINTR){
+    }
+    score = bench_score();
+    return score == 300 || score == 301 ? BENCH_OK : score == bench_inherited ? BENCH_LOST : BENCH_WRONG;
+}
+
+static void *bench_thread(void *arg){
+    long t = (long)arg, i;
+    int go[2], status;
+    char byte = 0;
+    pid_t pid;
+    if(pipe2(go, O_CLOEXEC) == -1){
+        bench_count[t].wrong = bench_per_thread;
+        return NULL;
+    }
+    for(i = 0; i < bench_per_thread; i++){
+        if((pid = fork()) == 0){
+            _exit(bench_child(go[0]));
+        }
+        if(pid == -1 || write(go[1], &byte, 1) != 1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)){
+            bench_count[t].wrong++;
+            continue;
+        }
+        switch(WEXITSTATUS(status)){
+        case BENCH_OK:
+            bench_count[t].ok++;
+            break;
+        case BENCH_LOST:
+            bench_count[t].lost++;
+            break;
+        default:
+            bench_count[t].wrong++;
+        }
+    }
+    close(go[0]);
+    close(go[1]);
+    return NULL;
+}
+
+// The worker, with the shim preloaded: threads forks in all; prints forks/s, scored, lost, wrong.
+static int bench_worker(int threads, long forks){
+    pthread_t tid[BENCH_MAX_THREADS];
+    long ok = 0, lost = 0, wrong = 0;
+    double t;
+    int i;
+    bench_per_thread = forks / threads;
+    bench_inherited = bench_score();
+    t = bench_now();
+    for(i = 0; i < threads; i++){
+        if(pthread_create(&tid[i], NULL, bench_thread, (void *)(long)i) != 0){
+            return(1);
+        }
+    }
+    for(i = 0; i < threads; i++){
+        pthread_join(tid[i], NULL);
+        ok += bench_count[i].ok;
+        lost += bench_count[i].lost;
+        wrong += bench_count[i].wrong;
+    }
+    t = bench_now() - t;
+    printf("%.0f %ld %ld %ld\n", (ok + lost + wrong) / t, ok, lost, wrong);
+    return(0);
+}
+
+// Writes the fragment, then, while bench_rewriting, keeps rewriting it with the other score until
+// told to stop; by rename(), so the shim never sees it half written.
+static void *bench_rewriter(void *arg){
+    char tmp[] = WL_DIR "/.zz-fork-stress.tmp", buf[64];
+    int fd, len, i;
+    (void)arg;
+    for(i = 0; !__atomic_load_n(&bench_stop, __ATOMIC_RELAXED); i++){
+        len = shim_format(buf, sizeof(buf), "!" BENCH_WORKER " =%d\n", 300 + i % 2);
+        if((i == 0 || __atomic_load_n(&bench_rewriting, __ATOMIC_RELAXED)) && (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1){
+            if(write(fd, buf, len) == len){
+                rename(tmp, BENCH_FRAGMENT);
+            }
+            close(fd);
+        }
+        usleep(BENCH_REWRITE_US);
+    }
+    return NULL;
+}
+
+// One worker run under env; its forks/s, with lost and wrong children added up, -1 if it failed.
+static double bench_run(char *self, char **env, int threads, long forks, long *lost, long *wrong){
+    char nthreads[16], nforks[24], buf[128], *argv[] = { self, BENCH_WORKER, nthreads, nforks, NULL };
+    posix_spawn_file_actions_t fa;
+    double rate = -1;
+    long ok, l, w;
+    int out[2], status, spawned;
+    ssize_t n = 0, r;
+    pid_t pid;
+    shim_format(nthreads, sizeof(nthreads), "%d", threads);
+    shim_format(nforks, sizeof(nforks), "%ld", forks / threads * threads);
+    if(pipe2(out, O_CLOEXEC) == -1){
+        return(-1);
+    }
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    spawned = posix_spawn(&pid, self, &fa, NULL, argv, env) == 0;
+    posix_spawn_file_actions_destroy(&fa);
+    close(out[1]);
+    while(spawned && n < (ssize_t)sizeof(buf) - 1 && ((r = read(out[0], buf + n, sizeof(buf) - 1 - n)) > 0 || (r == -1 && errno == EINTR))){
+        n += r > 0 ? r : 0;
+    }
+    close(out[0]);
+    buf[n] = 0x00;
+    if(spawned && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+       sscanf(buf, "%lf %ld %ld %ld", &rate, &ok, &l, &w) == 4){
+        *lost += l;
+        *wrong += w;
+    }
+    return rate;
+}
+
+int main(int argc, char **argv){
+    static char preload[BENCH_SHIMS][PATH_MAX + sizeof("LD_PRELOAD=")];
+    static char *env[BENCH_SHIMS][256];
+    static const char *deflt[] = { "fork_shim.so", "fork_shim_nol1.so" };
+    const char *name[BENCH_SHIMS];
+    long forks = argc > 1 ? atol(argv[1]) : 3200, lost[BENCH_SHIMS] = { 0 }, wrong[BENCH_SHIMS] = { 0 };
+    double best[BENCH_SHIMS], t;
+    char path[PATH_MAX], self[PATH_MAX];
+    int nshim = argc > 2 ? argc - 2 : 2, threads, s, e, k, r, m, failed = 0;
+    pthread_t rewriter;
+    ssize_t n;
+    if(argc == 4 && !strcmp(argv[1], BENCH_WORKER)){
+        return bench_worker(atoi(argv[2]), atol(argv[3]));
+    }
+    if(forks < BENCH_MAX_THREADS || nshim > BENCH_SHIMS){
+        printf("usage: %s [N (at least %d) [shim.so...]] (at most %d shims)\n", argv[0], BENCH_MAX_THREADS, BENCH_SHIMS);
+        return(2);
+    }
+    if(geteuid() != 0 || access(WL_DIR, W_OK) == -1){
+        printf("fork_stress: needs root and %s, skipped\n", WL_DIR);
+        return(0);
+    }
+    if((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) <= 0){
+        return(1);
+    }
+    self[n] = 0x00;
+    // every environment is ours without LD_PRELOAD, plus the shim's
+    for(s = 0; s < nshim; s++){
+        name[s] = argc > 2 ? argv[s + 2] : deflt[s];
+        if(realpath(name[s], path) == NULL){
+            printf("%s: not found\n", name[s]);
+            return(1);
+        }
+        shim_format(preload[s], sizeof(preload[s]), "LD_PRELOAD=%s", path);
+        for(e = k = 0; environ[e] != NULL && k < 254; e++){
+            if(strncmp(environ[e], "LD_PRELOAD=", sizeof("LD_PRELOAD=") - 1)){
+                env[s][k++] = environ[e];
+            }
+        }
+        env[s][k++] = preload[s];
+        env[s][k] = NULL;
+    }
+    if(pthread_create(&rewriter, NULL, bench_rewriter, NULL) != 0){
+        return(1);
+    }
+    usleep(10 * BENCH_REWRITE_US); // the fragment is there before the first worker starts
+    printf("%ld forks per run, best of %d runs, forks/s\n", forks, BENCH_ROUNDS);
+    for(m = 0; m < 2 && !failed; m++){
+        __atomic_store_n(&bench_rewriting, m, __ATOMIC_RELAXED);
+        if(m){
+            printf("\nwhitelist changing every %d us\n%7s", BENCH_REWRITE_US, "threads");
+        } else {
+            printf("\nwhitelist unchanged\n%7s", "threads");
+        }
+        for(s = 0; s < nshim; s++){
+            printf("  %20s", name[s]);
+        }
+        printf("\n");
+        for(threads = 1; threads <= BENCH_MAX_THREADS && !failed; threads *= 2){
+            for(s = 0; s < nshim; s++){
+                best[s] = 0;
+            }
+            // the runs are interleaved, so drift hits every build alike
+            for(r = 0; r < BENCH_ROUNDS && !failed; r++){
+                for(s = 0; s < nshim; s++){
+                    if((t = bench_run(self, env[s], threads, forks, &lost[s], &wrong[s])) < 0){
+                        printf("%s: the worker didn't run\n", name[s]);
+                        failed = 1;
+                        break;
+                    }
+                    best[s] = t > best[s] ? t : best[s];
+                }
+            }
+            printf("%7d", threads);
+            for(s = 0; s < nshim && !failed; s++){
+                printf("  %20.0f", best[s]);
+            }
+            printf("\n");
+        }
+    }
+    __atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(rewriter, NULL);
+    unlink(BENCH_FRAGMENT);
+    for(s = 0; s < nshim; s++){
+        printf("%s: %ld children lost, %ld wrong\n", name[s], lost[s], wrong[s]);
+        failed |= lost[s] + wrong[s] > 0;
+    }
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/**************************************************************************************
+ kernel_bench.c
+
+ The matcher's inner kernels, each on its own, across token lengths:
+   delimiter scan  shim_scan_delim()'s scalar, SSE2 and AVX2 kernels (those this CPU
+                   has) finding the next NUL, space or slash, over a buffer of tokens
+                   of the given length; all kernels are checked to agree first
+   prefilter       check_wl_config()'s nibble-mask probe of the first 3 bytes, against
+                   walking the DFA over the whole token, for tokens a small and a large
+                   whitelist mostly don't match (flags, values, paths); reports how many
+                   the probe rejects, and what a check costs with and without it
+ Neither includes the per-check log line check_wl_config() also writes.  Where the
+ probe starts paying for itself is what WL_PREFILTER_MIN is set from.
+
+ $ make -C bench kernel_bench && bench/kernel_bench
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <stdio.h>   // printf()
+
+#define BENCH_BYTES (1 << 20)  // scanned per round
+#define BENCH_ROUNDS 20
+#define BENCH_LARGE 400        // entries in the large whitelist
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// BENCH_BYTES of tokens len bytes long, separated by a space, a slash or a NUL in turn.
+static void bench_tokens(char *buf, size_t len){
+    static const char delim[3] = { ' ', '/', 0x00 };
+    size_t i, k = 0;
+    for(i = 0; i < BENCH_BYTES; i++){
+        buf[i] = (i + 1) % (len + 1) == 0 ? delim[k++ % 3] : (char)('a' + i % 26);
+    }
+    memset(buf + BENCH_BYTES, 0, SHIM_SCAN_PAD);
+}
+
+// Best time of BENCH_ROUNDS to find every delimiter in buf; *found is how many there were.
+static double bench_scan(t_scan_delim scan, const char *buf, size_t *found){
+    const char *p, *end = buf + BENCH_BYTES;
+    double t, best = 1e9;
+    int r;
+    for(r = 0; r < BENCH_ROUNDS; r++){
+        *found = 0;
+        t = bench_now();
+        for(p = buf; (p = scan(p, end - p)) < end; p++){
+            (*found)++;
+        }
+        t = bench_now() - t;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+// check_wl_config()'s prefilter: 0 = none of the entries can match a name starting like p.
+static int bench_prefilter(const struct wl_dfa *dfa, const unsigned char *p, size_t len){
+    unsigned int m = 0xff;
+    size_t i;
+    for(i = 0; i < 3 && i < len; i++){
+        m &= dfa->pf_lo[i][p[i] & 0x0f] & dfa->pf_hi[i][p[i] >> 4];
+    }
+    return m != 0 || wl_bloom_maybe(dfa, p, len);
+}
+
+// ...and the DFA walk it saves.
+static int bench_walk(const struct wl_dfa *dfa, const unsigned char *p, size_t len){
+    unsigned int s = dfa->start;
+    size_t i;
+    for(i = 0; i < len && s != 0; i++){
+        s = dfa->next[s * dfa->nclasses + dfa->cls[p[i]]];
+    }
+    return dfa->accept[s];
+}
+
+int main(void){
+    static const size_t lens[] = { 1, 4, 8, 16, 32, 64, 256, 1024, 4096 };
+    static const char small[] = "!sshd\n!systemd\njava =important\n^/usr/sbin/\n$.rb =tolerated\n~postgres*\n!puppet\n";
+    static const char *words[] = { "--verbose", "-c", "0", "/etc/puppetlabs/puppet/puppet.conf", "--no-daemonize",
+                                   "xvda1", "1000", "--log-level=debug", "/var/lib/apt/lists", "-o", "run", "agent" };
+    struct { const char *name; t_scan_delim scan; } kernel[3];
+    char path[32], *buf, *tok;
+    static char large[BENCH_LARGE * 32];
+    struct wl_rules wl;
+    size_t l, found, expect, nk = 0, i, n, nwords = sizeof(words) / sizeof(*words), pass, nlarge = 0;
+    double t, scan_t[3], pre_t, walk_t;
+    int k, fd, r, w, sink = 0;
+    kernel[nk].name = "scalar";
+    kernel[nk++].scan = scan_delim_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        kernel[nk].name = "sse2";
+        kernel[nk++].scan = scan_delim_sse2;
+    }
+    if(__builtin_cpu_supports("avx2")){
+        kernel[nk].name = "avx2";
+        kernel[nk++].scan = scan_delim_avx2;
+    }
+#endif
+    if((buf = malloc(BENCH_BYTES + SHIM_SCAN_PAD)) == NULL){
+        return(1);
+    }
+    printf("delimiter scan, %d KB of tokens, best of %d rounds, ns per token (GB/s)\n%8s", BENCH_BYTES >> 10, BENCH_ROUNDS, "length");
+    for(k = 0; k < (int)nk; k++){
+        printf("  %18s", kernel[k].name);
+    }
+    printf("\n");
+    for(l = 0; l < sizeof(lens) / sizeof(*lens); l++){
+        bench_tokens(buf, lens[l]);
+        expect = BENCH_BYTES / (lens[l] + 1);
+        printf("%8zu", lens[l]);
+        for(k = 0; k < (int)nk; k++){
+            scan_t[k] = bench_scan(kernel[k].scan, buf, &found);
+            if(found != expect){
+                printf("\n%s found %zu delimiters, not %zu\n", kernel[k].name, found, expect);
+                return(1);
+            }
+            printf("  %8.2f (%6.2f)", scan_t[k] / expect * 1e9, BENCH_BYTES / scan_t[k] / 1e9);
+        }
+        printf("\n");
+    }
+    // a small whitelist, and a large one: BENCH_LARGE generated names of every kind but globs
+    for(i = 0; i < BENCH_LARGE; i++){
+        static const char kind[4] = { '!', '^', '$', 'x' };
+        char entry[32];
+        int len = shim_format(entry, sizeof(entry), "%c%s%u\n", kind[i % 4], i % 4 == 2 ? ".x" : "daemon-", (unsigned int)(i * 2654435761u % 100000));
+        if(len > 0 && kind[i % 4] == 'x'){
+            memmove(entry, entry + 1, len--); // plain substring entry
+        }
+        memcpy(large + nlarge, entry, len);
+        nlarge += len;
+    }
+    for(w = 0; w < 2; w++){
+        shim_format(path, sizeof(path), "/tmp/kernel_bench.XXXXXX");
+        if((fd = mkstemp(path)) == -1 || write(fd, w ? large : small, w ? nlarge : sizeof(small) - 1) != (ssize_t)(w ? nlarge : sizeof(small) - 1)){
+            return(1);
+        }
+        close(fd);
+        k = wl_load(&wl, path);
+        unlink(path);
+        if(k != 1 || (wl.dfa = wl_compile(&wl)) == NULL){
+            return(1);
+        }
+        printf("\nprefilter, %zu entries (%u DFA states), tokens cycling through %zu flags, values and paths, ns per token\n",
+               wl.nrules, wl.dfa->nstates, nwords);
+        printf("%8s  %10s  %12s  %12s\n", "length", "rejected", "with probe", "DFA only");
+        for(l = 0; l < sizeof(lens) / sizeof(*lens); l++){
+            // each token is a word, repeated up to the length
+            n = BENCH_BYTES / lens[l];
+            for(i = 0; i < n; i++){
+                const char *word = words[i % nwords];
+                size_t wlen = strlen(word), j;
+                for(j = 0; j < lens[l]; j++){
+                    buf[i * lens[l] + j] = word[j % wlen];
+                }
+            }
+            pre_t = walk_t = 1e9;
+            for(r = 0; r < BENCH_ROUNDS; r++){
+                pass = 0;
+                t = bench_now();
+                for(i = 0, tok = buf; i < n; i++, tok += lens[l]){
+                    if(bench_prefilter(wl.dfa, (unsigned char *)tok, lens[l])){
+                        pass++;
+                        sink += bench_walk(wl.dfa, (unsigned char *)tok, lens[l]);
+                    }
+                }
+                t = bench_now() - t;
+                pre_t = t < pre_t ? t : pre_t;
+                t = bench_now();
+                for(i = 0, tok = buf; i < n; i++, tok += lens[l]){
+                    sink += bench_walk(wl.dfa, (unsigned char *)tok, lens[l]);
+                }
+                t = bench_now() - t;
+                walk_t = t < walk_t ? t : walk_t;
+            }
+            printf("%8zu  %9.1f%%  %12.2f  %12.2f\n", lens[l], 100.0 * (n - pass) / n, pre_t / n * 1e9, walk_t / n * 1e9);
+        }
+        wl_free(&wl);
+    }
+    return sink == 42 ? 2 : 0; // keeps the walks from being optimized away
+}
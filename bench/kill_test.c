@@ -0,0 +1,179 @@
+/**************************************************************************************
+ kill_test.c
+
+ Test harness for forkshimd's '%kill' engine (forkshimd_kill_tick()).  In a cgroup
+ with a small memory limit (memory.max on cgroup v2, memory.limit_in_bytes where the
+ memory controller is still on v1) it starts a keeper (score 0), a small disposable
+ process and a memory hog (both 1000), and runs the engine on the cgroup until the
+ hog is gone.  Twice: a hog that exits on SIGTERM, then one that ignores it and has
+ to be SIGKILLed after the grace period.  It passes if the hog, and only the hog,
+ was ended by the engine's signal, before the kernel's OOM killer had to step in.
+ Needs root.
+
+ $ make -C bench kill_test && bench/kill_test
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <stdio.h>   // printf()
+
+#define TEST_LIMIT (256 << 20)   // the cgroup's memory limit
+#define TEST_PCT 20              // '%kill' percentage
+#define TEST_GRACE 300           // ms between SIGTERM and SIGKILL
+#define TEST_CHUNK (1 << 20)     // the hog grows by this much...
+#define TEST_PACE 10000          // ...every this many us: 100 MB/s
+#define TEST_TIMEOUT 30          // seconds the hog gets to be ended
+
+static char test_cgroup[PATH_MAX];
+static int test_v2;
+
+static int test_write(const char *name, const char *fmt, long v){
+    char path[PATH_MAX], buf[32];
+    int fd, len, ok;
+    shim_format(path, sizeof(path), "%s/%s", test_cgroup, name);
+    len = shim_format(buf, sizeof(buf), fmt, v);
+    if((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1){
+        return(-1);
+    }
+    ok = write(fd, buf, len) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Where to make the test cgroup: a cgroup2 mount with the memory controller, or else the v1
+// memory hierarchy.
+static int test_cgroup_make(void){
+    char buf[16384], *line, *save, dev[64], dir[PATH_MAX], type[32], opts[256];
+    FILE *f;
+    for(test_v2 = 1; test_v2 >= 0; test_v2--){
+        if(forkshimd_read_at("self/mounts", buf, sizeof(buf)) <= 0){
+            return(-1);
+        }
+        for(line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)){
+            if(sscanf(line, "%63s %4095s %31s %255s", dev, dir, type, opts) != 4){
+                continue;
+            }
+            if(test_v2 && !strcmp(type, "cgroup2")){
+                shim_format(test_cgroup, sizeof(test_cgroup), "%s/cgroup.subtree_control", dir);
+                if((f = fopen(test_cgroup, "w")) != NULL){ // let children have memory limits
+                    fputs("+memory", f);
+                    fclose(f);
+                }
+                shim_format(test_cgroup, sizeof(test_cgroup), "%s/forkshim_kill_test", dir);
+                rmdir(test_cgroup);
+                if(mkdir(test_cgroup, 0755) == 0 && test_write("memory.max", "%ld", TEST_LIMIT) == 0){
+                    test_write("memory.swap.max", "%ld", 0);
+                    return(0);
+                }
+                rmdir(test_cgroup);
+            } else if(!test_v2 && !strcmp(type, "cgroup") && strstr(opts, "memory") != NULL){
+                shim_format(test_cgroup, sizeof(test_cgroup), "%s/forkshim_kill_test", dir);
+                rmdir(test_cgroup);
+                if(mkdir(test_cgroup, 0755) == 0 && test_write("memory.limit_in_bytes", "%ld", TEST_LIMIT) == 0){
+                    return(0);
+                }
+                rmdir(test_cgroup);
+            }
+        }
+    }
+    return(-1);
+}
+
+// The kernel's own OOM kills in the test cgroup so far.
+static unsigned long long test_oom_kills(void){
+    char buf[4096];
+    if(forkshimd_cgroup_read(test_cgroup, test_v2 ? "memory.events" : "memory.oom_control", buf, sizeof(buf)) <= 0){
+        return(0);
+    }
+    return forkshimd_stat_field(buf, "oom_kill");
+}
+
+// A child in the test cgroup with score adj, holding mb MB; if grow, it keeps growing (and, if
+// stubborn, ignores SIGTERM).
+static pid_t test_child(int adj, long mb, int grow, int stubborn){
+    char *p;
+    long i;
+    pid_t pid = fork();
+    if(pid != 0){
+        return pid;
+    }
+    if(test_write("cgroup.procs", "%ld", getpid()) == -1 || write_score("/proc/self/oom_score_adj", adj) == -1){
+        _exit(111);
+    }
+    if(stubborn){
+        signal(SIGTERM, SIG_IGN);
+    }
+    for(i = 0; i < mb; i++){
+        if((p = malloc(TEST_CHUNK)) != NULL){
+            memset(p, 1, TEST_CHUNK);
+        }
+    }
+    while(grow){
+        if((p = malloc(TEST_CHUNK)) != NULL){
+            memset(p, 1, TEST_CHUNK);
+        }
+        usleep(TEST_PACE);
+    }
+    for(;;){
+        pause();
+    }
+}
+
+static double test_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// One round: keeper, small and hog; 0 if only the hog was ended, by the signal expected.
+static int test_round(int stubborn){
+    static struct wl_rules cfg;
+    pid_t keeper, small, hog;
+    unsigned long long ooms = test_oom_kills();
+    int status = 0, gone = 0, ok;
+    double t0;
+    cfg.kill_pct = TEST_PCT;
+    cfg.kill_grace_ms = TEST_GRACE;
+    cfg.kill_score = WL_SCORE_DEFAULT;
+    shim_format(cfg.kill_cgroup, sizeof(cfg.kill_cgroup), "%s", test_cgroup);
+    keeper = test_child(0, 8, 0, 0);
+    small = test_child(WL_SCORE_DEFAULT, 8, 0, 0);
+    usleep(200000); // both settled in before the hog starts
+    hog = test_child(WL_SCORE_DEFAULT, 0, 1, stubborn);
+    t0 = test_now();
+    while(test_now() - t0 < TEST_TIMEOUT && !(gone = waitpid(hog, &status, WNOHANG) == hog)){
+        forkshimd_kill_tick(&cfg);
+        usleep(20000);
+    }
+    ok = gone && WIFSIGNALED(status) && WTERMSIG(status) == (stubborn ? SIGKILL : SIGTERM) &&
+         test_oom_kills() == ooms && kill(keeper, 0) == 0 && kill(small, 0) == 0;
+    printf("%-28s hog %s after %.2f s, kernel OOM kills %llu, keeper %s, small disposable %s: %s\n",
+           stubborn ? "hog ignoring SIGTERM:" : "hog that exits on SIGTERM:",
+           !gone ? "still running" : WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "exited",
+           test_now() - t0, test_oom_kills() - ooms, kill(keeper, 0) == 0 ? "alive" : "gone",
+           kill(small, 0) == 0 ? "alive" : "gone", ok ? "ok" : "FAILED");
+    if(!gone){
+        kill(hog, SIGKILL);
+        waitpid(hog, NULL, 0);
+    }
+    kill(keeper, SIGKILL);
+    kill(small, SIGKILL);
+    waitpid(keeper, NULL, 0);
+    waitpid(small, NULL, 0);
+    return ok ? 0 : 1;
+}
+
+int main(void){
+    int failed;
+    if(geteuid() != 0 || test_cgroup_make() == -1){
+        printf("kill_test: needs root and a memory cgroup (v2 with the memory controller, or v1)\n");
+        return(1);
+    }
+    printf("cgroup %s (%s), limit %d MB, '%%kill %d %d'\n", test_cgroup, test_v2 ? "v2" : "v1", TEST_LIMIT >> 20, TEST_PCT, TEST_GRACE);
+    failed = test_round(0) + test_round(1);
+    rmdir(test_cgroup);
+    return failed ? 1 : 0; // what the engine did is in /tmp/shim_forks_wl.log
+}
@@ -0,0 +1,182 @@
+/**************************************************************************************
+ match_bench.c
+
+ Worst-case classification against adversarial whitelists and command lines.  Each
+ whitelist is compiled the way the shim does it (wl_load(), wl_compile()), then every
+ command line is classified (classify_cmdline()) BENCH_ROUNDS times:
+   overlap    1000 entries that are all prefixes, suffixes and substrings of one
+              another ('ab', 'aab', 'aaac', ... in every kind)
+   glob soup  globs that blow up a DFA ('~*a?????????????b*' and friends), which
+              the compiler has to turn away, among ordinary entries
+ and the command lines are long repetitive tokens, paths made of them, and shell
+ strings nested many levels deep.  Reports each whitelist's compile time and each
+ command line's worst and mean time, and fails if any single classification takes
+ longer than the budget (default 20000 us).  Every checked name is also logged to
+ /tmp/shim_forks_wl.log, as it is at fork time, so that's part of what's timed.
+
+ $ make -C bench match_bench && bench/match_bench [budget_us]
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <stdio.h>   // printf()
+
+#define BENCH_ROUNDS 20
+#define BENCH_BUDGET_US 20000
+#define BENCH_OVERLAP 25     // a-runs up to this long in the overlap whitelist...
+#define BENCH_LETTERS 10     // ...each ending in one of this many letters, in each of 4 kinds
+#define BENCH_NEST 200       // nesting depth of the shell strings
+
+struct bench_buf {
+    char *p;
+    size_t len, cap;
+};
+
+static void bench_put(struct bench_buf *b, const char *s, size_t n){
+    if(b->len + n + 1 > b->cap){
+        b->cap = (b->len + n + 1) * 2;
+        if((b->p = realloc(b->p, b->cap)) == NULL){
+            exit(1);
+        }
+    }
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+    b->p[b->len] = 0x00;
+}
+
+static void bench_puts(struct bench_buf *b, const char *s){
+    bench_put(b, s, strlen(s));
+}
+
+static void bench_repeat(struct bench_buf *b, const char *s, size_t times){
+    while(times-- > 0){
+        bench_puts(b, s);
+    }
+}
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Compile a whitelist from text (written to a scratch file, since wl_load() reads files); its
+// compile time in seconds, -1 if it couldn't be loaded.
+static double bench_whitelist(struct wl_rules *wl, const struct bench_buf *text){
+    char path[] = "/tmp/match_bench.XXXXXX";
+    int fd = mkstemp(path), ok;
+    double t;
+    ok = fd != -1 && write(fd, text->p, text->len) == (ssize_t)text->len;
+    if(fd != -1){
+        close(fd);
+        ok = ok && wl_load(wl, path) == 1;
+        unlink(path);
+    }
+    if(!ok){
+        return(-1);
+    }
+    t = bench_now();
+    wl->dfa = wl_compile(wl);
+    wl_exe_build(wl);
+    return wl->dfa != NULL ? bench_now() - t : -1;
+}
+
+int main(int argc, char **argv){
+    static const char *soup[] = {
+        "~*a?????????????b*", "~*a*b*c*d*e*f*g*h?", "~*[ab][ab][ab][ab][ab][ab][ab][ab][ab][ab][ab][ab]*",
+        "~*a??????????????????????????????b*", "~*?a?b?a?b?a?b?a?b?a?b*", "~*aaaa*aaaa*aaaa*aaaa*b",
+    };
+    struct bench_buf list[2] = { { 0 } }, line[6] = { { 0 } };
+    static const char *list_name[2] = { "overlap", "glob soup" };
+    static const char *line_name[6] = { "100 KB token 'aaa...'", "100 KB token 'abab...'", "100 KB path '/aaa/aaa...'",
+                                        "1 MB token 'aaa...b'", "nested sh -c, depth 200", "nested /bin/sh -c, depth 200" };
+    long budget = argc > 1 ? atol(argv[1]) : BENCH_BUDGET_US;
+    struct wl_rules wl;
+    char entry[BENCH_OVERLAP + 8], *buf;
+    double t, compile, worst, total, overall = 0;
+    int i, j, r, k, c, failed = 0;
+    size_t len = 0;
+    if(budget <= 0){
+        printf("usage: %s [budget_us]\n", argv[0]);
+        return(2);
+    }
+    // overlap: a^n followed by one of BENCH_LETTERS letters, in every kind, so a name of a's runs
+    // into a prefix, suffix or substring of nearly all of them at once
+    for(i = 1; i <= BENCH_OVERLAP; i++){
+        memset(entry, 'a', i);
+        for(c = 0; c < BENCH_LETTERS; c++){
+            entry[i] = 'b' + c;
+            for(k = 0; k < 4; k++){
+                static const char kind[4] = { 0, '!', '^', '$' };
+                char head[2] = { kind[k], 0x00 };
+                bench_puts(&list[0], head);
+                bench_put(&list[0], entry, i + 1);
+                bench_puts(&list[0], k == 0 ? " =tolerated\n" : "\n");
+            }
+        }
+    }
+    // glob soup: entries that multiply DFA states, between ordinary ones
+    for(i = 0; i < (int)(sizeof(soup) / sizeof(*soup)); i++){
+        bench_puts(&list[1], "!sshd\n^/usr/bin/\n$.rb =tolerated\n");
+        bench_puts(&list[1], soup[i]);
+        bench_puts(&list[1], "\n");
+    }
+    bench_repeat(&line[0], "a", 100000);
+    bench_repeat(&line[1], "ab", 50000);
+    bench_repeat(&line[2], "/aaaaaaa", 12500);
+    bench_repeat(&line[3], "a", 1 << 20);
+    bench_puts(&line[3], "b");
+    // sh -c "sh -c 'sh -c \"...\"'": argv is sh, -c and one long string
+    bench_puts(&line[4], "sh");
+    bench_put(&line[4], "", 1);
+    bench_puts(&line[4], "-c");
+    bench_put(&line[4], "", 1);
+    bench_repeat(&line[5], "/bin/sh -c '", BENCH_NEST);
+    for(k = 0; k < BENCH_NEST; k++){
+        bench_puts(&line[4], k % 2 ? "sh -c '" : "sh -c \"");
+    }
+    bench_puts(&line[4], "id");
+    bench_puts(&line[5], "id");
+    for(k = BENCH_NEST - 1; k >= 0; k--){
+        bench_puts(&line[4], k % 2 ? "'" : "\"");
+        bench_puts(&line[5], "'");
+    }
+    for(i = 0; i < 6; i++){
+        len = line[i].len > len ? line[i].len : len;
+    }
+    if((buf = malloc(len + SHIM_SCAN_PAD)) == NULL){
+        return(1);
+    }
+    printf("budget %ld us per classification, worst and mean of %d rounds\n", budget, BENCH_ROUNDS);
+    for(j = 0; j < 2; j++){
+        if((compile = bench_whitelist(&wl, &list[j])) < 0){
+            printf("%s: couldn't load the whitelist\n", list_name[j]);
+            return(1);
+        }
+        printf("%s: %zu entries, %u DFA states x %u byte classes, compiled in %.1f ms\n",
+               list_name[j], wl.nrules, wl.dfa->nstates, wl.dfa->nclasses, compile * 1e3);
+        for(i = 0; i < 6; i++){
+            worst = total = 0;
+            for(r = 0; r < BENCH_ROUNDS; r++){
+                memcpy(buf, line[i].p, line[i].len);
+                memset(buf + line[i].len, 0, SHIM_SCAN_PAD);
+                t = bench_now();
+                k = classify_cmdline(&wl, buf, line[i].len);
+                t = bench_now() - t;
+                worst = t > worst ? t : worst;
+                total += t;
+            }
+            overall = worst > overall ? worst : overall;
+            printf("  %-30s %9.1f us worst %9.1f us mean %7.2f ns/byte  %s%s\n", line_name[i], worst * 1e6,
+                   total / BENCH_ROUNDS * 1e6, worst * 1e9 / line[i].len, k == -1 ? "no match" : "matched",
+                   worst * 1e6 > budget ? "  OVER BUDGET" : "");
+            failed |= worst * 1e6 > budget;
+        }
+        wl_free(&wl);
+    }
+    printf("worst classification %.1f us: %s\n", overall * 1e6, failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,87 @@
+/**************************************************************************************
+ scan_bench.c
+
+ Times forkshimd's /proc scanner (forkshimd_scan()) over a host with N extra processes
+ (default 50000).  The processes are made with clone(CLONE_VM), sharing our memory, so
+ 50k of them cost little more than their kernel stacks; pid_max and threads-max may
+ need raising first (as root):
+ # echo 4194304 > /proc/sys/kernel/pid_max; echo 200000 > /proc/sys/kernel/threads-max
+
+ $ make -C bench scan_bench && bench/scan_bench [N]
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <sched.h>   // clone()
+#include <stdio.h>   // printf()
+
+#define BENCH_STACK 16384
+#define BENCH_ROUNDS 5
+
+static int bench_idle(void *arg){
+    (void)arg;
+    for(;;){
+        pause();
+    }
+    return(0);
+}
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    static const struct { unsigned int what; const char *name; } mode[] = {
+        { 0, "pids" },
+        { FORKSHIMD_SCAN_STAT, "stat" },
+        { FORKSHIMD_SCAN_STAT | FORKSHIMD_SCAN_STATM | FORKSHIMD_SCAN_SCORE, "stat+statm+score" },
+        { FORKSHIMD_SCAN_STAT | FORKSHIMD_SCAN_STATM | FORKSHIMD_SCAN_SCORE | FORKSHIMD_SCAN_CMDLINE, "stat+statm+score+cmdline" },
+    };
+    static struct forkshimd_procs ps;
+    long n = argc > 1 ? atol(argv[1]) : 50000, i, made;
+    char *stacks = mmap(NULL, n * BENCH_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pid_t *kids = malloc(n * sizeof(*kids));
+    size_t k, mine, bad;
+    double t, best;
+    int m, r;
+    if(stacks == MAP_FAILED || kids == NULL){
+        return(1);
+    }
+    for(made = 0; made < n; made++){
+        if((kids[made] = clone(bench_idle, stacks + (made + 1) * BENCH_STACK, CLONE_VM | SIGCHLD, NULL)) == -1){
+            printf("stopped at %ld processes: %s\n", made, strerror(errno));
+            break;
+        }
+    }
+    for(m = 0; m < (int)(sizeof(mode) / sizeof(mode[0])); m++){
+        for(r = 0, best = 1e9; r < BENCH_ROUNDS; r++){
+            t = bench_now();
+            if(forkshimd_scan(&ps, mode[m].what) == -1){
+                printf("scan failed\n");
+                return(1);
+            }
+            t = bench_now() - t;
+            best = t < best ? t : best;
+        }
+        printf("%-26s %7zu processes  %8.1f ms  %9.0f processes/s\n", mode[m].name, ps.n, best * 1e3, ps.n / best);
+    }
+    // the last snapshot has everything: our children should be there, as the kernel has them
+    for(k = 0, mine = 0, bad = 0; k < ps.n; k++){
+        if(ps.ppid[k] == getpid()){
+            mine++;
+            bad += ps.state[k] != 'S' || ps.cmdLen[k] == 0 || ps.rss[k] == 0;
+        }
+    }
+    printf("%zu of %ld children found, %zu with unexpected fields\n", mine, made, bad);
+    for(i = 0; i < made; i++){
+        kill(kids[i], SIGKILL);
+    }
+    while(wait(NULL) > 0){
+    }
+    return mine == (size_t)made && bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+/**************************************************************************************
+ startup_bench.c
+
+ What loading the shim costs a process that never forks: /bin/true started N times
+ (default 100000) with posix_spawn(), without the shim and with each shim given.
+ By default those are the two 'make' builds next to this program:
+   fork_shim_plain.so  built as the header used to say (no -O2, everything exported,
+                       -lstdc++ linked in)
+   fork_shim.so        the documented lean build (-fvisibility=hidden, libc only)
+ The runs are interleaved in blocks of 1000 so drift hits every build alike; each
+ build's best block is what's reported, per exec and against no shim.
+
+ $ make -C bench startup_bench && bench/startup_bench [N [shim.so...]]
+
+*************************************************************************************/
+
+#include <spawn.h>   // posix_spawn()
+#include <stdio.h>   // printf()
+#include <stdlib.h>  // atol(), realpath()
+#include <string.h>  // strcmp()
+#include <limits.h>  // PATH_MAX
+#include <time.h>    // clock_gettime()
+#include <sys/wait.h> // waitpid()
+
+#define BENCH_BLOCK 1000
+#define BENCH_SHIMS 8
+
+extern char **environ;
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Seconds to start and reap n /bin/true with env; -1 if one couldn't be started.
+static double bench_block(char **env, long n){
+    char *argv[] = { "/bin/true", NULL };
+    double t = bench_now();
+    int status;
+    pid_t pid;
+    long i;
+    for(i = 0; i < n; i++){
+        if(posix_spawn(&pid, argv[0], NULL, NULL, argv, env) != 0 || waitpid(pid, &status, 0) != pid ||
+           !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            return(-1);
+        }
+    }
+    return bench_now() - t;
+}
+
+int main(int argc, char **argv){
+    static char preload[BENCH_SHIMS][PATH_MAX + sizeof("LD_PRELOAD=")];
+    static char *env[BENCH_SHIMS + 1][256];
+    static const char *deflt[] = { "fork_shim_plain.so", "fork_shim.so" };
+    const char *name[BENCH_SHIMS + 1] = { "no shim" };
+    long n = argc > 1 ? atol(argv[1]) : 100000, done, block;
+    double best[BENCH_SHIMS + 1], t;
+    char path[PATH_MAX];
+    int nshim = argc > 2 ? argc - 2 : 2, s, e, k;
+    if(n <= 0 || nshim > BENCH_SHIMS){
+        printf("usage: %s [N [shim.so...]] (at most %d shims)\n", argv[0], BENCH_SHIMS);
+        return(2);
+    }
+    // every environment is ours without LD_PRELOAD, plus the shim's
+    for(s = 0; s <= nshim; s++){
+        for(e = k = 0; environ[e] != NULL && k < 254; e++){
+            if(strncmp(environ[e], "LD_PRELOAD=", sizeof("LD_PRELOAD=") - 1)){
+                env[s][k++] = environ[e];
+            }
+        }
+        if(s > 0){
+            name[s] = argc > 2 ? argv[s + 1] : deflt[s - 1];
+            if(realpath(name[s], path) == NULL){
+                printf("%s: not found\n", name[s]);
+                return(1);
+            }
+            snprintf(preload[s - 1], sizeof(preload[s - 1]), "LD_PRELOAD=%s", path);
+            env[s][k++] = preload[s - 1];
+        }
+        env[s][k] = NULL;
+        best[s] = 1e9;
+    }
+    printf("%ld execs of /bin/true each, in blocks of %d, best block\n", n, BENCH_BLOCK);
+    for(done = 0; done < n; done += block){
+        block = n - done < BENCH_BLOCK ? n - done : BENCH_BLOCK;
+        for(s = 0; s <= nshim; s++){
+            if((t = bench_block(env[s], block)) < 0){
+                printf("%s: /bin/true didn't start or exit cleanly\n", name[s]);
+                return(1);
+            }
+            best[s] = t / block < best[s] ? t / block : best[s];
+        }
+    }
+    for(s = 0; s <= nshim; s++){
+        printf("%-24s %7.1f us per exec", name[s], best[s] * 1e6);
+        if(s > 0){
+            printf(", %+.1f us against no shim", (best[s] - best[0]) * 1e6);
+        }
+        printf("\n");
+    }
+    return(0);
+}
@@ -0,0 +1,139 @@
+/**************************************************************************************
+ sweep_bench.c
+
+ What writing scores to many processes at once costs forkshimd, with and without its
+ io_uring (-u).  Forks N idle children (default 10000), then scores all of them the
+ way forkshimd_batch() does: oom_score_adj opened for each, queued (forkshimd_score())
+ and written (forkshimd_flush()), either
+   plain syscalls  a pwrite() and a close() per process
+   io_uring        write/close chains, FORKSHIMD_RING processes per io_uring_enter()
+ Each round gives every child a new score; the runs are interleaved, best of 5 is
+ reported per process, and each way is checked to have really left every child with
+ its score.  Last, for scale, a whole 'forkshimd -r' sweep of the children (reading,
+ classifying and scoring each against the installed whitelist) is timed once.  Where
+ io_uring isn't available (io_uring_disabled, seccomp) only the plain syscalls are run.
+
+ $ make -C bench sweep_bench && bench/sweep_bench [N]
+
+*************************************************************************************/
+
+#define main forkshimd_main
+#include "../fork_shim.c"
+#undef main
+
+#include <stdio.h>   // printf()
+#include <sys/wait.h> // waitpid()
+
+#define BENCH_ROUNDS 5
+
+enum { BENCH_PLAIN, BENCH_URING, BENCH_MODES };
+
+static double bench_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Give each of the n children score, as forkshimd does; how many got it, -1 if one couldn't be opened.
+static long bench_score_all(const pid_t *pid, long n, int score){
+    char name[sizeof("/oom_score_adj") + 10];
+    long i;
+    int fd;
+    for(i = 0; i < n; i++){
+        shim_format(name, sizeof(name), "%d/oom_score_adj", pid[i]);
+        if((fd = openat(forkshimd_procfd, name, O_RDWR | O_CLOEXEC)) == -1){
+            forkshimd_flush();
+            return(-1);
+        }
+        forkshimd_score(fd, score);
+    }
+    return forkshimd_flush();
+}
+
+// How many of the n children don't have score.
+static long bench_unscored(const pid_t *pid, long n, int score){
+    char name[sizeof("/oom_score_adj") + 10], buf[16];
+    long i, wrong = 0;
+    ssize_t got;
+    int fd;
+    for(i = 0; i < n; i++){
+        shim_format(name, sizeof(name), "%d/oom_score_adj", pid[i]);
+        got = -1;
+        if((fd = openat(forkshimd_procfd, name, O_RDONLY | O_CLOEXEC)) != -1){
+            got = pread(fd, buf, sizeof(buf) - 1, 0);
+            close(fd);
+        }
+        buf[got > 0 ? got : 0] = 0x00;
+        wrong += got <= 0 || atoi(buf) != score;
+    }
+    return wrong;
+}
+
+int main(int argc, char **argv){
+    static const char *name[BENCH_MODES] = { "plain syscalls", "io_uring" };
+    long n = argc > 1 ? atol(argv[1]) : 10000, i, children = 0, done;
+    double t, best[BENCH_MODES] = { 1e9, 1e9 };
+    int go[2], ring, modes, m, r, score, failed = 0;
+    pid_t *pid;
+    if(n <= 0 || (pid = malloc(n * sizeof(*pid))) == NULL){
+        printf("usage: %s [N]\n", argv[0]);
+        return(2);
+    }
+    if(pipe2(go, O_CLOEXEC) == -1 || forkshimd_proc_open() == -1){
+        return(1);
+    }
+    // the children wait for the pipe to close, then exit
+    for(; children < n; children++){
+        if((pid[children] = fork()) == 0){
+            char byte;
+            close(go[1]);
+            while(read(go[0], &byte, 1) == -1 && errno == EINTR){
+            }
+            _exit(0);
+        }
+        if(pid[children] == -1){
+            printf("only %ld children could be forked (RLIMIT_NPROC, pid_max?)\n", children);
+            failed = 1;
+            break;
+        }
+    }
+    forkshimd_ring_init();
+    ring = forkshimd_ring.fd;
+    modes = ring != -1 ? BENCH_MODES : 1;
+    if(ring == -1){
+        printf("no io_uring here, plain syscalls only\n");
+    }
+    printf("%ld processes, best of %d rounds\n", children, BENCH_ROUNDS);
+    for(r = 0; r < BENCH_ROUNDS && !failed; r++){
+        for(m = 0; m < modes; m++){
+            forkshimd_ring.fd = m == BENCH_URING ? ring : -1;
+            score = 500 + 2 * r + m; // a new score every time, so every write changes something
+            t = bench_now();
+            done = bench_score_all(pid, children, score);
+            t = bench_now() - t;
+            best[m] = t < best[m] ? t : best[m];
+            if(done != children || (r == 0 && bench_unscored(pid, children, score) > 0)){
+                printf("%s: %ld of %ld processes scored\n", name[m], done, children);
+                failed = 1;
+            }
+        }
+    }
+    forkshimd_ring.fd = ring;
+    for(m = 0; m < modes && !failed; m++){
+        printf("%-16s %7.2f us per process, %7.1f ms for all", name[m], best[m] / children * 1e6, best[m] * 1e3);
+        if(m > BENCH_PLAIN){
+            printf(", %.2fx plain", best[BENCH_PLAIN] / best[m]);
+        }
+        printf("\n");
+    }
+    if(!failed){
+        printf("for scale, ");
+        fflush(stdout);
+        failed = forkshimd_sweep_run(getpid(), INT_MIN, INT_MAX) != 0;
+    }
+    close(go[1]);
+    for(i = 0; i < children; i++){
+        waitpid(pid[i], NULL, 0);
+    }
+    return failed ? 1 : 0;
+}
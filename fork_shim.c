@@ -19,97 +19,1132 @@
  i.e. !sshd
  This will ensure only 'sshd' matches.  Keep substring and non substring syntax in
  mind when creating your whitelist file, as for they both have their use cases.
+ Finer grained entries are selected by their first character:
+   ^/usr/bin/     anchored prefix, the process/flag name starts with '/usr/bin/'
+   $.rb           anchored suffix, the process/flag name ends with '.rb'
+   ~/usr/bin/yum* shell glob ('*', '?', '[a-z]', '[!0-9]', '[[:digit:]]') matching the whole name
+ Arguments starting with '/' are checked as a full path (up to the first space)
+ as well as by their basename and flags.
+ Since argv[0] can be anything, entries starting with '@' match the executable
+ itself instead: '@/usr/sbin/sshd' that exact file, '@/opt/app/bin/' anything
+ below that directory.  The executable comes from the exec call's path (exec*()
+ are intercepted too, and classify the new program before it starts) or from
+ /proc/<pid>/exe for forks.
+ Entries may be any length; empty lines and lines starting with '#' are ignored.
+
+ Whitelisted entries get -1000 unless they name their own oom_score_adj value with a
+ trailing '=', either as a number or as one of the tiers:
+   disposable = 1000, tolerated = 300, important = -500, never-kill = -1000
+ i.e.
+   !sshd =never-kill
+   ruby =tolerated
+   java =-500
+ Forks that match nothing get 1000, or whatever a '%default <score>' line says.
+ Entries can also be limited to what a given program starts, and to whole subtrees:
+   parent:<exe|name>  only for processes forked or exec'd by that executable (full
+                      path), or by a process of that name (executable or script name)
+   tag:<tag>          whatever this entry matches, and everything below it, carries tag
+   lineage:<tag>      only for processes somewhere below one that was tagged so
+ i.e.
+   ~* parent:puppet tag:puppet-exec =disposable
+   !sshd lineage:puppet-exec =tolerated
+ Tags travel in the FORK_SHIM_LINEAGE environment variable, set on exec.  The
+ conditions are settled once per process when the whitelist is loaded, so they
+ don't cost anything per fork.
+ A program exec'd as never-kill (-1000) is started with FORK_SHIM_IMMUNE set, and
+ neither it nor anything below it is classified again: they all inherit -1000.  The
+ variable is only taken at its word by a process that really is at -1000.
+ 'cgroup:<dir>' also puts what an entry matches into that cgroup directory (relative
+ names are under /sys/fs/cgroup), say one with its own memory.high and memory.max
+ for everything disposable:
+   ~* parent:puppet cgroup:puppet/disposable =disposable
+ The directory has to exist already.  It's opened once per process and kept open,
+ and placing a fork is one write to its cgroup.procs.  The shim can't create the
+ child in it (clone3() with CLONE_INTO_CGROUP would bypass glibc's fork()), so a
+ fork is placed right after it's created, an exec before the program starts;
+ forkshimd -s starts its program straight in it.  forkshimd only places forks it
+ was handed by root, and forks that only get the default score under '%psi' (below)
+ aren't placed at all.
+
+ LD_PRELOAD normally reaches every descendant, so every 'sh', 'grep' and 'awk' below
+ puppet loads the shim and classifies its own children.  '%propagate <depth>' keeps
+ the shim for that many exec generations below the first process (the rest are still
+ scored, by their parent, but don't load the shim themselves).  An entry's own
+ 'propagate:<depth>' option ('none', a number or 'all') overrides it for what the
+ entry matches.  Never-kill programs are always started without the shim.
+ When several entries match, '@' executables win, then full ('!') matches, then
+ '@' directories, then anchored, then globs, then substring matches; among
+ equally specific entries the one listed first wins.
+ All entries are compiled into one DFA, so checking a name costs the same however
+ many entries there are, and classifying a fork is linear in its command line.
+ Globs that would make the DFA too large (think '~*a?????????????b*') are ignored
+ and logged when the whitelist is loaded, as are globs fnmatch() could never match
+ ('[[:digts:]]', a trailing '\') or only in some locales ('[[=e=]]', '[[.a.]]').
+
+ Teams that own different services can drop their own fragment files into
+ /etc/oom_whitelist.d/ instead of sharing /etc/oom_whitelist.  Fragments are read
+ in name order after /etc/oom_whitelist, and everything is merged into a single
+ de-duplicated index.  Files starting with '.' or ending with '~' are ignored.
+ Changes are picked up on the next fork; only the fragment that changed is re-read.
+ Threads can fork concurrently: a reload in progress never holds up forks in
+ other threads, which keep using the previous index until the new one is in.
+
+ FORKSHIMD:
+ Optionally, the forks can be classified by a daemon instead of inline.  When
+ forkshimd is listening on /run/forkshimd.sock, a shim's fork() hands the child over
+ with a single non-blocking send (its pid, a pidfd, and the command line and
+ executable the child inherited) and returns; forkshimd holds the compiled whitelist
+ and the caches, does the logging, and applies scores in batches.  It only sets a
+ score a process's own user could have set itself (or root: anything).  Whenever
+ forkshimd isn't running, or falls behind, the shim classifies inline as usual.
+ With -n, forkshimd also follows every fork, exec and exit on the host through the
+ netlink process connector (root, in the initial namespaces, CONFIG_PROC_EVENTS),
+ reads each exec'd program's command line once and scores it with the same rules,
+ 'parent:' and 'lineage:' included: it remembers what each process exec'd.  Events
+ the kernel had to drop (its receive buffer overran) are counted and logged.
+ With -u, scores are written through an io_uring, a whole batch per system call
+ (a write/close chain per process, on files opened as it goes), where the kernel
+ allows it.  procfs writes can't be done without blocking, so io_uring hands each
+ one to a worker thread: it's worth trying on hosts with cores to spare, not by
+ default (bench/sweep_bench measures it against plain syscalls).
+ forkshimd -r classifies every running process again with the whitelist as it is
+ now (or, given a pid, that process and everything below it), and exits; run it
+ after changing the whitelist, so long-running children don't keep scores from
+ before.  Processes already never-kill are left alone, and 'parent:' and 'lineage:'
+ are judged from the parent's program and FORK_SHIM_LINEAGE.
+ With -s, forkshimd runs a program instead, and catches every execve()/execveat() in
+ it and below it with a seccomp filter (SECCOMP_RET_USER_NOTIF), LD_PRELOAD or not:
+ static binaries and raw syscalls included.  Each exec waits while forkshimd reads
+ its argv and path out of the caller and sets its score, as the shim's exec*() would,
+ 'parent:' being the program that execs.  forkshimd -s returns the program's exit
+ status once nothing below it is left.  Run by anyone but root, setuid programs in
+ the tree don't gain privileges (the filter needs no_new_privs).
+ A '%psi <some|full> <stall ms> <window ms>' line in the whitelist, e.g. '%psi some
+ 150 1000', has forkshimd (as root) watch /proc/pressure/memory for that much stall
+ within a window.  While there is none, forks only get the default score, with no
+ classifying at all (execs still are), which forkshimd vouches for in
+ /dev/shm/forkshimd.pressure.  At the first sign of pressure, forks are classified
+ in full again and forkshimd classifies every process that still has the default
+ score; ten windows without pressure later, forks go back to the default.  If
+ forkshimd stops, forks are classified in full within a few seconds.
+ '%rebalance <low> <high> [ms]', e.g. '%rebalance 500 disposable', has forkshimd rank
+ every process whose score is within that band by resident size, every 5 s or that
+ many ms, and spread the band over them: the largest get the top, so the OOM killer
+ takes the biggest disposable child first and leaves the small ones running.  Put
+ the band above every entry's score that should keep its place.  Each pass starts
+ from the last ranking and writes only the scores that changed.
+ '%kill <percent> [grace ms] [score] [cgroup]', e.g. '%kill 5 2000 disposable', has
+ forkshimd act before the kernel's OOM killer would: whenever less than that much of
+ memory is available (MemAvailable; twice that while '%psi' reports pressure) it
+ sends SIGTERM to the process with the highest score, the largest of those, and
+ SIGKILL if it's still there after the grace period (2000 ms by default, 0 = SIGKILL
+ straight away); then the next one, until there's enough again.  Only processes
+ with at least that score (1000 by default) are candidates.  With a cgroup
+ directory, what's left below its memory.max (plus page cache it can drop) is what
+ counts, and only processes in it or below it are candidates.
 
 
  HOW TO COMPILE:
- $ gcc -fPIC -c -Wall fork_shim.c
- $ gcc -shared fork_shim.o -ldl -lstdc++ -o fork_shim.so
+ $ gcc -O2 -fPIC -fvisibility=hidden -Wall -c fork_shim.c
+ $ gcc -shared -Wl,-O1,--as-needed fork_shim.o -ldl -o fork_shim.so
+ and, if wanted, the daemon (the same source, without the interposers):
+ $ gcc -O2 -Wall -DFORKSHIMD fork_shim.c -ldl -o forkshimd
+ Every process below the one started with LD_PRELOAD loads this, so it's kept lean:
+ plain C with nothing but libc, no stdio, and only the interposed calls exported
+ (check with 'nm -D --defined-only fork_shim.so').  Leave -fno-plt out: it binds all
+ of the shim's libc calls when the library is loaded instead of on first use, which
+ most processes (those that never fork or exec) never get to.
+ Benchmarks live in bench/: 'make -C bench' builds them, 'make -C bench run' runs them,
+ and 'make -C bench test' (as root) runs the test harnesses there.
 
  USAGE:
  # LD_PRELOAD=/path/to/fork_shim.so /opt/puppetlabs/bin/puppet agent -t
+ # /path/to/forkshimd &     (optional, as root; stays in the foreground)
+ # /path/to/forkshimd -n &  (the same, and also classify every exec on the host,
+                             LD_PRELOAD or not: static binaries, setuid programs,
+                             anything outside puppet's tree)
+ # /path/to/forkshimd -r [pid]  (after changing the whitelist)
+ # /path/to/forkshimd -s /opt/puppetlabs/bin/puppet agent -t
+                            (puppet and everything below it, without LD_PRELOAD)
 
  LOG FILES:
- /tmp/shim_forks_wl.log  [will detail the process (and flags) being checked for]
+ /tmp/shim_forks_wl.log  [will detail the process (and flags) being checked for, index
+                          rebuilds, ignored entries and each process's worst classification time]
  /tmp/shim_forks.log     [will detail the process IDs being checked]
+ /dev/shm/fork_shim.stats [counters shared by all of root's processes (other users' go to
+                          /dev/shm/fork_shim.stats.<uid>): forks and execs classified,
+                          those skipped below never-kill processes and execs started
+                          without the shim, forks handed to forkshimd, process event
+                          overruns and processes swept; kept in 64 shards of 8 counters
+                          so forking threads don't contend, add them up with
+                          od -v -An -tu8 -w64 /dev/shm/fork_shim.stats |
+                          awk '{for(i=1;i<=8;i++)s[i]+=$i}END{for(i=1;i<=8;i++)printf "%s ",s[i];print ""}']
 
  Author: Cody Tubbs (codytubbs@gmail.com) Sep 2017
 
 *************************************************************************************/
 
-#include <dlfcn.h>   // dlsym()
-#include <stdio.h>   // FILE, fopen(), fprintf(), fclose(), snprintf(), fgets()
-#include <string.h>  // strrchr(), strlen(), strstr(), strtok()
-#include <unistd.h>  // access()
-#include <stdlib.h>  // free()
-
-int check_wl_config(const char *proc_name);
-
-pid_t fork(void){
-    FILE *logFile = fopen("/tmp/shim_forks.log", "a"); // Location for debugging list of pids.
-    int oomValue = 1000;        // define as highest value for oom_score_adj ... death row
-    int whitelistValue = -1000; // define as lowest value for oom_score_adj ... never kill
-    char fileName[25+1];    // max pid is 65535; (i.e. /proc/65535/oom_score_adj) = len 25
-    char cmdFileName[19+1]; // max pid is 65535; (i.e. /proc/65535/cmdline) = len 19
-    typedef pid_t (*t_fork)(void);
-    t_fork org_fork = dlsym(((void *) -1l), "fork");
-    pid_t pid = org_fork();
-    if(pid != 0){
-        fprintf(logFile, "pid = %i\n", pid); // tmp during dev
-        fclose(logFile); // ''
-    } else {
+#define _GNU_SOURCE  // dladdr(), struct ucred, recvmmsg()
+#include <dlfcn.h>   // dlsym(), dladdr()
+#include <stdarg.h>  // va_list
+#include <string.h>  // strrchr(), strlen(), strstr(), strtok(), memchr()
+#include <fnmatch.h> // fnmatch()
+#include <unistd.h>  // access(), read(), close()
+#include <stdlib.h>  // malloc(), realloc(), free()
+#include <stdint.h>  // uint64_t
+#include <fcntl.h>   // open()
+#include <dirent.h>  // opendir(), readdir()
+#include <limits.h>  // NAME_MAX, PATH_MAX
+#include <time.h>    // clock_gettime()
+#include <sys/stat.h> // fstat()
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2/AVX2 intrinsics for the delimiter scanner
+#endif
+#include <sys/inotify.h> // inotify_init1(), inotify_add_watch()
+#include <sys/prctl.h>   // prctl(PR_GET_NAME)
+#include <sys/mman.h>    // mmap()
+#include <sched.h>       // sched_yield()
+#include <sys/syscall.h> // SYS_gettid, SYS_pidfd_open
+#include <sys/socket.h>  // forkshimd's socket
+#include <sys/un.h>      // struct sockaddr_un
+#include <poll.h>        // poll()
+#include <errno.h>       // EAGAIN
+#include <signal.h>      // sigaction()
+#include <pthread.h>     // pthread_atfork(), pthread_mutex_lock()
+#ifdef FORKSHIMD
+#include <sys/epoll.h>        // epoll_wait()
+#include <linux/netlink.h>    // struct sockaddr_nl
+#include <linux/connector.h>  // struct cn_msg
+#include <linux/cn_proc.h>    // struct proc_event
+#include <linux/seccomp.h>    // SECCOMP_RET_USER_NOTIF
+#include <linux/filter.h>     // struct sock_filter
+#include <linux/audit.h>      // AUDIT_ARCH_*
+#include <sys/ioctl.h>        // ioctl(SECCOMP_IOCTL_NOTIF_RECV)
+#include <sys/uio.h>          // process_vm_readv()
+#include <sys/wait.h>         // waitpid()
+#include <linux/io_uring.h>   // struct io_uring_sqe
+#include <linux/sched.h>      // struct clone_args, CLONE_INTO_CGROUP
+#if defined(__x86_64__)
+#define FORKSHIMD_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define FORKSHIMD_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__i386__)
+#define FORKSHIMD_AUDIT_ARCH AUDIT_ARCH_I386
+#endif
+#endif
+
+// Build with -fvisibility=hidden: the interposed calls are all the shim exports.
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+#define WL_FILE     "/etc/oom_whitelist"
+#define WL_FILE_DIR "/etc"
+#define WL_DIR      "/etc/oom_whitelist.d" // per-team fragments, merged into the index after WL_FILE
+
+#define WL_SCORE_DEFAULT 1000  // oom_score_adj for anything no rule matched ... death row
+#define WL_SCORE_RULE   -1000  // oom_score_adj for entries that don't name their own ... never kill
+#define WL_SCORE_NEVER_KILL -1000 // the OOM killer leaves these alone, and their children inherit it
+
+#define WL_DFA_MAX_CELLS (1 << 20) // transition table budget (states x byte classes) of the compiled whitelist
+#define SHIM_SCAN_PAD 32           // readable slack after any buffer handed to shim_scan_delim()
+#define WL_BLOOM_BITS_PER_KEY 12   // blocked Bloom filter sizing, ~1% false positives
+#define WL_BLOOM_K 6               // bits set per key, all within one 64-byte block
+#define WL_BLOOM_LENS 8            // distinct anchored entry lengths probed per name; more turns the filter off
+#define WL_BLOOM_KIND(k) ((k) == WL_EXACT || (k) == WL_PREFIX || (k) == WL_SUFFIX)
+#define WL_PREFILTER_MIN 64        // shorter names just walk the DFA, it's cheaper than the prefilters (bench/kernel_bench)
+#define WL_GLOB_BAD ((size_t)-1)  // a '~' entry's bracket fnmatch() fails on, see wl_glob_class()
+#define WL_NONE 0xffffffffu        // arena offset of an option that wasn't given
+
+#define SHIM_ENV_LINEAGE "FORK_SHIM_LINEAGE" // ':' separated tags of the rules that started our ancestors
+#define SHIM_LINEAGE_MAX 1024
+#define SHIM_ENV_IMMUNE  "FORK_SHIM_IMMUNE"  // set below a never-kill process, which isn't classified again
+#define SHIM_STATS_FILE  "/dev/shm/fork_shim.stats"
+#define SHIM_STATS_SHARDS 64       // per-thread counter shards in SHIM_STATS_FILE, summed by whoever reads it
+#define SHIM_PRESSURE_FILE "/dev/shm/forkshimd.pressure" // root's forkshimd says here when forks can skip classifying
+#ifndef SHIM_L1_WAYS
+#define SHIM_L1_WAYS 8             // recent fork() decisions each thread remembers; 0 remembers none
+#endif
+#define SHIM_CGROUPS 16            // 'cgroup:' directories a process keeps open
+#define SHIM_CGROUP_ROOT "/sys/fs/cgroup" // where 'cgroup:' directories that aren't absolute are
+#define FORKSHIMD_SOCK "/run/forkshimd.sock" // where forkshimd listens; without it shims classify inline
+#define FORKSHIMD_MAGIC 0x31445346u // "FSD1", first word of every record
+#define FORKSHIMD_ARGV_MAX 4096    // command lines longer than this are classified inline
+#define FORKSHIMD_RETRY 1          // seconds a shim waits before trying to reach forkshimd again
+#define FORKSHIMD_BATCH 64         // records forkshimd takes off a connection at once
+#define FORKSHIMD_CONTEXTS 32      // per-program indexes forkshimd keeps for 'parent:'/'lineage:' entries
+#define FORKSHIMD_CONTEXT_WAYS 4   // ...in sets of this many
+#define FORKSHIMD_CACHE 4096       // decisions forkshimd remembers
+#define FORKSHIMD_RING FORKSHIMD_BATCH // scores forkshimd writes per io_uring_enter(), two linked SQEs each
+#define FORKSHIMD_SWEEP_ARGV (32 << 10) // command line bytes a sweep looks at per process
+#define FORKSHIMD_SWEEP_WORKERS 16 // most threads a sweep uses
+#define FORKSHIMD_SCAN_STAT    0x1 // the /proc scanner reads ppid, state and start time,
+#define FORKSHIMD_SCAN_STATM   0x2 // resident pages,
+#define FORKSHIMD_SCAN_SCORE   0x4 // oom_score_adj,
+#define FORKSHIMD_SCAN_CMDLINE 0x8 // and the command line (FORKSHIMD_SWEEP_ARGV bytes at most)
+#define FORKSHIMD_IMAGES 16384     // distinct programs (and lineages) forkshimd -n tells apart at once
+#define FORKSHIMD_RCVBUF (16 << 20) // process connector receive buffer: room for a fork storm
+#define FORKSHIMD_IMAGE_NONE 0     // nothing known about what a process is (or nothing to know)
+#define FORKSHIMD_IMAGE_IMMUNE 1   // below a never-kill program, not classified again
+#define FORKSHIMD_PSI_FILE "/proc/pressure/memory"
+#define FORKSHIMD_PSI_TICK 1000    // ms between forkshimd's "still calm" heartbeats
+#define FORKSHIMD_PSI_CALM 3       // seconds a heartbeat lasts, so a dead forkshimd soon stops vouching
+#define FORKSHIMD_PSI_HOLD 10      // windows without a pressure event before forks go back to the default
+#define FORKSHIMD_RANK_MS 5000     // '%rebalance' interval when the line doesn't give one
+#define FORKSHIMD_KILL_TICK 100    // ms between looks at available memory with a '%kill' line
+#define FORKSHIMD_KILL_GRACE 2000  // ms a '%kill' victim has between SIGTERM and SIGKILL by default
+#define SHIM_ENV_PROPAGATE "FORK_SHIM_PROPAGATE" // exec generations below us that still get the shim preloaded
+#define SHIM_PRELOAD_MAX 4096      // longest LD_PRELOAD we'll take ourselves out of
+#define WL_PROPAGATE_ALL INT_MAX   // no limit on LD_PRELOAD propagation
+#define WL_PROPAGATE_NONE -1       // take the shim out of LD_PRELOAD on exec
+
+// How an entry is matched against a proc/flag name, selected by its first character.
+// The order is also the specificity order used when several entries match.
+enum wl_kind {
+    WL_EXE,     // '@/path' the executable is /path
+    WL_EXACT,   // '!name'  name == token
+    WL_EXE_DIR, // '@/dir/' the executable lives somewhere below /dir/
+    WL_PREFIX, // '^text'  token starts with text
+    WL_SUFFIX, // '$text'  token ends with text
+    WL_GLOB,   // '~glob'  token matches the shell glob (*, ?, [...]) as a whole
+    WL_SUBSTR, // 'text'   token is a substring of text (the original behaviour)
+};
+
+// Trailing 'name:value' options of an entry, besides its '=score'.
+enum wl_opt {
+    WL_OPT_PARENT,  // 'parent:sshd'  only for what a process with that exe/name forks or execs
+    WL_OPT_LINEAGE, // 'lineage:tag'  only below a process started by a rule with 'tag:tag'
+    WL_OPT_TAG,     // 'tag:tag'      what this rule matches, and everything it starts, carries tag
+    WL_OPT_PROPAGATE, // 'propagate:N' what this rule matches keeps the shim for N more exec generations
+    WL_OPT_CGROUP,  // 'cgroup:dir'   what this rule matches goes into that cgroup (v2)
+    WL_NOPTS
+};
+
+// One whitelist entry.  The text itself lives in the rule set's arena.
+struct wl_rule {
+    unsigned int off;    // offset of the NUL terminated entry within the arena
+    unsigned int len;    // entry length, without the leading bang, score or the terminator
+    unsigned int opt[WL_NOPTS]; // arena offsets of the NUL terminated option values, WL_NONE = not given
+    short score;         // oom_score_adj to apply when this rule wins
+    unsigned char kind;  // enum wl_kind
+    unsigned char active; // the parent/lineage conditions hold for this process (merged index only)
+};
+
+// All entries of the merged index compiled together into one minimized DFA.  Matching walks one
+// flat transition table per input byte, whatever the number of entries.
+struct wl_dfa {
+    // Teddy-style prefilter for substring and glob entries: nibble masks over a name's first 3
+    // bytes, one bucket bit per group of entries.  Masks that AND to zero rule all of those out.
+    unsigned char pf_lo[3][16], pf_hi[3][16];
+    // Blocked Bloom filter over exact and anchored entries: the hashes of whole names, of name
+    // prefixes and suffixes of the anchored entries' lengths.  Names neither filter lets through
+    // are rejected without walking the DFA.
+    uint64_t *bloom;                  // bloom_blocks blocks of 8 words (one cache line each)
+    unsigned int bloom_blocks, bloom_keys;
+    unsigned char bloom_mode;         // 0 = no such entries, 1 = filter, 2 = can't filter (too many lengths)
+    unsigned char bloom_exact;        // any exact entries, so whole names need probing
+    unsigned char npre, nsuf;         // distinct prefix/suffix entry lengths, ascending
+    unsigned int pre_len[WL_BLOOM_LENS], suf_len[WL_BLOOM_LENS];
+    unsigned int bloom_fpr;           // measured false-positive rate, in 1/10000ths
+    unsigned char cls[256];  // byte -> equivalence class; bytes no entry tells apart share one
+    unsigned int nclasses;
+    unsigned int nstates;    // state 0 is the dead state
+    unsigned int start;
+    unsigned int *next;      // next[state * nclasses + cls[byte]]
+    int *accept;             // winning rule for input ending in each state, -1 = none
+};
+
+// All whitelist entries, in file order, backed by a single contiguous string arena.
+struct wl_rules {
+    char *arena;
+    size_t arena_len;
+    struct wl_rule *rule;
+    size_t nrules, rules_cap;
+    int default_score;   // oom_score_adj when no rule matches
+    int has_default;     // default_score came from a '%default' line
+    int propagate;       // exec generations that get the shim preloaded, WL_PROPAGATE_ALL = no limit
+    int has_propagate;   // propagate came from a '%propagate' line
+    int psi_full;        // '%psi full': every task stalled, not just some
+    unsigned int psi_stall_ms, psi_window_ms; // '%psi' trigger, 0 = classify every fork
+    int rank_low, rank_high;   // '%rebalance' band, spread by resident size
+    unsigned int rank_ms;      // ...every this often, 0 = not at all
+    unsigned int kill_pct;     // '%kill': below this % of memory available, signal a victim, 0 = never
+    unsigned int kill_grace_ms; // SIGTERM to SIGKILL
+    int kill_score;            // lowest score a victim can have
+    char kill_cgroup[256];     // only watch (and pick from) this cgroup and below, "" = the host
+    struct wl_dfa *dfa;  // compiled matcher, merged index only (NULL = scan the rules)
+    struct wl_exe_node *exe; // path trie of the '@' entries, merged index only
+    unsigned int nexe;
+    unsigned int nconditional; // entries with 'parent:' or 'lineage:', merged index only
+};
+
+// Path trie node for executable entries; a directory entry like '@/opt/app/bin/' costs one walk
+// down the trie however many other entries share its prefix.
+struct wl_exe_node {
+    unsigned int off, len;       // path component, in the index arena
+    unsigned int child, sibling; // node indices, 0 = none (node 0 is the root, never a child)
+    int exact;                   // rule naming exactly this path, -1 = none
+    int dir;                     // rule covering everything below this path, -1 = none
+};
+
+// One source of rules: WL_FILE itself (empty name) or a fragment in WL_DIR.
+struct wl_fragment {
+    char name[NAME_MAX+1];
+    struct wl_rules rules;
+    int stale;             // changed on disk since it was last parsed
+    int seen;              // wl_rescan(): still there
+    struct {               // the file as it was when parsed, all 0 = wasn't there
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+    } id;
+};
+
+int wl_load(struct wl_rules *wl, const char *fileName);
+void wl_free(struct wl_rules *wl);
+const struct wl_rules *wl_current(int watch, unsigned int *ticket);
+void wl_release(unsigned int ticket);
+static void wl_refresh(int watch);
+static const struct wl_rules *wl_enter(unsigned int *ticket);
+#ifndef FORKSHIMD
+static unsigned int wl_epoch(void);
+static int wl_published(void);
+#endif
+int wl_pick(const struct wl_rules *wl, int a, int b);
+int check_wl_config(const struct wl_rules *wl, const char *proc_name, size_t len);
+char *read_cmdline(const char *fileName, size_t *len);
+int classify_cmdline(const struct wl_rules *wl, char *buf, size_t len);
+int check_wl_exe(const struct wl_rules *wl, const char *exe, size_t len);
+int write_score(const char *fileName, int score);
+const char *shim_scan_delim(const char *p, size_t n);
+struct wl_dfa *wl_compile(const struct wl_rules *wl);
+void wl_dfa_free(struct wl_dfa *dfa);
+void wl_exe_build(struct wl_rules *wl);
+
+extern char **environ;
+
+static int wl_parse_propagate(const char *s, size_t len, int *depth);
+static int wl_glob_ok(const char *p, size_t len);
+
+// A small snprintf() for what the shim formats: %s, %.*s, %c, %d/%i/%u with an optional l or z and
+// zero padded width, and %%.  Like snprintf() it returns the length the whole output would have.
+// Keeps stdio (and its FILE buffers and locks) out of the shim altogether.
+static int shim_vformat(char *buf, size_t size, const char *fmt, va_list ap){
+    size_t n = 0;
+    char num[24], c_;
+    const char *str;
+    int len, width, prec;
+    // c is evaluated even once buf is full: it's num[--len] or va_arg() in places
+#define SHIM_PUT(c) do { c_ = (c); if(n + 1 < size){ buf[n] = c_; } n++; } while(0)
+    for(; *fmt; fmt++){
+        unsigned long v;
+        int neg = 0, pad = 0;
+        if(*fmt != '%'){
+            SHIM_PUT(*fmt);
+            continue;
+        }
+        fmt++;
+        width = 0;
+        prec = -1;
+        if(*fmt == '0'){
+            pad = 1;
+            fmt++;
+        }
+        for(; *fmt >= '0' && *fmt <= '9'; fmt++){
+            width = width * 10 + (*fmt - '0');
+        }
+        if(fmt[0] == '.' && fmt[1] == '*'){
+            prec = va_arg(ap, int);
+            fmt += 2;
+        }
+        switch(*fmt){
+        case 's':
+            str = va_arg(ap, const char *);
+            for(len = 0; str[len] && (prec < 0 || len < prec); len++){
+                SHIM_PUT(str[len]);
+            }
+            continue;
+        case 'c':
+            SHIM_PUT((char)va_arg(ap, int));
+            continue;
+        case '%':
+            SHIM_PUT('%');
+            continue;
+        case 'l':
+        case 'z':
+            fmt++;
+            if(*fmt == 'd' || *fmt == 'i'){
+                long l = va_arg(ap, long);
+                neg = l < 0;
+                v = neg ? -(unsigned long)l : (unsigned long)l;
+            } else {
+                v = va_arg(ap, unsigned long);
+            }
+            break;
+        case 'd':
+        case 'i':
+            len = va_arg(ap, int);
+            neg = len < 0;
+            v = neg ? -(unsigned long)len : (unsigned long)len;
+            break;
+        case 'u':
+            v = va_arg(ap, unsigned int);
+            break;
+        default:
+            return(-1); // not something the shim formats
+        }
+        len = 0;
+        do {
+            num[len++] = '0' + v % 10;
+            v /= 10;
+        } while(v != 0);
+        if(neg){
+            SHIM_PUT('-');
+            width--;
+        }
+        for(; width > len; width--){
+            SHIM_PUT(pad ? '0' : ' ');
+        }
+        while(len > 0){
+            SHIM_PUT(num[--len]);
+        }
+    }
+#undef SHIM_PUT
+    if(size > 0){
+        buf[n < size ? n : size - 1] = 0x00;
+    }
+    return n;
+}
+
+static int shim_format(char *buf, size_t size, const char *fmt, ...){
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = shim_vformat(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// Append one formatted line to a log file, in a single write() so lines from different processes
+// don't interleave.  Long lines are cut short.
+static void shim_log(const char *fileName, const char *fmt, ...){
+    char buf[4096];
+    va_list ap;
+    int n, fd;
+    va_start(ap, fmt);
+    n = shim_vformat(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n < 0 || (fd = open(fileName, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1){
+        return;
+    }
+    if((size_t)n >= sizeof(buf)){
+        n = sizeof(buf) - 1;
+        buf[n - 1] = '\n';
+    }
+    if(write(fd, buf, n) != n){
+        // nothing to be done about a short log line
+    }
+    close(fd);
+}
+
+// Who we are, for the 'parent:' and 'lineage:' conditions: anything we fork or exec is our child.
+// That can't change before the next exec, so it's worked out once, by shim_init().
+static struct {
+    int immune;                        // we were started never-kill; so is everything we start
+    char exe[PATH_MAX];                // /proc/self/exe
+    const char *base;                  // its basename
+    char comm[16];                     // our process name; for scripts, the script's name
+    char lineage[SHIM_LINEAGE_MAX];    // SHIM_ENV_LINEAGE we were started with, "" = none
+    int propagate;                     // SHIM_ENV_PROPAGATE we were started with, -1 = none
+} shim_self;
+
+static void shim_self_init(void){
+    const char *env = getenv(SHIM_ENV_LINEAGE);
+    ssize_t n;
+    if((n = readlinkat(AT_FDCWD, "/proc/self/exe", shim_self.exe, sizeof(shim_self.exe) - 1)) < 0){
+        n = 0;
+    }
+    shim_self.exe[n] = 0x00;
+    shim_self.base = strrchr(shim_self.exe, '/') ? strrchr(shim_self.exe, '/') + 1 : shim_self.exe;
+    if(prctl(PR_GET_NAME, shim_self.comm, 0, 0, 0) == -1){
+        shim_self.comm[0] = 0x00;
+    }
+    if(env != NULL && strlen(env) < sizeof(shim_self.lineage)){
+        strcpy(shim_self.lineage, env);
+    }
+    if(getenv(SHIM_ENV_IMMUNE) != NULL){
+        // only if it's so: anyone can set the variable, and skip classifying what they start
+        char num[16];
+        int fd = open("/proc/self/oom_score_adj", O_RDONLY | O_CLOEXEC);
+        n = fd == -1 ? -1 : pread(fd, num, sizeof(num) - 1, 0);
+        if(fd != -1){
+            close(fd);
+        }
+        num[n > 0 ? n : 0] = 0x00;
+        shim_self.immune = n > 0 && atoi(num) == WL_SCORE_NEVER_KILL;
+    }
+    shim_self.propagate = -1;
+    if((env = getenv(SHIM_ENV_PROPAGATE)) != NULL && !wl_parse_propagate(env, strlen(env), &shim_self.propagate)){
+        shim_self.propagate = -1;
+    }
+}
+
+typedef pid_t (*t_fork)(void);
+typedef int (*t_execve)(const char *, char *const [], char *const []);
+typedef int (*t_execv)(const char *, char *const []);
+typedef const char *(*t_scan_delim)(const char *p, size_t n);
+
+static const char *scan_delim_scalar(const char *p, size_t n);
+static t_scan_delim pick_scan_delim(void);
+
+// What the interposers need before they can do anything: the calls they wrap, the delimiter
+// scanner for this CPU, our own file name and shim_self.  Set up by the first interposed call
+// rather than at load time (there is no constructor, and no ifunc), since most processes that
+// inherit the shim never fork or exec at all.
+static struct {
+    t_fork fork, vfork;
+    t_execve execve, execvpe;
+    t_execv execv, execvp;
+    t_scan_delim scan_delim;
+    const char *self;          // the shim's file name, as LD_PRELOAD would have it; NULL = unknown
+} shim_real = { .scan_delim = scan_delim_scalar };
+
+static int shim_once; // 0 = not set up, 1 = a thread is setting it up, 2 = ready
+
+static void shim_atfork_prepare(void);
+static void shim_atfork_parent(void);
+static void shim_atfork_child(void);
+
+// Lock-free once: the thread that moves shim_once from 0 to 1 sets everything up, anyone racing it
+// waits the few microseconds that takes.  Afterwards it's a single acquire load.
+static void shim_init(void){
+    int state = __atomic_load_n(&shim_once, __ATOMIC_ACQUIRE);
+    if(state == 2){
+        return;
+    }
+    if(state == 0 && __atomic_compare_exchange_n(&shim_once, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+        Dl_info info;
+        shim_real.fork = (t_fork)dlsym(((void *) -1l), "fork");
+        shim_real.vfork = (t_fork)dlsym(((void *) -1l), "vfork");
+        shim_real.execve = (t_execve)dlsym(((void *) -1l), "execve");
+        shim_real.execvpe = (t_execve)dlsym(((void *) -1l), "execvpe");
+        shim_real.execv = (t_execv)dlsym(((void *) -1l), "execv");
+        shim_real.execvp = (t_execv)dlsym(((void *) -1l), "execvp");
+        shim_real.scan_delim = pick_scan_delim();
+        if(dladdr((void *)shim_init, &info) && info.dli_fname != NULL){
+            shim_real.self = strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+        }
+        shim_self_init();
+        pthread_atfork(shim_atfork_prepare, shim_atfork_parent, shim_atfork_child);
+        __atomic_store_n(&shim_once, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    while(__atomic_load_n(&shim_once, __ATOMIC_ACQUIRE) != 2){
+        sched_yield();
+    }
+}
+
+// Counters shared by every process running the shim, mapped from SHIM_STATS_FILE: SHIM_STATS_SHARDS
+// of these back to back, one cache line each, and a thread only ever adds to the one its tid picks.
+// The totals are the per-field sums over all shards (see LOG FILES above); the fields are in this order.
+struct shim_stats {
+    uint64_t forks_classified;
+    uint64_t execs_classified;
+    uint64_t forks_immune;     // forks by a never-kill process, not classified
+    uint64_t execs_immune;     // execs by a never-kill process, not classified
+    uint64_t execs_stripped;   // execs started without the shim preloaded
+    uint64_t forks_delegated;  // forks handed to forkshimd (which counts them in forks_classified)
+    uint64_t proc_overruns;    // times forkshimd -n found process events dropped (ENOBUFS)
+    uint64_t procs_swept;      // running processes forkshimd -r classified again
+} __attribute__((aligned(64)));
+
+// Per-thread state, so threads forking at once don't keep pulling the same cache lines off each other.
+// Initial-exec: the shim is preloaded, so its TLS is in the static block and needs no lookup.
+static __thread struct {
+    int shard;                 // stats shard + 1, 0 = not picked yet
+    pid_t vfork_parent;        // our pid when we last vfork()ed; a child sharing this sees its parent's
+    unsigned int gen;          // wl_state.epoch + 1 the decisions below were made against, 0 = none
+    const struct wl_rules *idx; // ...and the index that was
+    int exe_rules;             // that index has '@' entries, so the executable is part of the key
+    unsigned int used, next;
+    struct {
+        uint64_t key;          // hash of the command line (and executable)
+        int score;
+        int cgroup;            // shim_cgroup slot, -1 = none
+    } way[SHIM_L1_WAYS > 0 ? SHIM_L1_WAYS : 1];
+} shim_tls __attribute__((tls_model("initial-exec")));
+
+#define SHIM_STATS_SIZE (SHIM_STATS_SHARDS * sizeof(struct shim_stats))
+
+static void *shim_stats_ptr; // NULL = not tried yet, MAP_FAILED = not available
+
+// The shared counters, mapped on first use: SHIM_STATS_FILE for root, SHIM_STATS_FILE.<uid> for
+// anyone else.  NULL if that can't be opened, or isn't a regular file of our own (/dev/shm is anyone's
+// to create files in, so it could be a link, or somebody else's counters).  The space is allocated
+// up front: a sparse file on a full tmpfs would SIGBUS the first counter that lands on a new page.
+// The mapping survives fork(), so children count into the same file.  Threads racing to map it all
+// try; the first to publish its mapping wins, the others unmap theirs.
+static struct shim_stats *shim_stats(void){
+    void *p = __atomic_load_n(&shim_stats_ptr, __ATOMIC_ACQUIRE), *expect = NULL;
+    char path[sizeof(SHIM_STATS_FILE) + 12];
+    uid_t uid = geteuid();
+    struct stat st;
+    int fd;
+    if(p != NULL){
+        return p == MAP_FAILED ? NULL : p;
+    }
+    shim_format(path, sizeof(path), uid == 0 ? SHIM_STATS_FILE : SHIM_STATS_FILE ".%u", (unsigned int)uid);
+    if((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)) != -1){
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == uid &&
+           (st.st_size >= (off_t)SHIM_STATS_SIZE || posix_fallocate(fd, 0, SHIM_STATS_SIZE) == 0)){
+            p = mmap(NULL, SHIM_STATS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    p = p != NULL ? p : MAP_FAILED;
+    if(!__atomic_compare_exchange_n(&shim_stats_ptr, &expect, p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        if(p != MAP_FAILED){
+            munmap(p, SHIM_STATS_SIZE);
+        }
+        p = expect;
+    }
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// This thread's shard of the shared counters.  Threads of one process, and processes started one
+// after the other, get consecutive tids and so different shards.
+static struct shim_stats *shim_stats_shard(void){
+    struct shim_stats *st = shim_stats();
+    if(st == NULL){
+        return NULL;
+    }
+    if(shim_tls.shard == 0){
+        shim_tls.shard = (int)((unsigned long)syscall(SYS_gettid) % SHIM_STATS_SHARDS) + 1;
+    }
+    return st + shim_tls.shard - 1;
+}
+
+#define SHIM_COUNT_N(field, n) do { \
+        struct shim_stats *st_ = shim_stats_shard(); \
+        if(st_ != NULL){ \
+            __atomic_fetch_add(&st_->field, (n), __ATOMIC_RELAXED); \
+        } \
+    } while(0)
+#define SHIM_COUNT(field) SHIM_COUNT_N(field, 1)
+
+// SHIM_PRESSURE_FILE: forkshimd, watching memory pressure for a '%psi' line, keeps moving calm_until
+// ahead while there is none.  Forks before then only get calm_score; once pressure shows up it stops,
+// sweeps what still has that score, and forks are classified in full until it's calm again.
+struct shim_pressure {
+    uint64_t calm_until;       // CLOCK_MONOTONIC ns, 0 = classify every fork
+    int32_t calm_score;        // what forks get meanwhile (the whitelist's default)
+} __attribute__((aligned(64)));
+
+// 'cgroup:' directories this process has opened, each as the directory (for CLONE_INTO_CGROUP) and
+// its cgroup.procs (for everything else), kept open for good.  Looked up without a lock: a slot is
+// claimed, filled in, then marked ready; two threads opening the same directory at once both get
+// a slot, which is harmless.  One that couldn't be opened keeps its slot, so it isn't tried again.
+static struct {
+    struct {
+        int state;             // 0 = free, 1 = being filled in, 2 = ready
+        uint64_t key;          // hash of the 'cgroup:' value
+        int dirfd, procs;      // -1 = couldn't be opened
+    } slot[SHIM_CGROUPS];
+} shim_cgroup;
+
+static uint64_t shim_l1_hash(uint64_t h, const char *p, size_t len);
+
+// The shim_cgroup slot for a 'cgroup:' value, opened the first time; -1 if they're all taken.
+static int shim_cgroup_slot(const char *cgroup){
+    uint64_t key = shim_l1_hash(0, cgroup, strlen(cgroup));
+    char path[PATH_MAX];
+    int i, free_ = 0;
+    for(i = 0; i < SHIM_CGROUPS; i++){
+        if(__atomic_load_n(&shim_cgroup.slot[i].state, __ATOMIC_ACQUIRE) == 2 && shim_cgroup.slot[i].key == key){
+            return(i);
+        }
+    }
+    for(i = 0; i < SHIM_CGROUPS && !__atomic_compare_exchange_n(&shim_cgroup.slot[i].state, &free_, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED); i++){
+        free_ = 0;
+    }
+    if(i == SHIM_CGROUPS){
+        return(-1);
+    }
+    shim_format(path, sizeof(path), cgroup[0] == '/' ? "%s" : SHIM_CGROUP_ROOT "/%s", cgroup);
+    shim_cgroup.slot[i].key = key;
+    shim_cgroup.slot[i].dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    shim_cgroup.slot[i].procs = shim_cgroup.slot[i].dirfd == -1 ? -1 : openat(shim_cgroup.slot[i].dirfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if(shim_cgroup.slot[i].procs == -1){
+        shim_log("/tmp/shim_forks_wl.log", "pid %d: can't use cgroup %s, what goes there stays where it is\n", getpid(), path);
+    }
+    __atomic_store_n(&shim_cgroup.slot[i].state, 2, __ATOMIC_RELEASE);
+    return(i);
+}
+
+// The shim_cgroup slot of the winning rule's 'cgroup:', -1 = none.
+static int shim_cgroup_of(const struct wl_rules *wl, int best){
+    return best != -1 && wl->rule[best].opt[WL_OPT_CGROUP] != WL_NONE ? shim_cgroup_slot(wl->arena + wl->rule[best].opt[WL_OPT_CGROUP]) : -1;
+}
+
+// Move pid (0 = ourselves) into the cgroup in slot: a single write to its cgroup.procs.
+static int shim_cgroup_move(int slot, pid_t pid){
+    char num[16];
+    int len;
+    if(slot < 0 || shim_cgroup.slot[slot].procs == -1){
+        return(-1);
+    }
+    len = shim_format(num, sizeof(num), "%d\n", pid);
+    return write(shim_cgroup.slot[slot].procs, num, len) == len ? 0 : -1;
+}
+
+static uint64_t shim_now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now); // vDSO, no system call
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+#ifndef FORKSHIMD
+static const struct shim_pressure *shim_pressure_ptr; // NULL = not mapped (yet)
+static time_t shim_pressure_retry;                    // when to look for the file again
+
+// Whether forks may take the whitelist's default without being classified, and that score.  Only a
+// root-owned file that nobody else can write counts; without one (no forkshimd, or no '%psi'),
+// every fork is classified, and the file is looked for again every FORKSHIMD_RETRY seconds.
+static int shim_calm(int *score){
+    const struct shim_pressure *p = __atomic_load_n(&shim_pressure_ptr, __ATOMIC_ACQUIRE);
+    const void *expect = NULL, *m = MAP_FAILED;
+    uint64_t now = shim_now_ns();
+    struct stat st;
+    int fd;
+    if(p == NULL){
+        if((time_t)(now / 1000000000u) < __atomic_load_n(&shim_pressure_retry, __ATOMIC_RELAXED)){
+            return(0);
+        }
+        __atomic_store_n(&shim_pressure_retry, (time_t)(now / 1000000000u) + FORKSHIMD_RETRY, __ATOMIC_RELAXED);
+        if((fd = open(SHIM_PRESSURE_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1){
+            return(0);
+        }
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == 0 && !(st.st_mode & 022) &&
+           st.st_size >= (off_t)sizeof(*p)){
+            m = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if(m == MAP_FAILED){
+            return(0);
+        }
+        if(!__atomic_compare_exchange_n(&shim_pressure_ptr, &expect, m, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            munmap((void *)m, sizeof(*p)); // another thread mapped it first
+        }
+        p = __atomic_load_n(&shim_pressure_ptr, __ATOMIC_ACQUIRE);
+    }
+    if(now >= __atomic_load_n(&p->calm_until, __ATOMIC_ACQUIRE)){
+        return(0);
+    }
+    *score = __atomic_load_n(&p->calm_score, __ATOMIC_RELAXED);
+    return(1);
+}
+#endif
+
+// Hash of len bytes at p, 8 at a time, chained onto h.  A collision would hand one command line
+// another's decision, but argv is the caller's to choose anyway; it can always add a whitelisted arg.
+static uint64_t shim_l1_hash(uint64_t h, const char *p, size_t len){
+    uint64_t w;
+    size_t i;
+    for(i = 0; i + 8 <= len; i += 8){
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 32;
+    }
+    for(; i < len; i++){
+        h = (h ^ (unsigned char)p[i]) * 0x100000001b3ull;
+    }
+    h = (h ^ len) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+}
+
+#ifndef FORKSHIMD
+// Forget this thread's decisions when the index has moved on: gen and idx are what wl_enter() gave us.
+static void shim_l1_stamp(unsigned int gen, const struct wl_rules *wl){
+    if(shim_tls.gen != gen || shim_tls.idx != wl){
+        shim_tls.gen = gen;
+        shim_tls.idx = wl;
+        shim_tls.exe_rules = wl->nexe > 0;
+        shim_tls.used = shim_tls.next = 0;
+    }
+}
+
+static int shim_l1_find(uint64_t key, int *score, int *cgroup){
+    unsigned int i;
+    for(i = 0; i < shim_tls.used; i++){
+        if(shim_tls.way[i].key == key){
+            *score = shim_tls.way[i].score;
+            *cgroup = shim_tls.way[i].cgroup;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+static void shim_l1_add(uint64_t key, int score, int cgroup){
+#if SHIM_L1_WAYS > 0
+    unsigned int i = shim_tls.next++ % SHIM_L1_WAYS;
+    shim_tls.way[i].key = key;
+    shim_tls.way[i].score = score;
+    shim_tls.way[i].cgroup = cgroup;
+    if(shim_tls.used < SHIM_L1_WAYS){
+        shim_tls.used++;
+    }
+#else
+    (void)key, (void)score, (void)cgroup;
+#endif
+}
+#endif
+
+// Whose children an index is merged for, as far as 'parent:' and 'lineage:' go: shim_self in the
+// shim, each sender in forkshimd.  All NUL-terminated.
+struct shim_who {
+    const char *exe;                   // full path, "" = unknown
+    const char *base;                  // its basename
+    const char *comm;                  // process name, at most 15 bytes
+    const char *lineage;               // ':' separated tags, "" = none
+};
+
+// Is name (an absolute path, or an executable/process name) who?  Process names are cut to 15 bytes.
+static int shim_who_is(const struct shim_who *who, const char *name){
+    size_t len = strlen(who->comm);
+    if(name[0] == '/'){
+        return !strcmp(name, who->exe);
+    }
+    if(who->base[0] && !strcmp(name, who->base)){
+        return(1);
+    }
+    return len > 0 && (!strcmp(name, who->comm) || (len == sizeof(shim_self.comm) - 1 && !strncmp(name, who->comm, len)));
+}
+
+// Does a ':' separated lineage list carry tag?
+static int shim_lineage_has(const char *lineage, const char *tag, size_t len){
+    const char *p = lineage, *colon;
+    for(; *p; p = *colon ? colon + 1 : colon){
+        colon = strchr(p, ':');
+        colon = colon ? colon : p + strlen(p);
+        if((size_t)(colon - p) == len && !memcmp(p, tag, len)){
+            return(1);
+        }
+    }
+    return(0);
+}
+
+// What a shim sends forkshimd for each fork(), along with a pidfd for the child (SCM_RIGHTS) and,
+// added by the kernel, the sender's credentials (SCM_CREDENTIALS).  Until it execs, the child's
+// command line and executable are the sender's, so those are what's sent, followed by the sender's
+// lineage (for 'parent:' and 'lineage:' entries): argv_len, exe_len and lineage_len bytes, no NULs
+// but the command line's own.
+struct forkshimd_record {
+    uint32_t magic;            // FORKSHIMD_MAGIC
+    int32_t pid;
+    uint64_t argv_hash;        // shim_l1_hash() of the command line
+    uint16_t argv_len, exe_len, lineage_len;
+    char comm[16];             // the sender's process name
+};
+
+#ifndef FORKSHIMD
+// Our connection to forkshimd.  A forked child shares it (forkshimd learns who sent each record
+// from the kernel); SOCK_CLOEXEC, so an exec'd program connects for itself.
+static struct {
+    int fd;                    // -1 = not connected
+    int busy;                  // a thread is (re)connecting
+    time_t retry;              // CLOCK_MONOTONIC second before which connecting isn't tried again
+    char *argv;                // our command line, read on the first connect
+    size_t argv_len;
+    uint64_t argv_hash;
+} shim_daemon = { .fd = -1 };
+
+// (Re)connect to forkshimd, at most every FORKSHIMD_RETRY seconds, and only one thread at a time:
+// the others classify inline meanwhile.  A broken connection is replaced on the same fd number, so a
+// thread still sending on it doesn't end up writing to some unrelated file.  Returns the fd or -1.
+static int shim_daemon_connect(int broken){
+    struct sockaddr_un sa = { .sun_family = AF_UNIX, .sun_path = FORKSHIMD_SOCK };
+    struct timespec now;
+    int fd, old;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(now.tv_sec < __atomic_load_n(&shim_daemon.retry, __ATOMIC_RELAXED) || __atomic_exchange_n(&shim_daemon.busy, 1, __ATOMIC_ACQUIRE)){
+        return(-1);
+    }
+    old = shim_daemon.fd;
+    if(old != -1 && !broken){
+        __atomic_store_n(&shim_daemon.busy, 0, __ATOMIC_RELEASE);
+        return old; // another thread got there first
+    }
+    if(shim_daemon.argv == NULL){
+        shim_daemon.argv = read_cmdline("/proc/self/cmdline", &shim_daemon.argv_len);
+        shim_daemon.argv_hash = shim_daemon.argv ? shim_l1_hash(0, shim_daemon.argv, shim_daemon.argv_len) : 0;
+    }
+    if(shim_daemon.argv != NULL && (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) != -1){
+        if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0){
+            if(old != -1 && dup3(fd, old, O_CLOEXEC) != -1){
+                close(fd);
+                fd = old;
+            }
+            __atomic_store_n(&shim_daemon.fd, fd, __ATOMIC_RELEASE);
+            __atomic_store_n(&shim_daemon.busy, 0, __ATOMIC_RELEASE);
+            return fd;
+        }
+        close(fd);
+    }
+    __atomic_store_n(&shim_daemon.retry, now.tv_sec + FORKSHIMD_RETRY, __ATOMIC_RELAXED);
+    __atomic_store_n(&shim_daemon.busy, 0, __ATOMIC_RELEASE);
+    return(-1);
+}
+
+// Hand the child over to forkshimd with one non-blocking send.  0 if it took it; otherwise (not
+// running, not keeping up, no pidfds on this kernel) the caller classifies inline.
+static int shim_daemon_send(pid_t pid){
+#ifdef SYS_pidfd_open
+    struct forkshimd_record rec = { .magic = FORKSHIMD_MAGIC, .pid = pid };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov[4];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 4, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+    struct cmsghdr *cm;
+    int fd = __atomic_load_n(&shim_daemon.fd, __ATOMIC_ACQUIRE), pidfd;
+    ssize_t sent;
+    if(fd == -1 && (fd = shim_daemon_connect(0)) == -1){
+        return(-1);
+    }
+    if(shim_daemon.argv_len > FORKSHIMD_ARGV_MAX || (pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1){
+        return(-1);
+    }
+    rec.argv_hash = shim_daemon.argv_hash;
+    rec.argv_len = shim_daemon.argv_len;
+    rec.exe_len = strlen(shim_self.exe);
+    rec.lineage_len = strlen(shim_self.lineage);
+    memcpy(rec.comm, shim_self.comm, sizeof(rec.comm));
+    iov[0] = (struct iovec){ &rec, sizeof(rec) };
+    iov[1] = (struct iovec){ shim_daemon.argv, rec.argv_len };
+    iov[2] = (struct iovec){ shim_self.exe, rec.exe_len };
+    iov[3] = (struct iovec){ shim_self.lineage, rec.lineage_len };
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &pidfd, sizeof(int));
+    sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(pidfd);
+    if(sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK){
+        shim_daemon_connect(1); // forkshimd went away; maybe it's back already
+    }
+    return sent == -1 ? -1 : 0;
+#else
+    (void)pid;
+    return(-1);
+#endif
+}
+
+SHIM_EXPORT pid_t fork(void){
+    char fileName[sizeof("/proc//oom_score_adj") + 10]; // pid_max goes up to 4194304; room for any int
+    char cmdFileName[sizeof("/proc//cmdline") + 10];
+    char exeFileName[sizeof("/proc//exe") + 10];
+    pid_t pid;
+    int score, calm;
+    shim_init();
+    calm = !shim_self.immune && shim_calm(&score);
+    pid = shim_real.fork();
+    if(pid == 0){
+        // no memory pressure: the default will do, forkshimd sweeps if it won't.  The child sets it
+        // itself, so it's always in before an exec*() of the child classifies it (and can't undo a
+        // never-kill that one gave it, as a write from the parent landing late could)
+        if(calm){
+            write_score("/proc/self/oom_score_adj", score);
+        }
+        return pid;
+    }
+    if(calm){
+        return pid;
+    }
+    shim_format(fileName, sizeof(fileName), "/proc/%d/oom_score_adj", pid);
+    if(!shim_self.immune && shim_daemon_send(pid) == 0){
+        SHIM_COUNT(forks_delegated); // forkshimd logs and classifies it
+        return pid;
+    }
+    shim_log("/tmp/shim_forks.log", "pid = %i\n", pid); // Location for debugging list of pids, tmp during dev
+    if(shim_self.immune){
+        SHIM_COUNT(forks_immune); // the child inherited our -1000, nothing to work out
         return pid;
     }
-    snprintf(fileName, sizeof(fileName), "/proc/%d/oom_score_adj", pid);
-    snprintf(cmdFileName, sizeof(cmdFileName), "/proc/%d/cmdline", pid);
+    shim_format(cmdFileName, sizeof(cmdFileName), "/proc/%d/cmdline", pid);
+    shim_format(exeFileName, sizeof(exeFileName), "/proc/%d/exe", pid);
     // check if /proc/$PID/oom_score_adj exists...
     if(access(fileName, F_OK) != -1){
-        FILE *oomFile = fopen(fileName, "w");
         // pid exists, let's hope we can write to it fast enough before it goes away (if it's short living)...
         // check if /proc/$PID/cmdline exists...
         if(access(cmdFileName, F_OK) != -1){
             // cmdline proc file exists, let's quickly read the entry...
             //printf("debug fork(): cmdFileName=[%s] accessible, opening...\n", cmdFileName);
             // this is not a standard flat-file, handle accordingly...
-            FILE *cmdFile = fopen(cmdFileName, "rb");
-            char *cmdArg = 0;
-            size_t size = 0;
-            while(getdelim(&cmdArg, &size, 0, cmdFile) != -1){
-                // check each arg against whitelist and whitelist accordingly.
-                //printf("debug fork(): original, cmdArg=[%s]...\n", cmdArg);
-                // use strrchr to grab the command after the last forward slash, e.g. sshd from /usr/sbin/sshd [DONE]
-                const char separator = '/';
-                if(cmdArg[0] == '/'){
-                    char * const afterSlash = strrchr(cmdArg, separator);
-                    if(afterSlash[0] == '/') {
-                        //printf("debug: fork(): strrchr cmdArg=[%s], ", cmdArg); // print before the last slash gets overwritten after memmove()
-                        memmove(afterSlash, afterSlash + 1, strlen(afterSlash)); // rewind over the leading slash!
-                        char* token = strtok(afterSlash, " ");
-                        // check all flags as being whitelisted, i.e. when sh -c is used... e.g. sh -c "sh -c 'id'" [DONE]
-                        while (token) {
-                            token = strtok(NULL, " ");
-                            if (check_wl_config(token) == 1) { // proccess or flag is whitelisted...
-                                fprintf(oomFile, "%i\n", whitelistValue);
-                                fclose(oomFile);
-                                free(cmdArg);
-                                free(token);
-                                fclose(cmdFile);
-                                return pid;
-                            }
-                        }
-                    }
-                } else {
-                    if(check_wl_config(cmdArg) == 1) { // proccess is whitelisted...
-                        fprintf(oomFile, "%i\n", whitelistValue);
-                        fclose(oomFile);
-                        free(cmdArg);
-                        fclose(cmdFile);
-                        return pid;
-                    }
-                }
+            size_t cmdLen = 0;
+            char *cmdBuf;
+            unsigned int ticket;
+            const struct wl_rules *wl = NULL;
+            int best = -1, cgroup; // most specific rule matched, -1 = none
+            char exe[PATH_MAX];
+            ssize_t exeLen = -1;
+            uint64_t key;
+            static long worst_ns; // slowest classification seen by this process
+            long ns;
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            wl_refresh(1); // only re-parsed when a fragment changed
+            if(shim_tls.gen != wl_epoch() + 1){
+                wl = wl_enter(&ticket);
+                shim_l1_stamp(ticket + 1, wl);
+            }
+            cmdBuf = read_cmdline(cmdFileName, &cmdLen);
+            // argv can be anything; the exe link can't (one readlinkat, only if there are '@' entries)
+            if(shim_tls.exe_rules && (exeLen = readlinkat(AT_FDCWD, exeFileName, exe, sizeof(exe) - 1)) > 0){
+                exe[exeLen] = 0x00;
+            }
+            key = 0;
+            if(SHIM_L1_WAYS > 0){ // built without the L1 (-DSHIM_L1_WAYS=0), there's nothing to look up
+                key = shim_l1_hash(0, cmdBuf != NULL ? cmdBuf : "", cmdLen);
+                key = exeLen > 0 ? shim_l1_hash(key, exe, exeLen) : key;
+            }
+            // a thread forking the same thing again (before it execs, the child is us) needs nothing shared
+            if(wl == NULL && cmdBuf != NULL && shim_l1_find(key, &score, &cgroup)){
+                free(cmdBuf);
+                shim_cgroup_move(cgroup, pid);
+                write_score(fileName, score);
+                SHIM_COUNT(forks_classified);
+                return pid;
+            }
+            if(wl == NULL){
+                wl = wl_enter(&ticket);
+            }
+            if(cmdBuf != NULL){
+                best = classify_cmdline(wl, cmdBuf, cmdLen);
+                free(cmdBuf);
+            }
+            if(wl->nexe > 0 && exeLen <= 0 && (exeLen = readlinkat(AT_FDCWD, exeFileName, exe, sizeof(exe) - 1)) > 0){
+                exe[exeLen] = 0x00; // the index changed under us and now has '@' entries
             }
-            fclose(cmdFile);
-            fprintf(oomFile, "%i\n", oomValue);
-            fclose(oomFile);
+            if(wl->nexe > 0 && exeLen > 0){
+                best = wl_pick(wl, best, check_wl_exe(wl, exe, exeLen));
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+            if(ns > __atomic_load_n(&worst_ns, __ATOMIC_RELAXED)){
+                __atomic_store_n(&worst_ns, ns, __ATOMIC_RELAXED); // racing threads may both log, that's fine
+                shim_log("/tmp/shim_forks_wl.log", "pid %d: worst classification so far %ld ns (%u DFA states)\n", getpid(), ns, wl->dfa ? wl->dfa->nstates : 0);
+            }
+            score = best == -1 ? wl->default_score : wl->rule[best].score;
+            cgroup = shim_cgroup_of(wl, best);
+            if(cmdBuf != NULL && shim_tls.gen == ticket + 1 && shim_tls.idx == wl){
+                shim_l1_add(key, score, cgroup); // only if the key was made for this very index
+            }
+            shim_cgroup_move(cgroup, pid); // the child is already running: it's in there as soon as can be
+            write_score(fileName, score);
+            wl_release(ticket);
+            SHIM_COUNT(forks_classified);
             return pid;
         }
     } else {
@@ -118,67 +1153,4400 @@ pid_t fork(void){
     return pid;
 }
 
-int check_wl_config(const char *proc_name){
-    FILE *logFile = fopen("/tmp/shim_forks_wl.log", "a");
-    FILE *whitelist_file;
-    char *fileName = "/etc/oom_whitelist";
-    char wl_proc_name[128+1], real[128+1], last[128+1];
-    int catch_bad_things = 0;
-    //printf("debug: proc_name=[%s]\n", proc_name);
+#if defined(__x86_64__) || defined(__aarch64__)
+// vfork(): the child borrows our memory and stack until it execs, and the exec*() it calls may not
+// take a lock or malloc() there (another of our threads could be holding either, for good).  So
+// what exec_classify() would otherwise set up on the spot is done here, in the parent, first: the
+// shim itself, a published whitelist index and the stats mapping.  Returns the real vfork().
+static __attribute__((used)) t_fork shim_vfork_prepare(void){
+    shim_init();
+    if(!shim_self.immune){
+        wl_refresh(1);
+    }
+    shim_stats();
+    shim_tls.vfork_parent = getpid();
+    return shim_real.vfork != NULL ? shim_real.vfork : shim_real.fork;
+}
+
+// vfork() itself can't be a C function: its child returns from it and goes on using the stack
+// below, so whatever frame we'd leave there the parent would find overwritten.  This stub calls
+// shim_vfork_prepare() and then jumps to the real vfork() with nothing of its own on the stack.
+__asm__(".text\n"
+        ".globl vfork\n"
+#if defined(__x86_64__)
+        ".type vfork, @function\n"
+        "vfork:\n"
+#ifdef __CET__
+        "    endbr64\n"
+#endif
+        "    sub $8, %rsp\n"            // keep the stack 16-byte aligned for the call
+        "    call shim_vfork_prepare\n"
+        "    add $8, %rsp\n"
+        "    jmp *%rax\n"
+#else
+        ".type vfork, %function\n"
+        "vfork:\n"
+        "    stp x29, x30, [sp, #-16]!\n"
+        "    mov x29, sp\n"
+        "    bl shim_vfork_prepare\n"
+        "    mov x16, x0\n"
+        "    ldp x29, x30, [sp], #16\n"
+        "    br x16\n"
+#endif
+        ".size vfork, . - vfork\n");
+#endif
+#endif
 
-    if(access(fileName, F_OK) == -1){
-        //printf("debug: /etc/oom_whitelist not found, skipping...");
-        fclose(logFile);
-        return(0);
+// Set the oom_score_adj behind fileName (/proc/<pid>/oom_score_adj).
+int write_score(const char *fileName, int score){
+    char buf[16];
+    int fd, len, ok;
+    if((fd = open(fileName, O_WRONLY | O_CLOEXEC)) == -1){
+        return(-1);
     }
-    if((whitelist_file=fopen(fileName, "r")) == NULL){
-        //printf("Error, couldn't open '%s' process whitelist file!\n", fileName);
-        fclose(logFile);
-        return(0);
+    len = shim_format(buf, sizeof(buf), "%d\n", score);
+    ok = write(fd, buf, len) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+#ifndef FORKSHIMD
+// Work out which file an exec will run: path itself when it has a slash (made absolute against the
+// working directory), otherwise the first executable hit along $PATH, the way execvp() looks.
+static int exec_resolve(const char *path, int search, char *exe, size_t size){
+    const char *dirs, *colon;
+    int len;
+    if(strchr(path, '/') != NULL || !search){
+        if(path[0] == '/'){
+            len = shim_format(exe, size, "%s", path);
+        } else {
+            char cwd[PATH_MAX];
+            if(getcwd(cwd, sizeof(cwd)) == NULL){
+                return(-1);
+            }
+            len = shim_format(exe, size, "%s/%s", cwd, path);
+        }
+        return len > 0 && (size_t)len < size ? len : -1;
+    }
+    if((dirs = getenv("PATH")) == NULL){
+        dirs = "/bin:/usr/bin";
+    }
+    for(; *dirs; dirs = *colon ? colon + 1 : colon){
+        colon = strchr(dirs, ':');
+        colon = colon ? colon : dirs + strlen(dirs);
+        len = shim_format(exe, size, "%.*s/%s", (int)(colon - dirs), colon == dirs ? "." : dirs, path);
+        if(len > 0 && (size_t)len < size && access(exe, X_OK) == 0){
+            return len;
+        }
     }
-    fprintf(logFile, "checking for proc/flag name = [%s]\n", proc_name);
-    while(fgets(wl_proc_name, sizeof(wl_proc_name)-1, whitelist_file) != NULL){
-        //printf("X: wl_proc_name=[%s]\n", wl_proc_name);
-        if(!strstr(wl_proc_name, "\n")){ // fgets read too little and rolled over, or entry is missing a newline
-            catch_bad_things++;
-            continue; // prevent potentially truncated entries from fgets from actually matching (case of >sizeof)
+    return(-1);
+}
+
+// What exec_classify() wants the new program's environment to carry.
+struct exec_vars {
+    char lineage[sizeof(SHIM_ENV_LINEAGE "=") + SHIM_LINEAGE_MAX];
+    char propagate[sizeof(SHIM_ENV_PROPAGATE "=") + 12];
+    char preload[sizeof("LD_PRELOAD=") + SHIM_PRELOAD_MAX];
+    const char *set[5]; // "NAME=value" to set or "NAME" to remove, NULL terminated
+    size_t env_size;    // bytes mapped for exec_env()'s copy of the environment
+};
+
+// envp's value of name, NULL = not set.
+static const char *exec_getenv(char *const envp[], const char *name){
+    size_t n = strlen(name);
+    for(; envp != NULL && *envp != NULL; envp++){
+        if(!strncmp(*envp, name, n) && (*envp)[n] == '='){
+            return *envp + n + 1;
         }
-        snprintf(real, sizeof(real)-1, "%s", wl_proc_name);
-        wl_proc_name[strlen(wl_proc_name)-1] = 0x00;
+    }
+    return NULL;
+}
 
-        if(strlen(wl_proc_name) == 0){ // skip empty lines in the whitelist conf
+// Take ourselves out of an LD_PRELOAD value (entries are separated by spaces or colons; ours is
+// recognized by its file name) into v->preload.  Returns "LD_PRELOAD=rest", "LD_PRELOAD" when
+// nothing else is left, or NULL if we aren't in there (or it's too long to bother).
+static const char *exec_strip_preload(const char *preload, struct exec_vars *v){
+    const char *self = shim_real.self, *p, *end, *base;
+    size_t len = sizeof("LD_PRELOAD=") - 1, n;
+    int found = 0;
+    if(preload == NULL || strlen(preload) >= SHIM_PRELOAD_MAX || self == NULL){
+        return NULL;
+    }
+    memcpy(v->preload, "LD_PRELOAD=", len);
+    for(p = preload; *p; p = end){
+        while(*p == ' ' || *p == ':'){
+            p++;
+        }
+        for(end = p; *end && *end != ' ' && *end != ':'; end++){
+        }
+        if(end == p){
+            break;
+        }
+        for(base = end; base > p && base[-1] != '/'; base--){
+        }
+        n = end - p;
+        if((size_t)(end - base) == strlen(self) && !memcmp(base, self, end - base)){
+            found = 1;
             continue;
-        } else {
-            if(wl_proc_name[0] == '#'){ // skip lines that are punched out
-                continue;
-            }else{
-                if((last[strlen(last)-1] != '\n') && (catch_bad_things > 0)){
-                    // caught: str < sizeof rollover from fgets (due to prior >sizeof) attempting to be a new entry... clever.
-                    snprintf(last, sizeof(last)-1, "%s", real);
-                    continue;
-                }
-                // Allow for non-substring whitelist entries, prepended by a bang.
-                if(wl_proc_name[0] == '!'){
-                    memmove(wl_proc_name, wl_proc_name+1, strlen(wl_proc_name)); // rewind over the bang
-                    if(!strcmp(wl_proc_name, proc_name)){
-                        fprintf(logFile, "proc/arg name=[%s] is whitelisted. Fully matched [%s] entry, setting -1000\n", proc_name, wl_proc_name);
-                        fclose(logFile); // tmp while debugging
+        }
+        if(len > sizeof("LD_PRELOAD=") - 1){
+            v->preload[len++] = ' ';
+        }
+        memcpy(v->preload + len, p, n);
+        len += n;
+    }
+    v->preload[len] = 0x00;
+    if(!found){
+        return NULL;
+    }
+    if(len == sizeof("LD_PRELOAD=") - 1){
+        v->preload[len - 1] = 0x00; // nothing left, unset it
+    }
+    return v->preload;
+}
 
-                        return(1);
-                    }
+// Classify the program we're about to exec from its own argv and path, and set our own
+// oom_score_adj so it's in place before the new program starts.  Runs in the (usually freshly
+// forked) child; the whitelist index inherited from the parent is used as is.  A vfork() child
+// runs on its parent's memory, where another thread may hold the whitelist lock or be inside
+// malloc(), so everything here sticks to what's safe there: buffers on the stack or mmap()ed, and
+// in such a child, only an index the parent already published (see shim_vfork_prepare()); with
+// none, the program isn't classified and keeps our score.
+// Returns the variables to change in the new program's environment, envp (in v).
+static const char *const *exec_classify(const char *path, char *const argv[], int search, char *const envp[], struct exec_vars *v){
+    const struct wl_rules *wl = NULL;
+    const char *tag = NULL, *preload;
+    unsigned int ticket;
+    size_t len = 0, n, pre = sizeof(SHIM_ENV_LINEAGE "=") - 1;
+    char small[1024], *buf, *p, exe[PATH_MAX];
+    int best = -1, exeLen, i, k = 0, score = WL_SCORE_NEVER_KILL, depth = WL_PROPAGATE_NONE;
+    int vforked = shim_tls.vfork_parent != 0 && shim_tls.vfork_parent == getppid();
+    if(shim_self.immune){
+        SHIM_COUNT(execs_immune); // we're never-kill, and so is whatever we exec
+    } else if(vforked && !wl_published()){
+        score = WL_SCORE_DEFAULT; // nothing to classify with, and loading it here isn't safe
+    } else {
+        wl = vforked ? wl_enter(&ticket) : wl_current(0, &ticket);
+        for(i = 0; argv != NULL && argv[i] != NULL; i++){
+            len += strlen(argv[i]) + 1;
+        }
+        buf = len + SHIM_SCAN_PAD <= sizeof(small) ? small : mmap(NULL, len + SHIM_SCAN_PAD, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(buf != MAP_FAILED){
+            for(p = buf, i = 0; argv != NULL && argv[i] != NULL; i++, p += n){
+                n = strlen(argv[i]) + 1;
+                memcpy(p, argv[i], n);
+            }
+            memset(buf + len, 0, SHIM_SCAN_PAD);
+            best = classify_cmdline(wl, buf, len);
+            if(buf != small){
+                munmap(buf, len + SHIM_SCAN_PAD);
+            }
+        }
+        if(wl->nexe > 0 && path != NULL && (exeLen = exec_resolve(path, search, exe, sizeof(exe))) > 0){
+            best = wl_pick(wl, best, check_wl_exe(wl, exe, exeLen));
+        }
+        score = best == -1 ? wl->default_score : wl->rule[best].score;
+        shim_cgroup_move(shim_cgroup_of(wl, best), 0); // before the program starts
+        if(write_score("/proc/self/oom_score_adj", score) == -1){
+            score = WL_SCORE_DEFAULT; // not never-kill after all, e.g. without CAP_SYS_RESOURCE
+        }
+        SHIM_COUNT(execs_classified);
+        if(best != -1 && wl->rule[best].opt[WL_OPT_TAG] != WL_NONE){
+            tag = wl->arena + wl->rule[best].opt[WL_OPT_TAG];
+        }
+    }
+    if(score == WL_SCORE_NEVER_KILL){
+        v->set[k++] = SHIM_ENV_IMMUNE "=1"; // and no shim, it would have nothing to do
+    } else if(best != -1 && wl->rule[best].opt[WL_OPT_PROPAGATE] != WL_NONE){
+        const char *d = wl->arena + wl->rule[best].opt[WL_OPT_PROPAGATE];
+        wl_parse_propagate(d, strlen(d), &depth);
+    } else {
+        depth = shim_self.propagate != -1 ? shim_self.propagate : wl != NULL ? wl->propagate : WL_PROPAGATE_ALL;
+        if(depth != WL_PROPAGATE_ALL){
+            depth--;
+        }
+    }
+    if(depth < 0){
+        if((preload = exec_strip_preload(exec_getenv(envp, "LD_PRELOAD"), v)) != NULL){
+            v->set[k++] = preload;
+            v->set[k++] = SHIM_ENV_PROPAGATE; // for whoever preloads the shim again further down
+            SHIM_COUNT(execs_stripped);
+        }
+    } else if(depth != WL_PROPAGATE_ALL){
+        shim_format(v->propagate, sizeof(v->propagate), "%s=%d", SHIM_ENV_PROPAGATE, depth);
+        v->set[k++] = v->propagate;
+    }
+    // our own lineage carries over (even through a cleared environment), plus the winner's tag
+    memcpy(v->lineage, SHIM_ENV_LINEAGE "=", pre);
+    len = strlen(shim_self.lineage);
+    memcpy(v->lineage + pre, shim_self.lineage, len + 1);
+    if(tag != NULL && !shim_lineage_has(v->lineage + pre, tag, n = strlen(tag)) && pre + len + n + 2 <= sizeof(v->lineage)){
+        if(len > 0){
+            v->lineage[pre + len++] = ':';
+        }
+        memcpy(v->lineage + pre + len, tag, n + 1);
+        len += n;
+    }
+    if(len > 0){
+        v->set[k++] = v->lineage;
+    }
+    v->set[k] = NULL;
+    if(wl != NULL){
+        wl_release(ticket); // tag and the rest have been copied out by now
+    }
+    return v->set;
+}
+
+// Is var ("NAME=value") the variable set names ("NAME=value" or "NAME")?
+static int exec_var_is(const char *var, const char *set){
+    size_t n = strcspn(set, "=");
+    return !strncmp(var, set, n) && var[n] == '=';
+}
+
+// envp changed as v->set says: "NAME=value" entries replace any variable of the same name, bare
+// "NAME" entries remove it.  Returns envp itself when that changes nothing, otherwise a copy
+// (mmap()ed, not malloc()ed: this may be a vfork() child) the caller hands to exec_env_free()
+// if the exec fails.
+static char **exec_env(char *const envp[], struct exec_vars *v){
+    const char *const *set = v->set;
+    size_t n, k, nset, nadd = 0, have = 0, keep = 0;
+    int change = 0;
+    char **env;
+    for(nset = 0; set[nset] != NULL; nset++){
+        nadd += strchr(set[nset], '=') != NULL;
+    }
+    if(envp == NULL || nset == 0){
+        return (char **)envp;
+    }
+    for(n = 0; envp[n] != NULL; n++){
+        for(k = 0; k < nset; k++){
+            if(exec_var_is(envp[n], set[k])){
+                if(strcmp(envp[n], set[k])){
+                    change = 1; // removed, or set to something else
                 } else {
-                    // if commands aren't prepended with a bang, they are sub searched.  "sshd" will allow "sh" to become whitelisted.
-                    if (strstr(wl_proc_name, proc_name) != NULL) {
-                        fprintf(logFile, "proc/arg name=[%s] is whitelisted due to substring matching [%s], setting -1000\n", proc_name, wl_proc_name);
-                        fclose(logFile); // tmp while debugging
-                        return(1);
-                    }
+                    have++;
                 }
-                snprintf(last, sizeof(last)-1, "%s", real);
-                catch_bad_things++;
             }
         }
     }
-    fclose(logFile);
+    v->env_size = (n + nadd + 1) * sizeof(*env);
+    if((!change && have == nadd) ||
+       (env = mmap(NULL, v->env_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        return (char **)envp;
+    }
+    for(n = 0; envp[n] != NULL; n++){
+        for(k = 0; k < nset && !exec_var_is(envp[n], set[k]); k++){
+        }
+        if(k == nset){
+            env[keep++] = envp[n];
+        }
+    }
+    for(k = 0; k < nset; k++){
+        if(strchr(set[k], '=') != NULL){
+            env[keep++] = (char *)set[k];
+        }
+    }
+    env[keep] = NULL;
+    return env;
+}
+
+static void exec_env_free(char **env, char *const envp[], const struct exec_vars *v){
+    if(env != envp){
+        munmap(env, v->env_size);
+    }
+}
+
+SHIM_EXPORT int execve(const char *path, char *const argv[], char *const envp[]){
+    struct exec_vars vars;
+    char **env;
+    int ret;
+    shim_init();
+    exec_classify(path, argv, 0, envp, &vars);
+    env = exec_env(envp, &vars);
+    ret = shim_real.execve(path, argv, env);
+    exec_env_free(env, envp, &vars);
+    return ret;
+}
+
+// execv() and execvp() hand the variables down through a copy of environ rather than setenv(): a
+// vfork() child shares its parent's environ.
+SHIM_EXPORT int execv(const char *path, char *const argv[]){
+    struct exec_vars vars;
+    char **env;
+    int ret;
+    shim_init();
+    exec_classify(path, argv, 0, environ, &vars);
+    if((env = exec_env(environ, &vars)) == environ){
+        return shim_real.execv(path, argv);
+    }
+    ret = shim_real.execve(path, argv, env);
+    exec_env_free(env, environ, &vars);
+    return ret;
+}
+
+SHIM_EXPORT int execvp(const char *file, char *const argv[]){
+    struct exec_vars vars;
+    char **env;
+    int ret;
+    shim_init();
+    exec_classify(file, argv, 1, environ, &vars);
+    if((env = exec_env(environ, &vars)) == environ){
+        return shim_real.execvp(file, argv);
+    }
+    ret = shim_real.execvpe(file, argv, env);
+    exec_env_free(env, environ, &vars);
+    return ret;
+}
+
+SHIM_EXPORT int execvpe(const char *file, char *const argv[], char *const envp[]){
+    struct exec_vars vars;
+    char **env;
+    int ret;
+    shim_init();
+    exec_classify(file, argv, 1, envp, &vars);
+    env = exec_env(envp, &vars);
+    ret = shim_real.execvpe(file, argv, env);
+    exec_env_free(env, envp, &vars);
+    return ret;
+}
+#endif
+
+// Read all of a /proc/<pid>/cmdline in one go.  The buffer is NUL terminated and padded for
+// shim_scan_delim().
+char *read_cmdline(const char *fileName, size_t *len){
+    size_t cap = 4096, have = 0;
+    ssize_t got;
+    char *buf = malloc(cap + SHIM_SCAN_PAD), *grown;
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if(fd == -1 || buf == NULL){
+        free(buf);
+        if(fd != -1){
+            close(fd);
+        }
+        return NULL;
+    }
+    while((got = read(fd, buf + have, cap - have)) > 0){
+        have += got;
+        if(have == cap){
+            if((grown = realloc(buf, cap * 2 + SHIM_SCAN_PAD)) == NULL){
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    close(fd);
+    memset(buf + have, 0, SHIM_SCAN_PAD);
+    *len = have;
+    return buf;
+}
+
+// Check every arg of a NUL separated command line (which gets cut up in place) and return the
+// most specific rule matched, -1 = none; one pass over all args, no early exit.
+// Args starting with '/' are checked as a full path (up to the first space), then, like
+// 'sshd' from '/usr/sbin/sshd', by everything after the last slash split on spaces, so
+// flags get checked too, i.e. when sh -c is used... e.g. sh -c "sh -c 'id'".
+int classify_cmdline(const struct wl_rules *wl, char *buf, size_t len){
+    char *p = buf, *end = buf + len;
+    int best = -1;
+    while(p < end){
+        char *arg = p, *q = p, *firstSpace = NULL, *lastSlash = NULL, *tok;
+        if(arg[0] != '/'){
+            q = memchr(p, 0x00, end - p);
+            q = q ? q : end;
+            best = wl_pick(wl, best, check_wl_config(wl, arg, q - arg));
+            p = q + 1;
+            continue;
+        }
+        // one scan finds the end of the arg, its first space and its last slash
+        for(;;){
+            q = (char *)shim_scan_delim(q, end - q);
+            if(q == end || *q == 0x00){
+                break;
+            }
+            if(*q == ' ' && firstSpace == NULL){
+                firstSpace = q;
+            } else if(*q == '/'){
+                lastSlash = q;
+            }
+            q++;
+        }
+        *q = 0x00; // NUL terminate the last arg too (there's padding)
+        best = wl_pick(wl, best, check_wl_config(wl, arg, (firstSpace ? firstSpace : q) - arg));
+        for(tok = lastSlash + 1; tok < q; tok++){
+            char *sp = memchr(tok, ' ', q - tok);
+            sp = sp ? sp : q;
+            if(sp > tok){
+                *sp = 0x00;
+                best = wl_pick(wl, best, check_wl_config(wl, tok, sp - tok));
+            }
+            tok = sp;
+        }
+        p = q + 1;
+    }
+    return best;
+}
+
+// The first '\0', ' ' or '/' in p[0..n), or p + n.  Callers guarantee SHIM_SCAN_PAD readable bytes
+// after p + n, so the vector kernels never need a scalar tail.  Picked once, by shim_init().
+static const char *scan_delim_scalar(const char *p, size_t n){
+    const char *end = p + n;
+    for(; p < end; p++){
+        if(*p == 0x00 || *p == ' ' || *p == '/'){
+            return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *scan_delim_sse2(const char *p, size_t n){
+    const __m128i nul = _mm_setzero_si128(), sp = _mm_set1_epi8(' '), sl = _mm_set1_epi8('/');
+    size_t i;
+    for(i = 0; i < n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, sp)), _mm_cmpeq_epi8(v, sl)));
+        if(m){
+            i += __builtin_ctz(m);
+            return i < n ? p + i : p + n;
+        }
+    }
+    return p + n;
+}
+
+__attribute__((target("avx2")))
+static const char *scan_delim_avx2(const char *p, size_t n){
+    const __m256i nul = _mm256_setzero_si256(), sp = _mm256_set1_epi8(' '), sl = _mm256_set1_epi8('/');
+    size_t i;
+    for(i = 0; i < n; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, nul), _mm256_cmpeq_epi8(v, sp)), _mm256_cmpeq_epi8(v, sl)));
+        if(m){
+            i += __builtin_ctz(m);
+            return i < n ? p + i : p + n;
+        }
+    }
+    return p + n;
+}
+#endif
+
+static t_scan_delim pick_scan_delim(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return scan_delim_avx2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return scan_delim_sse2;
+    }
+#endif
+    return scan_delim_scalar;
+}
+
+const char *shim_scan_delim(const char *p, size_t n){
+    return shim_real.scan_delim(p, n);
+}
+
+// Score tiers that may be used by name instead of a number.
+static const struct {
+    char name[12];
+    int score;
+} wl_tiers[] = {
+    { "disposable",  1000 },
+    { "tolerated",    300 },
+    { "important",   -500 },
+    { "never-kill", -1000 },
+};
+
+// Parse a tier name or a number within oom_score_adj's range of -1000..1000.
+static int wl_parse_score(const char *s, size_t len, int *score){
+    size_t i;
+    int neg = 0, v = 0;
+    for(i = 0; i < sizeof(wl_tiers) / sizeof(wl_tiers[0]); i++){
+        if(strlen(wl_tiers[i].name) == len && !memcmp(wl_tiers[i].name, s, len)){
+            *score = wl_tiers[i].score;
+            return(1);
+        }
+    }
+    i = 0;
+    if(len > 0 && (s[0] == '-' || s[0] == '+')){
+        neg = s[0] == '-';
+        i++;
+    }
+    if(i == len){
+        return(0);
+    }
+    for(; i < len; i++){
+        if(s[i] < '0' || s[i] > '9' || (v = v * 10 + (s[i] - '0')) > 1000){
+            return(0);
+        }
+    }
+    *score = neg ? -v : v;
+    return(1);
+}
+
+// Parse a propagation depth: a number of exec generations, 'all' or 'none'.
+static int wl_parse_propagate(const char *s, size_t len, int *depth){
+    size_t i;
+    int v = 0;
+    if(len == 3 && !memcmp(s, "all", 3)){
+        *depth = WL_PROPAGATE_ALL;
+        return(1);
+    }
+    if(len == 4 && !memcmp(s, "none", 4)){
+        *depth = WL_PROPAGATE_NONE;
+        return(1);
+    }
+    for(i = 0; i < len; i++){
+        if(s[i] < '0' || s[i] > '9' || (v = v * 10 + (s[i] - '0')) > 1000){
+            return(0);
+        }
+    }
+    *depth = v;
+    return(len > 0);
+}
+
+// Parse a '%psi' trigger, e.g. "some 150 1000": 150 ms of stalls within any 1000 ms window.  The
+// kernel takes windows of 500 ms to 10 s, and a stall no longer than its window.
+static int wl_parse_psi(const char *s, size_t len, struct wl_rules *wl){
+    unsigned long v[2] = { 0, 0 };
+    size_t i = 5;
+    int k;
+    if(len <= 5 || (memcmp(s, "some ", 5) && memcmp(s, "full ", 5))){
+        return(0);
+    }
+    for(k = 0; k < 2; k++){
+        for(; i < len && (s[i] == ' ' || s[i] == '\t'); i++){
+        }
+        if(i == len || s[i] < '0' || s[i] > '9'){
+            return(0);
+        }
+        for(; i < len && s[i] >= '0' && s[i] <= '9' && v[k] <= 10000; i++){
+            v[k] = v[k] * 10 + (s[i] - '0');
+        }
+    }
+    if(i != len || v[0] == 0 || v[0] > v[1] || v[1] < 500 || v[1] > 10000){
+        return(0);
+    }
+    wl->psi_full = s[0] == 'f';
+    wl->psi_stall_ms = v[0];
+    wl->psi_window_ms = v[1];
+    return(1);
+}
+
+// Parse a '%rebalance' band, e.g. "500 disposable 10000": two scores (tiers too), low first, and how
+// many ms apart to rank what's in it, at least 1000.  Never-kill can't be part of a band.
+static int wl_parse_rebalance(const char *s, size_t len, struct wl_rules *wl){
+    const char *tok[3];
+    size_t tlen[3], i = 0;
+    int k, v[3] = { 0, 0, FORKSHIMD_RANK_MS };
+    for(k = 0; k < 3; k++){
+        for(; i < len && (s[i] == ' ' || s[i] == '\t'); i++){
+        }
+        for(tok[k] = s + i; i < len && s[i] != ' ' && s[i] != '\t'; i++){
+        }
+        if((tlen[k] = s + i - tok[k]) == 0){
+            break;
+        }
+    }
+    if(k < 2 || i != len || !wl_parse_score(tok[0], tlen[0], &v[0]) || !wl_parse_score(tok[1], tlen[1], &v[1]) ||
+       v[0] <= WL_SCORE_NEVER_KILL || v[0] >= v[1]){
+        return(0);
+    }
+    for(i = 0, v[2] = k == 3 ? 0 : v[2]; k == 3 && i < tlen[2]; i++){
+        if(tok[2][i] < '0' || tok[2][i] > '9' || (v[2] = v[2] * 10 + (tok[2][i] - '0')) > 3600000){
+            return(0);
+        }
+    }
+    if(v[2] < FORKSHIMD_PSI_TICK){ // forkshimd looks no more often
+        return(0);
+    }
+    wl->rank_low = v[0];
+    wl->rank_high = v[1];
+    wl->rank_ms = v[2];
+    return(1);
+}
+
+// Parse a '%kill' line, e.g. "5 2000 disposable /sys/fs/cgroup/batch": act below 5% of memory
+// available, give victims 2000 ms between SIGTERM and SIGKILL (0 = SIGKILL straight away), and only
+// take those scored 1000; the cgroup (and what's below it), if given, is both what's watched and
+// where victims come from.  Everything after the percentage is optional, in that order.
+static int wl_parse_kill(const char *s, size_t len, struct wl_rules *wl){
+    const char *tok;
+    size_t tlen, i = 0, j;
+    int k, v[3] = { 0, FORKSHIMD_KILL_GRACE, WL_SCORE_DEFAULT };
+    char cgroup[sizeof(wl->kill_cgroup)] = "";
+    for(k = 0; k < 4; k++){
+        for(; i < len && (s[i] == ' ' || s[i] == '\t'); i++){
+        }
+        for(tok = s + i; i < len && s[i] != ' ' && s[i] != '\t'; i++){
+        }
+        if((tlen = s + i - tok) == 0){
+            break;
+        }
+        if(tok[0] == '/'){ // the cgroup, which may come early
+            if(k == 0 || tlen >= sizeof(cgroup)){
+                return(0);
+            }
+            memcpy(cgroup, tok, tlen);
+            cgroup[tlen] = 0x00;
+            k = 3;
+        } else if(k == 2){
+            if(!wl_parse_score(tok, tlen, &v[2]) || v[2] <= WL_SCORE_NEVER_KILL){
+                return(0);
+            }
+        } else if(k < 2){
+            for(j = 0, v[k] = 0; j < tlen; j++){
+                if(tok[j] < '0' || tok[j] > '9' || (v[k] = v[k] * 10 + (tok[j] - '0')) > 600000){
+                    return(0);
+                }
+            }
+        } else {
+            return(0);
+        }
+    }
+    if(k == 0 || i != len || v[0] < 1 || v[0] > 90){
+        return(0);
+    }
+    wl->kill_pct = v[0];
+    wl->kill_grace_ms = v[1];
+    wl->kill_score = v[2];
+    memcpy(wl->kill_cgroup, cgroup, sizeof(cgroup));
+    return(1);
+}
+
+// If line is the directive name ('%default'), the offset of its argument, otherwise 0.
+static size_t wl_directive(const char *line, size_t len, const char *name){
+    size_t n = strlen(name), skip;
+    if(len < n || memcmp(line, name, n) || (len > n && line[n] != ' ' && line[n] != '\t')){
+        return(0);
+    }
+    for(skip = n; skip < len && (line[skip] == ' ' || line[skip] == '\t'); skip++){
+    }
+    return(skip);
+}
+
+static const char wl_opt_names[WL_NOPTS][12] = { "parent:", "lineage:", "tag:", "propagate:", "cgroup:" };
+
+// Peel the trailing options off an entry, in any order, e.g. "sshd =never-kill" or
+// "~* parent:puppet tag:puppet-exec =disposable".  The values are left in val/vlen (vlen 0 =
+// not given).  Returns 0 if an option is malformed or given twice; the first word that isn't an
+// option ends the list and stays part of the entry.
+static int wl_split_options(const char *line, size_t *len, short *score, const char **val, size_t *vlen){
+    int scored = 0, v, k;
+    memset(vlen, 0, WL_NOPTS * sizeof(*vlen));
+    for(;;){
+        size_t i = *len, n;
+        const char *w;
+        while(i > 0 && line[i-1] != ' ' && line[i-1] != '\t'){
+            i--;
+        }
+        if(i == 0){
+            return(1); // that's the entry itself, whatever it looks like
+        }
+        w = line + i;
+        n = *len - i;
+        if(w[0] == '='){
+            if(scored || !wl_parse_score(w + 1, n - 1, &v)){
+                return(0);
+            }
+            *score = v;
+            scored = 1;
+        } else {
+            for(k = 0; k < WL_NOPTS; k++){
+                size_t m = strlen(wl_opt_names[k]);
+                if(n >= m && !memcmp(w, wl_opt_names[k], m)){
+                    if(n == m || vlen[k] != 0){
+                        return(0);
+                    }
+                    val[k] = w + m;
+                    vlen[k] = n - m;
+                    break;
+                }
+            }
+            if(k == WL_NOPTS){
+                return(1);
+            }
+        }
+        while(i > 0 && (line[i-1] == ' ' || line[i-1] == '\t')){
+            i--;
+        }
+        *len = i;
+    }
+}
+
+int wl_load(struct wl_rules *wl, const char *fileName){
+    struct stat st;
+    char *buf, *line, *end, *next;
+    ssize_t got;
+    size_t have = 0;
+    int fd;
+
+    memset(wl, 0, sizeof(*wl));
+    wl->default_score = WL_SCORE_DEFAULT;
+    wl->propagate = WL_PROPAGATE_ALL;
+    if((fd = open(fileName, O_RDONLY | O_CLOEXEC)) == -1){
+        //printf("debug: /etc/oom_whitelist not found, skipping...");
+        return(0);
+    }
+    if(fstat(fd, &st) == -1 || (buf = malloc(st.st_size + 1)) == NULL){
+        close(fd);
+        return(0);
+    }
+    while(have < (size_t)st.st_size && (got = read(fd, buf + have, st.st_size - have)) > 0){
+        have += got;
+    }
+    close(fd);
+    // one arena byte per file byte is always enough: entries and option values only ever shrink
+    // (newline or space -> NUL, bang and option names dropped)
+    if((wl->arena = malloc(have + 1)) == NULL){
+        free(buf);
+        return(0);
+    }
+    end = buf + have;
+    for(line = buf; line < end; line = next){
+        char *nl = memchr(line, '\n', end - line);
+        size_t len = (nl ? nl : end) - line;
+        struct wl_rule r;
+        const char *val[WL_NOPTS];
+        size_t vlen[WL_NOPTS], skip;
+        int k, depth;
+        next = nl ? nl + 1 : end;
+        if(len > 0 && line[len-1] == '\r'){ // tolerate CRLF whitelists
+            len--;
+        }
+        if(len == 0 || line[0] == '#'){ // skip empty lines and lines that are punched out
+            continue;
+        }
+        if((skip = wl_directive(line, len, "%default")) > 0){
+            // '%default <score>' sets the value for forks no rule matched
+            if(wl_parse_score(line + skip, len - skip, &wl->default_score)){
+                wl->has_default = 1;
+            }
+            continue;
+        }
+        if((skip = wl_directive(line, len, "%propagate")) > 0){
+            // '%propagate <depth>' limits how many exec generations get the shim preloaded
+            if(wl_parse_propagate(line + skip, len - skip, &wl->propagate)){
+                wl->has_propagate = 1;
+            }
+            continue;
+        }
+        if((skip = wl_directive(line, len, "%psi")) > 0){
+            // '%psi <some|full> <stall ms> <window ms>' lets forks skip classifying while memory isn't tight
+            wl_parse_psi(line + skip, len - skip, wl);
+            continue;
+        }
+        if((skip = wl_directive(line, len, "%rebalance")) > 0){
+            // '%rebalance <low> <high> [ms]' spreads what scores inside the band by resident size
+            wl_parse_rebalance(line + skip, len - skip, wl);
+            continue;
+        }
+        if((skip = wl_directive(line, len, "%kill")) > 0){
+            // '%kill <percent> [grace ms] [score] [cgroup]' has forkshimd end processes before the kernel has to
+            wl_parse_kill(line + skip, len - skip, wl);
+            continue;
+        }
+        r.score = WL_SCORE_RULE;
+        if(!wl_split_options(line, &len, &r.score, val, vlen) ||
+           (vlen[WL_OPT_PROPAGATE] != 0 && !wl_parse_propagate(val[WL_OPT_PROPAGATE], vlen[WL_OPT_PROPAGATE], &depth))){
+            continue; // option that doesn't parse; don't guess what was meant
+        }
+        switch(line[0]){
+        case '@': r.kind = line[len-1] == '/' ? WL_EXE_DIR : WL_EXE; break;
+        case '!': r.kind = WL_EXACT; break; // allow for non-substring whitelist entries, prepended by a bang.
+        case '^': r.kind = WL_PREFIX; break;
+        case '$': r.kind = WL_SUFFIX; break;
+        case '~': r.kind = WL_GLOB; break;
+        default: r.kind = WL_SUBSTR; break;
+        }
+        if(r.kind != WL_SUBSTR){
+            line++;
+            len--;
+            if(len == 0){
+                continue;
+            }
+        }
+        if(r.kind == WL_GLOB && !wl_glob_ok(line, len)){
+            // compiled it'd match other names than fnmatch() does when there's no DFA
+            shim_log("/tmp/shim_forks_wl.log", "whitelist entry [~%.*s] ignored: fnmatch() fails on it, or reads it by locale\n", (int)len, line);
+            continue;
+        }
+        if(wl->nrules == wl->rules_cap){
+            size_t cap = wl->rules_cap ? wl->rules_cap * 2 : 16;
+            struct wl_rule *grown = realloc(wl->rule, cap * sizeof(*grown));
+            if(grown == NULL){
+                break;
+            }
+            wl->rule = grown;
+            wl->rules_cap = cap;
+        }
+        r.off = wl->arena_len;
+        r.len = len;
+        memcpy(wl->arena + wl->arena_len, line, len);
+        wl->arena_len += len;
+        wl->arena[wl->arena_len++] = 0x00;
+        for(k = 0; k < WL_NOPTS; k++){
+            r.opt[k] = WL_NONE;
+            if(vlen[k] != 0){
+                r.opt[k] = wl->arena_len;
+                memcpy(wl->arena + wl->arena_len, val[k], vlen[k]);
+                wl->arena_len += vlen[k];
+                wl->arena[wl->arena_len++] = 0x00;
+            }
+        }
+        r.active = 1;
+        wl->rule[wl->nrules++] = r;
+    }
+    free(buf);
+    return(1);
+}
+
+void wl_free(struct wl_rules *wl){
+    wl_dfa_free(wl->dfa);
+    free(wl->exe);
+    free(wl->arena);
+    free(wl->rule);
+    memset(wl, 0, sizeof(*wl));
+}
+
+// The merged whitelist index and what's needed to keep it current.  WL_FILE and every fragment in
+// WL_DIR are parsed separately and kept around; an inotify watch on both directories tells us which
+// one changed, so only that fragment is re-parsed before the index is re-merged from the parsed tables.
+// Threads fork concurrently: everything but the published index belongs to whoever holds lock, and
+// the index is swapped in atomically for readers, which never lock (see wl_current()).
+static struct {
+    pid_t owner;               // process the inotify instance belongs to, 0 = not set up yet
+    int ifd;                   // inotify fd, -1 when watching isn't possible (re-checked every fork)
+    int file_wd, dir_wd;
+    struct wl_fragment *frag;  // sorted by name, so WL_FILE ("") always comes first
+    size_t nfrag, frag_cap;
+    struct wl_rules *index;    // all fragments merged and de-duplicated, in fragment then file order
+    int dirty;
+    pthread_mutex_t lock;      // reloads, and everything above but index
+    unsigned int epoch;        // bumped when an index is published
+    unsigned int readers[2];   // readers that entered in an even/odd epoch
+} wl_state = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Served when there's no index at all (nothing loaded yet, or out of memory).
+static struct wl_rules wl_empty = { .default_score = WL_SCORE_DEFAULT, .propagate = WL_PROPAGATE_ALL };
+
+static int wl_fragment_name_ok(const char *name){
+    size_t len = strlen(name);
+    // skip dot files (editor swap files, '.', '..') and backup copies ending in '~'
+    return len > 0 && name[0] != '.' && name[len-1] != '~';
+}
+
+static struct wl_fragment *wl_fragment_get(const char *name, int create){
+    size_t lo = 0, hi = wl_state.nfrag;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(wl_state.frag[mid].name, name);
+        if(c == 0){
+            return &wl_state.frag[mid];
+        }
+        if(c < 0){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(!create || strlen(name) > NAME_MAX){
+        return NULL;
+    }
+    if(wl_state.nfrag == wl_state.frag_cap){
+        size_t cap = wl_state.frag_cap ? wl_state.frag_cap * 2 : 8;
+        struct wl_fragment *grown = realloc(wl_state.frag, cap * sizeof(*grown));
+        if(grown == NULL){
+            return NULL;
+        }
+        wl_state.frag = grown;
+        wl_state.frag_cap = cap;
+    }
+    memmove(&wl_state.frag[lo+1], &wl_state.frag[lo], (wl_state.nfrag - lo) * sizeof(*wl_state.frag));
+    wl_state.nfrag++;
+    memset(&wl_state.frag[lo], 0, sizeof(*wl_state.frag));
+    strcpy(wl_state.frag[lo].name, name);
+    return &wl_state.frag[lo];
+}
+
+static void wl_fragment_drop(const char *name){
+    struct wl_fragment *f = wl_fragment_get(name, 0);
+    if(f != NULL){
+        size_t i = f - wl_state.frag;
+        wl_free(&f->rules);
+        memmove(f, f + 1, (wl_state.nfrag - i - 1) * sizeof(*f));
+        wl_state.nfrag--;
+        wl_state.dirty = 1;
+    }
+}
+
+static void wl_fragment_touch(const char *name){
+    struct wl_fragment *f = wl_fragment_get(name, 1);
+    if(f != NULL){
+        f->stale = 1;
+        wl_state.dirty = 1;
+    }
+}
+
+// Forget every fragment and pick up whatever is on disk now.
+static void wl_scan_all(void){
+    DIR *dir;
+    struct dirent *de;
+    while(wl_state.nfrag > 0){
+        wl_free(&wl_state.frag[--wl_state.nfrag].rules);
+    }
+    wl_fragment_touch("");
+    if((dir = opendir(WL_DIR)) != NULL){
+        while((de = readdir(dir)) != NULL){
+            if(wl_fragment_name_ok(de->d_name) && (de->d_type == DT_REG || de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)){
+                wl_fragment_touch(de->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    wl_state.dirty = 1;
+}
+
+// The path a fragment is read from.
+static void wl_fragment_path(const struct wl_fragment *f, char *path, size_t size){
+    if(f->name[0] == 0x00){
+        shim_format(path, size, "%s", WL_FILE);
+    } else {
+        shim_format(path, size, "%s/%s", WL_DIR, f->name);
+    }
+}
+
+// Has f changed on disk since it was parsed?  With update, take down what it is now.
+static int wl_fragment_changed(struct wl_fragment *f, int update){
+    char path[PATH_MAX];
+    struct stat st;
+    int changed;
+    wl_fragment_path(f, path, sizeof(path));
+    if(stat(path, &st) == -1){
+        memset(&st, 0, sizeof(st));
+    }
+    changed = st.st_dev != f->id.dev || st.st_ino != f->id.ino || st.st_size != f->id.size ||
+              st.st_mtim.tv_sec != f->id.mtime.tv_sec || st.st_mtim.tv_nsec != f->id.mtime.tv_nsec;
+    if(update){
+        f->id.dev = st.st_dev;
+        f->id.ino = st.st_ino;
+        f->id.size = st.st_size;
+        f->id.mtime = st.st_mtim;
+    }
+    return changed;
+}
+
+// Like wl_scan_all(), but keeping the fragments already parsed (say, by the parent we were forked
+// from) unless they changed on disk since: only those, and any that are new, are read again.
+static void wl_rescan(void){
+    DIR *dir;
+    struct dirent *de;
+    struct wl_fragment *f;
+    size_t i;
+    for(i = 0; i < wl_state.nfrag; i++){
+        wl_state.frag[i].seen = wl_state.frag[i].name[0] == 0x00; // WL_FILE stays, there or not
+    }
+    if((dir = opendir(WL_DIR)) != NULL){
+        while((de = readdir(dir)) != NULL){
+            if(wl_fragment_name_ok(de->d_name) && (de->d_type == DT_REG || de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)){
+                if(wl_fragment_get(de->d_name, 0) == NULL){
+                    wl_fragment_touch(de->d_name); // new since
+                }
+                if((f = wl_fragment_get(de->d_name, 0)) != NULL){
+                    f->seen = 1;
+                }
+            }
+        }
+        closedir(dir);
+    }
+    for(i = 0; i < wl_state.nfrag; i++){
+        f = &wl_state.frag[i];
+        if(!f->seen){
+            wl_fragment_drop(f->name);
+            i--;
+        } else if(!f->stale && wl_fragment_changed(f, 0)){
+            f->stale = 1;
+            wl_state.dirty = 1;
+        }
+    }
+    if(wl_fragment_get("", 0) == NULL){
+        wl_fragment_touch("");
+    }
+}
+
+static void wl_watch_start(void){
+    if(wl_state.ifd != -1){
+        close(wl_state.ifd); // inherited from the parent across fork(); its events aren't ours
+    }
+    wl_state.dir_wd = -1;
+    if((wl_state.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1){
+        const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+        wl_state.file_wd = inotify_add_watch(wl_state.ifd, WL_FILE_DIR, mask | IN_ONLYDIR);
+        wl_state.dir_wd = inotify_add_watch(wl_state.ifd, WL_DIR, mask | IN_ONLYDIR);
+        if(wl_state.file_wd == -1){
+            close(wl_state.ifd);
+            wl_state.ifd = -1;
+        }
+    }
+    // after the watches, so nothing changed in between goes unnoticed
+    if(wl_state.nfrag > 0){
+        wl_rescan();
+    } else {
+        wl_scan_all();
+    }
+}
+
+// Drain pending inotify events and mark the fragments they name as stale.
+static void wl_watch_poll(void){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while((got = read(wl_state.ifd, buf, sizeof(buf))) > 0){
+        char *p;
+        for(p = buf; p < buf + got; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if(ev->mask & IN_Q_OVERFLOW){
+                wl_scan_all(); // lost track of what changed, start over
+                continue;
+            }
+            if(ev->wd == wl_state.file_wd && ev->len > 0){
+                if(!strcmp(ev->name, WL_FILE + sizeof(WL_FILE_DIR))){
+                    wl_fragment_touch("");
+                } else if(!strcmp(ev->name, WL_DIR + sizeof(WL_FILE_DIR)) && (ev->mask & (IN_CREATE | IN_MOVED_TO))){
+                    // the include directory showed up after we started
+                    wl_state.dir_wd = inotify_add_watch(wl_state.ifd, WL_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+                    wl_scan_all();
+                }
+            } else if(ev->wd == wl_state.dir_wd && wl_state.dir_wd != -1){
+                if(ev->mask & IN_IGNORED){ // include directory itself went away
+                    wl_state.dir_wd = -1;
+                    wl_scan_all();
+                } else if(ev->len > 0 && wl_fragment_name_ok(ev->name) && !(ev->mask & IN_ISDIR)){
+                    if(ev->mask & (IN_DELETE | IN_MOVED_FROM)){
+                        wl_fragment_drop(ev->name);
+                    } else {
+                        wl_fragment_touch(ev->name);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static unsigned int wl_rule_hash(const char *s, size_t len, unsigned char kind){
+    unsigned int h = 2166136261u ^ kind; // FNV-1a
+    while(len--){
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+// Whether a rule's conditions hold for what who starts.  Rules that don't apply are left out of the
+// compiled index altogether, so conditions cost nothing when classifying.
+static int wl_rule_applies(const struct wl_rules *wl, const struct wl_rule *r, const struct shim_who *who){
+    if(r->opt[WL_OPT_PARENT] != WL_NONE && !shim_who_is(who, wl->arena + r->opt[WL_OPT_PARENT])){
+        return(0);
+    }
+    if(r->opt[WL_OPT_LINEAGE] != WL_NONE){
+        const char *tag = wl->arena + r->opt[WL_OPT_LINEAGE];
+        return shim_lineage_has(who->lineage, tag, strlen(tag));
+    }
+    return(1);
+}
+
+// Two rules' option values for k are the same (or both not given).
+static int wl_opt_same(const struct wl_rules *a, const struct wl_rule *ra, const struct wl_rules *b, const struct wl_rule *rb, int k){
+    if(ra->opt[k] == WL_NONE || rb->opt[k] == WL_NONE){
+        return ra->opt[k] == rb->opt[k];
+    }
+    return !strcmp(a->arena + ra->opt[k], b->arena + rb->opt[k]);
+}
+
+// Swap a new index in for readers, then free the old one once no reader can still be using it:
+// readers that entered before the epoch moved on are counted in the old epoch's slot, so waiting for
+// that slot to drain is enough.  Called with wl_state.lock held, so only one index is ever retiring.
+static void wl_publish(struct wl_rules *merged){
+    struct wl_rules *idx = malloc(sizeof(*idx)), *old;
+    unsigned int e;
+    if(idx == NULL){
+        wl_free(merged);
+        return; // keep serving the previous index
+    }
+    *idx = *merged;
+    old = __atomic_exchange_n(&wl_state.index, idx, __ATOMIC_SEQ_CST);
+    e = __atomic_fetch_add(&wl_state.epoch, 1, __ATOMIC_SEQ_CST); // even the first: per-thread decisions go stale
+    if(old == NULL){
+        return;
+    }
+    while(__atomic_load_n(&wl_state.readers[e & 1], __ATOMIC_SEQ_CST) != 0){
+        sched_yield(); // a classification takes microseconds
+    }
+    wl_free(old);
+    free(old);
+}
+
+// Re-parse the stale fragments, then merge every fragment's parsed rules into one de-duplicated,
+// compiled index for who's children, in *out.  total is set to the entries there were before de-duplication.
+static int wl_merge(struct wl_rules *out, size_t *totalp, const struct shim_who *who){
+    struct wl_rules merged;
+    unsigned int *slot;
+    size_t i, j, total = 0, arena = 0, nslots = 16;
+
+    for(i = 0; i < wl_state.nfrag; i++){
+        struct wl_fragment *f = &wl_state.frag[i];
+        if(f->stale){
+            char path[PATH_MAX];
+            wl_free(&f->rules);
+            wl_fragment_changed(f, 1); // before reading it: a change after this is seen next time
+            wl_fragment_path(f, path, sizeof(path));
+            wl_load(&f->rules, path);
+            f->stale = 0;
+        }
+        total += f->rules.nrules;
+        arena += f->rules.arena_len;
+    }
+    while(nslots < total * 2){
+        nslots *= 2;
+    }
+    memset(&merged, 0, sizeof(merged));
+    merged.default_score = WL_SCORE_DEFAULT;
+    merged.propagate = WL_PROPAGATE_ALL;
+    for(i = 0; i < wl_state.nfrag; i++){ // first of each directive, in merge order, wins
+        if(wl_state.frag[i].rules.has_default && !merged.has_default){
+            merged.default_score = wl_state.frag[i].rules.default_score;
+            merged.has_default = 1;
+        }
+        if(wl_state.frag[i].rules.has_propagate && !merged.has_propagate){
+            merged.propagate = wl_state.frag[i].rules.propagate;
+            merged.has_propagate = 1;
+        }
+        if(wl_state.frag[i].rules.psi_window_ms != 0 && merged.psi_window_ms == 0){
+            merged.psi_full = wl_state.frag[i].rules.psi_full;
+            merged.psi_stall_ms = wl_state.frag[i].rules.psi_stall_ms;
+            merged.psi_window_ms = wl_state.frag[i].rules.psi_window_ms;
+        }
+        if(wl_state.frag[i].rules.rank_ms != 0 && merged.rank_ms == 0){
+            merged.rank_low = wl_state.frag[i].rules.rank_low;
+            merged.rank_high = wl_state.frag[i].rules.rank_high;
+            merged.rank_ms = wl_state.frag[i].rules.rank_ms;
+        }
+        if(wl_state.frag[i].rules.kill_pct != 0 && merged.kill_pct == 0){
+            merged.kill_pct = wl_state.frag[i].rules.kill_pct;
+            merged.kill_grace_ms = wl_state.frag[i].rules.kill_grace_ms;
+            merged.kill_score = wl_state.frag[i].rules.kill_score;
+            memcpy(merged.kill_cgroup, wl_state.frag[i].rules.kill_cgroup, sizeof(merged.kill_cgroup));
+        }
+    }
+    slot = calloc(nslots, sizeof(*slot)); // merged rule index + 1, 0 = empty
+    merged.arena = malloc(arena + 1);
+    merged.rule = malloc((total + 1) * sizeof(*merged.rule));
+    if(slot == NULL || merged.arena == NULL || merged.rule == NULL){
+        free(slot);
+        wl_free(&merged);
+        return(-1); // keep serving the previous index
+    }
+    merged.rules_cap = total + 1;
+    for(i = 0; i < wl_state.nfrag; i++){
+        const struct wl_rules *src = &wl_state.frag[i].rules;
+        for(j = 0; j < src->nrules; j++){
+            const struct wl_rule *r = &src->rule[j];
+            const char *text = src->arena + r->off;
+            unsigned int h = wl_rule_hash(text, r->len, r->kind) & (nslots - 1);
+            struct wl_rule *m;
+            int k;
+            while(slot[h] != 0){
+                m = &merged.rule[slot[h] - 1];
+                if(m->len == r->len && m->kind == r->kind && !memcmp(merged.arena + m->off, text, r->len) &&
+                   wl_opt_same(&merged, m, src, r, WL_OPT_PARENT) && wl_opt_same(&merged, m, src, r, WL_OPT_LINEAGE)){
+                    break; // same entry under the same conditions already merged from an earlier fragment
+                }
+                h = (h + 1) & (nslots - 1);
+            }
+            if(slot[h] != 0){
+                continue;
+            }
+            m = &merged.rule[merged.nrules];
+            *m = *r;
+            m->off = merged.arena_len;
+            memcpy(merged.arena + merged.arena_len, text, r->len + 1);
+            merged.arena_len += r->len + 1;
+            for(k = 0; k < WL_NOPTS; k++){
+                if(r->opt[k] != WL_NONE){
+                    size_t n = strlen(src->arena + r->opt[k]) + 1;
+                    m->opt[k] = merged.arena_len;
+                    memcpy(merged.arena + merged.arena_len, src->arena + r->opt[k], n);
+                    merged.arena_len += n;
+                }
+            }
+            m->active = wl_rule_applies(&merged, m, who);
+            merged.nconditional += m->opt[WL_OPT_PARENT] != WL_NONE || m->opt[WL_OPT_LINEAGE] != WL_NONE;
+            slot[h] = ++merged.nrules;
+        }
+    }
+    free(slot);
+    merged.dfa = wl_compile(&merged);
+    wl_exe_build(&merged);
+    *out = merged;
+    *totalp = total;
+    return(0);
+}
+
+// Merge the index for ourselves (see wl_merge()) and hand it to readers.
+static void wl_rebuild(void){
+    struct wl_rules merged;
+    struct shim_who who;
+    size_t total;
+    shim_init();
+    who = (struct shim_who){ shim_self.exe, shim_self.base, shim_self.comm, shim_self.lineage };
+    if(wl_merge(&merged, &total, &who) == -1){
+        return;
+    }
+    wl_state.dirty = 0;
+    wl_publish(&merged);
+    shim_log("/tmp/shim_forks_wl.log", "whitelist index rebuilt: %zu fragments, %zu entries (%zu duplicates dropped), %u DFA states x %u byte classes\n",
+             wl_state.nfrag, merged.nrules, total - merged.nrules, merged.dfa ? merged.dfa->nstates : 0, merged.dfa ? merged.dfa->nclasses : 0);
+    if(merged.dfa && merged.dfa->bloom_mode == 1){
+        shim_log("/tmp/shim_forks_wl.log", "bloom filter: %u exact/anchored entries, %u bytes, false positives %u.%02u%%\n",
+                 merged.dfa->bloom_keys, merged.dfa->bloom_blocks * 64, merged.dfa->bloom_fpr / 100, merged.dfa->bloom_fpr % 100);
+    }
+}
+
+// Bring the merged whitelist up to date with whatever changed on disk since the last call.
+// Without watch, an index inherited across fork() is used as is instead of setting up a watch
+// of our own; that's for a child that's about to exec anyway.  Such a child may well come from
+// vfork() and share its parent's memory, so it never leaves an inotify fd (or ownership) behind in
+// wl_state: when there's no index yet, one is loaded without a watch, for the parent to take over.
+// Once set up, a thread finding another one reloading doesn't wait for it; it uses what's published.
+static void wl_refresh(int watch){
+    pid_t owner = __atomic_load_n(&wl_state.owner, __ATOMIC_ACQUIRE);
+    if(!watch && owner != getpid()){
+        if(owner == 0 && __atomic_load_n(&wl_state.index, __ATOMIC_ACQUIRE) == NULL){
+            pthread_mutex_lock(&wl_state.lock);
+            if(wl_state.owner == 0 && wl_state.index == NULL){
+                wl_state.ifd = -1;
+                wl_scan_all();
+                wl_rebuild();
+            }
+            pthread_mutex_unlock(&wl_state.lock);
+        }
+        return;
+    }
+    if(owner != getpid()){
+        pthread_mutex_lock(&wl_state.lock);
+        if(wl_state.owner != getpid()){
+            if(wl_state.owner == 0){
+                wl_state.ifd = -1;
+            }
+            wl_watch_start();
+            if(wl_state.dirty){
+                wl_rebuild();
+            }
+            // only now, so other threads never go without an index while this one builds it
+            __atomic_store_n(&wl_state.owner, getpid(), __ATOMIC_RELEASE);
+        }
+    } else if(pthread_mutex_trylock(&wl_state.lock) != 0){
+        return;
+    } else if(wl_state.ifd == -1){
+        wl_rescan(); // no inotify, nothing tells us what changed
+    } else {
+        wl_watch_poll();
+    }
+    if(wl_state.dirty){
+        wl_rebuild();
+    }
+    pthread_mutex_unlock(&wl_state.lock);
+}
+
+// The published index, without bringing it up to date.  Lock-free: it stays valid until the
+// wl_release() of the ticket handed back, however many reloads happen meanwhile.  The ticket is the
+// epoch entered in; anything worked out from the index can be reused as long as the epoch hasn't moved.
+static const struct wl_rules *wl_enter(unsigned int *ticket){
+    const struct wl_rules *wl;
+    unsigned int e;
+    for(;;){
+        e = __atomic_load_n(&wl_state.epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&wl_state.readers[e & 1], 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&wl_state.epoch, __ATOMIC_SEQ_CST) == e){
+            break;
+        }
+        __atomic_fetch_sub(&wl_state.readers[e & 1], 1, __ATOMIC_SEQ_CST); // raced a retirement, go again
+    }
+    *ticket = e;
+    wl = __atomic_load_n(&wl_state.index, __ATOMIC_SEQ_CST);
+    return wl != NULL ? wl : &wl_empty;
+}
+
+#ifndef FORKSHIMD
+// The epoch readers entering now get; see wl_enter().
+static unsigned int wl_epoch(void){
+    return __atomic_load_n(&wl_state.epoch, __ATOMIC_SEQ_CST);
+}
+
+// Whether there's an index to wl_enter(), rather than the empty one standing in until one is loaded.
+static int wl_published(void){
+    return __atomic_load_n(&wl_state.index, __ATOMIC_ACQUIRE) != NULL;
+}
+#endif
+
+// The merged whitelist, brought up to date first (see wl_refresh()).
+const struct wl_rules *wl_current(int watch, unsigned int *ticket){
+    wl_refresh(watch);
+    return wl_enter(ticket);
+}
+
+void wl_release(unsigned int ticket){
+    __atomic_fetch_sub(&wl_state.readers[ticket & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+// fork() from a multithreaded parent: no reload may be half done when the address space is copied,
+// and the child starts with only the forking thread, so nothing other threads were in the middle of
+// (reading the index, setting the shim up) carries over.
+static void shim_atfork_prepare(void){
+    pthread_mutex_lock(&wl_state.lock);
+}
+
+static void shim_atfork_parent(void){
+    pthread_mutex_unlock(&wl_state.lock);
+}
+
+static void shim_atfork_child(void){
+    pthread_mutex_unlock(&wl_state.lock);
+    wl_state.readers[0] = wl_state.readers[1] = 0;
+    shim_tls.shard = 0; // new tid
+    shim_tls.vfork_parent = 0; // a fork()ed child is no vfork() child, whatever its parent did before
+    if(__atomic_load_n(&shim_once, __ATOMIC_RELAXED) == 1){
+        shim_once = 0;
+    }
+}
+
+// More specific rules win, in enum wl_kind order: exact executables, full ('!') matches,
+// executable directories, anchored, globs, then substring matches.  Between rules of the same kind, the one listed first wins.  Either argument may be -1 (no match).
+int wl_pick(const struct wl_rules *wl, int a, int b){
+    if(a == -1 || b == -1){
+        return a == -1 ? b : a;
+    }
+    if(wl->rule[a].kind != wl->rule[b].kind){
+        return wl->rule[a].kind < wl->rule[b].kind ? a : b;
+    }
+    return a < b ? a : b;
+}
+
+// Match one rule the slow way; only used when there is no compiled DFA.
+static int wl_match_rule(const struct wl_rules *wl, size_t i, const char *proc_name, size_t len){
+    const struct wl_rule *r = &wl->rule[i];
+    const char *text = wl->arena + r->off;
+    switch(r->kind){
+    case WL_EXACT:  return !strcmp(text, proc_name);
+    case WL_PREFIX: return len >= r->len && !memcmp(text, proc_name, r->len);
+    case WL_SUFFIX: return len >= r->len && !memcmp(text, proc_name + len - r->len, r->len);
+    case WL_GLOB:   return !fnmatch(text, proc_name, 0);
+    case WL_SUBSTR: return strstr(text, proc_name) != NULL;
+    default:        return(0); // '@' entries only ever see the executable
+
+    }
+}
+
+// Build the path trie of the '@' entries; the first entry for a path wins.
+void wl_exe_build(struct wl_rules *wl){
+    size_t i, cap = 16;
+    wl->nexe = 0;
+    for(i = 0; i < wl->nrules; i++){
+        const struct wl_rule *r = &wl->rule[i];
+        const char *p = wl->arena + r->off, *end = p + r->len, *q;
+        unsigned int n = 0, c;
+        if((r->kind != WL_EXE && r->kind != WL_EXE_DIR) || !r->active){
+            continue;
+        }
+        if(wl->nexe == 0){
+            if((wl->exe = malloc(cap * sizeof(*wl->exe))) == NULL){
+                return;
+            }
+            memset(&wl->exe[0], 0, sizeof(wl->exe[0]));
+            wl->exe[0].exact = wl->exe[0].dir = -1;
+            wl->nexe = 1;
+        }
+        for(;;){
+            while(p < end && *p == '/'){
+                p++;
+            }
+            if(p == end){
+                break;
+            }
+            q = memchr(p, '/', end - p);
+            q = q ? q : end;
+            for(c = wl->exe[n].child; c != 0; c = wl->exe[c].sibling){
+                if(wl->exe[c].len == (size_t)(q - p) && !memcmp(wl->arena + wl->exe[c].off, p, q - p)){
+                    break;
+                }
+            }
+            if(c == 0){
+                if(wl->nexe == cap){
+                    struct wl_exe_node *grown = realloc(wl->exe, cap * 2 * sizeof(*grown));
+                    if(grown == NULL){
+                        return;
+                    }
+                    wl->exe = grown;
+                    cap *= 2;
+                }
+                c = wl->nexe++;
+                wl->exe[c].off = p - wl->arena;
+                wl->exe[c].len = q - p;
+                wl->exe[c].child = 0;
+                wl->exe[c].sibling = wl->exe[n].child;
+                wl->exe[c].exact = wl->exe[c].dir = -1;
+                wl->exe[n].child = c;
+            }
+            n = c;
+            p = q;
+        }
+        if(r->kind == WL_EXE && wl->exe[n].exact == -1){
+            wl->exe[n].exact = i;
+        } else if(r->kind == WL_EXE_DIR && wl->exe[n].dir == -1){
+            wl->exe[n].dir = i;
+        }
+    }
+}
+
+// Log the outcome of checking one proc/flag name.
+static void wl_log_check(const struct wl_rules *wl, const char *proc_name, int best){
+    if(best == -1){
+        shim_log("/tmp/shim_forks_wl.log", "checking for proc/flag name = [%s]\n", proc_name);
+    } else {
+        shim_log("/tmp/shim_forks_wl.log", "proc/arg name=[%s] is whitelisted by entry [%s] (kind %d), score %d\n", proc_name, wl->arena + wl->rule[best].off, wl->rule[best].kind, wl->rule[best].score);
+    }
+}
+
+#define WL_FNV_BASIS 14695981039346656037ull
+#define WL_FNV_STEP(h, c) (((h) ^ (c)) * 1099511628211ull)
+
+static uint64_t wl_bloom_mix(uint64_t h, int kind){
+    h ^= (uint64_t)(kind + 1) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+// Key h is in the filter if all WL_BLOOM_K of its bits are set in its block.
+static int wl_bloom_probe(const struct wl_dfa *dfa, uint64_t h){
+    const uint64_t *blk = dfa->bloom + (((h >> 32) * dfa->bloom_blocks) >> 32) * 8;
+    int k;
+    for(k = 0; k < WL_BLOOM_K; k++, h >>= 9){
+        if(!(blk[(h >> 6) & 7] & (1ull << (h & 63)))){
+            return(0);
+        }
+    }
+    return(1);
+}
+
+static void wl_bloom_insert(struct wl_dfa *dfa, uint64_t h){
+    uint64_t *blk = dfa->bloom + (((h >> 32) * dfa->bloom_blocks) >> 32) * 8;
+    int k;
+    for(k = 0; k < WL_BLOOM_K; k++, h >>= 9){
+        blk[(h >> 6) & 7] |= 1ull << (h & 63);
+    }
+}
+
+// Could an exact or anchored entry match name p[0..len)?  One forward pass hashes the whole name
+// and its prefixes, one backward pass its suffixes, and every hash is one cache line probe.
+static int wl_bloom_maybe(const struct wl_dfa *dfa, const unsigned char *p, size_t len){
+    uint64_t h = WL_FNV_BASIS;
+    size_t i, stop;
+    unsigned int k = 0;
+    if(dfa->bloom_mode != 1){
+        return dfa->bloom_mode == 2;
+    }
+    stop = dfa->bloom_exact ? len : (dfa->npre ? dfa->pre_len[dfa->npre - 1] : 0);
+    for(i = 0; i < stop && i < len; i++){
+        h = WL_FNV_STEP(h, p[i]);
+        for(; k < dfa->npre && dfa->pre_len[k] <= i + 1; k++){
+            if(dfa->pre_len[k] == i + 1 && wl_bloom_probe(dfa, wl_bloom_mix(h, WL_PREFIX))){
+                return(1);
+            }
+        }
+    }
+    if(dfa->bloom_exact && wl_bloom_probe(dfa, wl_bloom_mix(h, WL_EXACT))){
+        return(1);
+    }
+    h = WL_FNV_BASIS;
+    stop = dfa->nsuf ? dfa->suf_len[dfa->nsuf - 1] : 0;
+    for(i = 0, k = 0; i < stop && i < len; i++){
+        h = WL_FNV_STEP(h, p[len - 1 - i]);
+        for(; k < dfa->nsuf && dfa->suf_len[k] <= i + 1; k++){
+            if(dfa->suf_len[k] == i + 1 && wl_bloom_probe(dfa, wl_bloom_mix(h, WL_SUFFIX))){
+                return(1);
+            }
+        }
+    }
+    return(0);
+}
+
+// Returns the rule matching executable path exe[0..len): an exact '@/path' entry, else the deepest
+// '@/dir/' entry above it, else -1.  One walk down the path trie.
+int check_wl_exe(const struct wl_rules *wl, const char *exe, size_t len){
+    const char *p = exe, *end = exe + len, *q;
+    unsigned int n = 0, c;
+    int best = -1;
+    if(wl->nexe == 0){
+        return(-1);
+    }
+    for(;;){
+        while(p < end && *p == '/'){
+            p++;
+        }
+        if(p == end){
+            best = wl->exe[n].exact != -1 ? wl->exe[n].exact : best;
+            break;
+        }
+        if(wl->exe[n].dir != -1){ // there's more path below this node
+            best = wl->exe[n].dir;
+        }
+        q = memchr(p, '/', end - p);
+        q = q ? q : end;
+        for(c = wl->exe[n].child; c != 0; c = wl->exe[c].sibling){
+            if(wl->exe[c].len == (size_t)(q - p) && !memcmp(wl->arena + wl->exe[c].off, p, q - p)){
+                break;
+            }
+        }
+        if(c == 0){
+            break;
+        }
+        n = c;
+        p = q;
+    }
+    wl_log_check(wl, exe, best);
+    return(best);
+}
+
+// Returns the most specific rule matching proc_name[0..len), or -1.  proc_name must be NUL terminated.
+int check_wl_config(const struct wl_rules *wl, const char *proc_name, size_t len){
+    size_t i;
+    int best = -1;
+
+    if(len == 0 || wl->nrules == 0){
+        return(-1);
+    }
+    if(wl->dfa != NULL){
+        const struct wl_dfa *dfa = wl->dfa;
+        const unsigned char *p = (const unsigned char *)proc_name;
+        unsigned int s = dfa->start, m = 0xff;
+        if(len >= WL_PREFILTER_MIN){
+            for(i = 0; i < 3; i++){
+                m &= dfa->pf_lo[i][p[i] & 0x0f] & dfa->pf_hi[i][p[i] >> 4];
+            }
+        }
+        if(m == 0 && !wl_bloom_maybe(dfa, p, len)){
+            best = -1; // rejected by the prefilters, without walking all of a long name
+        } else {
+            for(i = 0; i < len && s != 0; i++){
+                s = dfa->next[s * dfa->nclasses + dfa->cls[p[i]]];
+            }
+            best = dfa->accept[s];
+        }
+    } else {
+        for(i = 0; i < wl->nrules; i++){
+            if(wl->rule[i].active && wl_match_rule(wl, i, proc_name, len)){
+                best = wl_pick(wl, best, i);
+            }
+        }
+    }
+    wl_log_check(wl, proc_name, best);
+    return(best);
+}
+
+// Whitelist compiler: every entry becomes a small NFA, all of them are joined under one start set,
+// turned into a DFA by subset construction over byte classes, and minimized (Moore's partition
+// refinement) into the flat table check_wl_config() walks.
+
+#define SET_ADD(set, b) ((set)[(b) >> 3] |= (unsigned char)(1 << ((b) & 7)))
+#define SET_HAS(set, b) ((set)[(b) >> 3] & (1 << ((b) & 7)))
+
+struct nfa_state {
+    unsigned char set[32]; // bytes that move on to 'next'
+    int next;              // -1 = no byte transition
+    int eps;               // free move to another state, -1 = none
+    int rule;              // rule matched when the input ends here, -1 = none
+};
+
+struct wl_build {
+    const struct wl_rules *wl;
+    struct nfa_state *nfa;        // all entries' NFAs, back to back
+    int nnfa, nfa_cap;
+    int *entry;                   // NFA states the combined automaton starts in
+    int nentry, entry_cap;
+    unsigned char cls[256], rep[256]; // byte -> class, class -> one byte of it
+    unsigned int nclasses;
+    int *pool;                    // NFA state subsets of the DFA states, back to back
+    size_t pool_len, pool_cap;
+    size_t *sub_off;
+    unsigned int *sub_len;
+    unsigned int *next;           // unminimized DFA
+    int *accept;
+    unsigned int nstates, states_cap;
+    unsigned int *slot;           // subset hash -> DFA state + 1
+    size_t nslots;
+    unsigned int *mark, gen;      // per NFA state, dedups subset members
+    int *tmp;
+    unsigned int ntmp;
+};
+
+static int wl_nfa_add(struct wl_build *b){
+    if(b->nnfa == b->nfa_cap){
+        int cap = b->nfa_cap ? b->nfa_cap * 2 : 256;
+        struct nfa_state *grown = realloc(b->nfa, cap * sizeof(*grown));
+        if(grown == NULL){
+            return(-1);
+        }
+        b->nfa = grown;
+        b->nfa_cap = cap;
+    }
+    memset(b->nfa[b->nnfa].set, 0, sizeof(b->nfa[b->nnfa].set));
+    b->nfa[b->nnfa].next = -1;
+    b->nfa[b->nnfa].eps = -1;
+    b->nfa[b->nnfa].rule = -1;
+    return(b->nnfa++);
+}
+
+static int wl_nfa_entry(struct wl_build *b, int st){
+    if(b->nentry == b->entry_cap){
+        int cap = b->entry_cap ? b->entry_cap * 2 : 64;
+        int *grown = realloc(b->entry, cap * sizeof(*grown));
+        if(grown == NULL){
+            return(-1);
+        }
+        b->entry = grown;
+        b->entry_cap = cap;
+    }
+    b->entry[b->nentry++] = st;
+    return(0);
+}
+
+// The POSIX class named by the len bytes at name (after '[:', up to ':]') added to set, C locale.
+// 0 if there's no such class.
+static int wl_glob_posix_class(const unsigned char *name, size_t len, unsigned char *set){
+    static const char *const names[] = { "alnum", "alpha", "blank", "cntrl", "digit", "graph",
+                                         "lower", "print", "punct", "space", "upper", "xdigit" };
+    int k, b, in, lower, upper, digit;
+    for(k = 0; k < (int)(sizeof(names) / sizeof(*names)); k++){
+        if(strlen(names[k]) == len && !memcmp(names[k], name, len)){
+            break;
+        }
+    }
+    if(k == (int)(sizeof(names) / sizeof(*names))){
+        return(0);
+    }
+    for(b = 0; b < 128; b++){
+        lower = b >= 'a' && b <= 'z';
+        upper = b >= 'A' && b <= 'Z';
+        digit = b >= '0' && b <= '9';
+        switch(k){
+        case 0:  in = lower || upper || digit; break;
+        case 1:  in = lower || upper; break;
+        case 2:  in = b == ' ' || b == '\t'; break;
+        case 3:  in = b < 0x20 || b == 0x7f; break;
+        case 4:  in = digit; break;
+        case 5:  in = b > 0x20 && b < 0x7f; break;
+        case 6:  in = lower; break;
+        case 7:  in = b >= 0x20 && b < 0x7f; break;
+        case 8:  in = b > 0x20 && b < 0x7f && !lower && !upper && !digit; break;
+        case 9:  in = b == ' ' || (b >= '\t' && b <= '\r'); break;
+        case 10: in = upper; break;
+        default: in = digit || (b >= 'a' && b <= 'f') || (b >= 'A' && b <= 'F'); break;
+        }
+        if(in){
+            SET_ADD(set, b);
+        }
+    }
+    return(1);
+}
+
+// Parse a '[...]' glob bracket into set the way fnmatch() without flags does in the C locale:
+// ranges, '\' escapes and '[:class:]'; a ']' right after the '[' (or its '!' or '^') is a member.
+// Returns its length; 0 if it isn't terminated (fnmatch() then treats the '[' as a literal, so do
+// we); WL_GLOB_BAD where fnmatch() fails the whole pattern (an unknown class, a '\' or range
+// cut off by the end) or would need the locale ('[=e=]', '[.a.]').
+static size_t wl_glob_class(const unsigned char *p, size_t len, unsigned char *set){
+    unsigned char in[32];
+    size_t i = 1, n;
+    int neg = 0, b, lo, hi;
+    memset(in, 0, sizeof(in));
+    if(i < len && (p[i] == '!' || p[i] == '^')){
+        neg = 1;
+        i++;
+    }
+    do {
+        if(i >= len){
+            return(0);
+        }
+        if(p[i] == '[' && i + 1 < len && (p[i+1] == '=' || p[i+1] == '.')){
+            return(WL_GLOB_BAD);
+        }
+        if(p[i] == '[' && i + 1 < len && p[i+1] == ':'){
+            // only lowercase letters up to ':]' make a class name; anything else and the '[' is a member
+            for(n = i + 2; n < len && p[n] >= 'a' && p[n] < 'z'; n++){
+            }
+            if(n + 1 < len && p[n] == ':' && p[n+1] == ']'){
+                if(!wl_glob_posix_class(p + i + 2, n - i - 2, in)){
+                    return(WL_GLOB_BAD);
+                }
+                i = n + 2;
+                continue;
+            }
+        }
+        if(p[i] == '\\' && ++i >= len){
+            return(WL_GLOB_BAD);
+        }
+        lo = hi = p[i++];
+        if(i + 1 < len && p[i] == '-' && p[i+1] != ']'){
+            i++;
+            if(p[i] == '\\' && ++i >= len){
+                return(WL_GLOB_BAD);
+            }
+            hi = p[i++];
+        } else if(i + 1 == len && p[i] == '-'){
+            return(WL_GLOB_BAD); // a range without its end
+        }
+        for(b = lo; b <= hi; b++){
+            SET_ADD(in, b);
+        }
+    } while(i >= len || p[i] != ']');
+    for(b = 0; b < 256; b++){
+        if(!SET_HAS(in, b) != !neg){
+            SET_ADD(set, b);
+        }
+    }
+    return(i + 1);
+}
+
+// Whether fnmatch() can ever match the glob at p, and means by it what the DFA will.
+static int wl_glob_ok(const char *p, size_t len){
+    const unsigned char *t = (const unsigned char *)p;
+    unsigned char set[32];
+    size_t k, used;
+    for(k = 0; k < len; k += used){
+        used = 1;
+        if(t[k] == '\\'){
+            if(k + 1 == len){
+                return(0); // fnmatch() matches nothing with a trailing '\'
+            }
+            used = 2;
+        } else if(t[k] == '[' && (used = wl_glob_class(t + k, len - k, set)) == WL_GLOB_BAD){
+            return(0);
+        } else if(used == 0){
+            used = 1; // an unterminated '[' is a literal
+        }
+    }
+    return(1);
+}
+
+// Append the NFA of rule i.  Each state's byte transition goes to the state after it unless noted.
+static int wl_nfa_rule(struct wl_build *b, int i){
+    const struct wl_rule *r = &b->wl->rule[i];
+    const unsigned char *t = (const unsigned char *)b->wl->arena + r->off;
+    int first = b->nnfa, st;
+    size_t k, used;
+
+    if(r->kind == WL_EXE || r->kind == WL_EXE_DIR){
+        return(0); // matched through the path trie instead
+    }
+    if(r->kind == WL_SUFFIX){ // anything, then the text
+        if((st = wl_nfa_add(b)) == -1){
+            return(-1);
+        }
+        memset(b->nfa[st].set, 0xff, sizeof(b->nfa[st].set));
+        b->nfa[st].next = st;
+        b->nfa[st].eps = st + 1;
+    }
+    for(k = 0; k < r->len; k += used){
+        if((st = wl_nfa_add(b)) == -1){
+            return(-1);
+        }
+        b->nfa[st].next = st + 1;
+        used = 1;
+        if(r->kind == WL_GLOB && t[k] == '*'){
+            memset(b->nfa[st].set, 0xff, sizeof(b->nfa[st].set));
+            b->nfa[st].next = st;
+            b->nfa[st].eps = st + 1;
+        } else if(r->kind == WL_GLOB && t[k] == '?'){
+            memset(b->nfa[st].set, 0xff, sizeof(b->nfa[st].set));
+        } else if(r->kind == WL_GLOB && t[k] == '[' && (used = wl_glob_class(t + k, r->len - k, b->nfa[st].set)) > 0){
+            // bracket set filled in by wl_glob_class()
+        } else {
+            used = 1;
+            if(r->kind == WL_GLOB && t[k] == '\\' && k + 1 < r->len){
+                used = 2; // escaped metacharacter
+            }
+            SET_ADD(b->nfa[st].set, t[k + used - 1]);
+        }
+        if(r->kind == WL_SUBSTR){
+            // a substring may start at any position and end after any position
+            if(wl_nfa_entry(b, st) == -1){
+                return(-1);
+            }
+            if(k > 0){
+                b->nfa[st].rule = i;
+            }
+        }
+    }
+    if((st = wl_nfa_add(b)) == -1){
+        return(-1);
+    }
+    b->nfa[st].rule = i;
+    if(r->kind == WL_PREFIX){ // the text, then anything
+        memset(b->nfa[st].set, 0xff, sizeof(b->nfa[st].set));
+        b->nfa[st].next = st;
+    }
+    return(r->kind == WL_SUBSTR ? 0 : wl_nfa_entry(b, first));
+}
+
+// Split the 256 byte values into classes no NFA state tells apart.
+static void wl_byte_classes(struct wl_build *b){
+    unsigned char single[32];
+    int map[512], q, c;
+    memset(b->cls, 0, sizeof(b->cls));
+    memset(single, 0, sizeof(single));
+    b->nclasses = 1;
+    for(q = 0; q < b->nnfa; q++){
+        const unsigned char *set = b->nfa[q].set;
+        unsigned int n = 0;
+        int last = -1;
+        for(c = 0; c < 256; c++){
+            if(SET_HAS(set, c)){
+                n++;
+                last = c;
+            }
+        }
+        if(n == 0 || n == 256 || (n == 1 && SET_HAS(single, last))){
+            continue; // splits nothing, or the same single byte was split off already
+        }
+        if(n == 1){
+            SET_ADD(single, last);
+        }
+        for(c = 0; c < (int)(2 * b->nclasses); c++){
+            map[c] = -1;
+        }
+        n = 0;
+        for(c = 0; c < 256; c++){
+            int key = b->cls[c] * 2 + !!SET_HAS(set, c);
+            if(map[key] == -1){
+                map[key] = n++;
+            }
+            b->cls[c] = map[key];
+        }
+        b->nclasses = n;
+    }
+    for(c = 255; c >= 0; c--){
+        b->rep[b->cls[c]] = c;
+    }
+}
+
+static void wl_subset_add(struct wl_build *b, int q){
+    for(; q != -1 && b->mark[q] != b->gen; q = b->nfa[q].eps){
+        b->mark[q] = b->gen;
+        b->tmp[b->ntmp++] = q;
+    }
+}
+
+// Order independent, so subsets never need sorting.
+static unsigned int wl_subset_hash(const int *s, unsigned int n){
+    unsigned int h = n;
+    while(n--){
+        unsigned int x = (unsigned int)*s++ * 2654435761u;
+        h += x ^ (x >> 15);
+    }
+    return h;
+}
+
+// Find the DFA state for the subset in b->tmp, adding it if it's new.  Returns -1 when the state
+// limit is hit or memory runs out.
+static long wl_subset_state(struct wl_build *b){
+    unsigned int h, s, i;
+    int accept = -1;
+    h = wl_subset_hash(b->tmp, b->ntmp);
+    for(i = h & (b->nslots - 1); b->slot[i] != 0; i = (i + 1) & (b->nslots - 1)){
+        const int *member;
+        unsigned int k;
+        s = b->slot[i] - 1;
+        if(b->sub_len[s] != b->ntmp){
+            continue;
+        }
+        // same size and every member is marked in the current generation -> same subset
+        for(member = b->pool + b->sub_off[s], k = 0; k < b->ntmp && b->mark[member[k]] == b->gen; k++){
+        }
+        if(k == b->ntmp){
+            return(s);
+        }
+    }
+    if((size_t)(b->nstates + 1) * b->nclasses > WL_DFA_MAX_CELLS){
+        return(-1);
+    }
+    if(b->nstates == b->states_cap){
+        unsigned int cap = b->states_cap * 2;
+        size_t *off = realloc(b->sub_off, cap * sizeof(*off));
+        unsigned int *len = off ? realloc(b->sub_len, cap * sizeof(*len)) : NULL;
+        unsigned int *next = len ? realloc(b->next, (size_t)cap * b->nclasses * sizeof(*next)) : NULL;
+        int *acc = next ? realloc(b->accept, cap * sizeof(*acc)) : NULL;
+        if(off) b->sub_off = off;
+        if(len) b->sub_len = len;
+        if(next) b->next = next;
+        if(acc == NULL){
+            return(-1);
+        }
+        b->accept = acc;
+        b->states_cap = cap;
+    }
+    if(b->pool_len + b->ntmp > b->pool_cap){
+        size_t cap = b->pool_cap;
+        int *grown;
+        while(cap < b->pool_len + b->ntmp){
+            cap *= 2;
+        }
+        if((grown = realloc(b->pool, cap * sizeof(*grown))) == NULL){
+            return(-1);
+        }
+        b->pool = grown;
+        b->pool_cap = cap;
+    }
+    if((b->nstates + 1) * 2 > b->nslots){ // keep the subset table at most half full
+        size_t nslots = b->nslots * 2, j;
+        unsigned int *slot = calloc(nslots, sizeof(*slot));
+        if(slot == NULL){
+            return(-1);
+        }
+        for(s = 0; s < b->nstates; s++){
+            for(j = wl_subset_hash(b->pool + b->sub_off[s], b->sub_len[s]) & (nslots - 1); slot[j] != 0; j = (j + 1) & (nslots - 1)){
+            }
+            slot[j] = s + 1;
+        }
+        free(b->slot);
+        b->slot = slot;
+        b->nslots = nslots;
+    }
+    s = b->nstates++;
+    b->sub_off[s] = b->pool_len;
+    b->sub_len[s] = b->ntmp;
+    memcpy(b->pool + b->pool_len, b->tmp, b->ntmp * sizeof(*b->tmp));
+    b->pool_len += b->ntmp;
+    for(i = 0; i < b->ntmp; i++){
+        accept = wl_pick(b->wl, accept, b->nfa[b->tmp[i]].rule);
+    }
+    b->accept[s] = accept;
+    memset(b->next + (size_t)s * b->nclasses, 0, b->nclasses * sizeof(*b->next));
+    for(i = h & (b->nslots - 1); b->slot[i] != 0; i = (i + 1) & (b->nslots - 1)){
+    }
+    b->slot[i] = s + 1;
+    return(s);
+}
+
+// Merge equivalent states of the subset-construction DFA and emit the final flat table.
+static struct wl_dfa *wl_minimize(struct wl_build *b, unsigned int start){
+    const unsigned int n = b->nstates, C = b->nclasses;
+    unsigned int *blk = malloc(n * sizeof(*blk)), *nblk = malloc(n * sizeof(*nblk));
+    unsigned int *slot = NULL, *map = NULL, nslots = 16, count = 0, s, c, i;
+    unsigned char *seen;
+    struct wl_dfa *dfa = NULL;
+
+    while(nslots < n * 2){
+        nslots *= 2;
+    }
+    if(blk == NULL || nblk == NULL || (slot = malloc(nslots * sizeof(*slot))) == NULL || (map = malloc(n * sizeof(*map))) == NULL){
+        goto out;
+    }
+    // start from "same accepted rule", then split blocks whose states move to different blocks
+    if((seen = calloc(b->wl->nrules + 1, 1)) == NULL){
+        goto out;
+    }
+    for(s = 0; s < n; s++){
+        blk[s] = b->accept[s] + 1;
+        if(!seen[blk[s]]){
+            seen[blk[s]] = 1;
+            count++;
+        }
+    }
+    free(seen);
+    for(;;){
+        unsigned int ncount = 0;
+        memset(slot, 0xff, nslots * sizeof(*slot));
+        for(s = 0; s < n; s++){
+            const unsigned int *row = b->next + (size_t)s * C;
+            unsigned int h = blk[s] * 2654435761u;
+            for(c = 0; c < C; c++){
+                h = (h ^ blk[row[c]]) * 16777619u;
+            }
+            for(i = h & (nslots - 1); slot[i] != 0xffffffffu; i = (i + 1) & (nslots - 1)){
+                const unsigned int r = slot[i], *rrow = b->next + (size_t)r * C;
+                if(blk[r] != blk[s]){
+                    continue;
+                }
+                for(c = 0; c < C && blk[rrow[c]] == blk[row[c]]; c++){
+                }
+                if(c == C){
+                    break;
+                }
+            }
+            if(slot[i] == 0xffffffffu){
+                slot[i] = s;
+                map[s] = ncount++;
+            }
+            nblk[s] = map[slot[i]];
+        }
+        memcpy(blk, nblk, n * sizeof(*blk));
+        if(ncount == count){
+            break;
+        }
+        count = ncount;
+    }
+    // renumber so the dead state stays 0
+    for(s = 0; s < n; s++){
+        map[s] = 0xffffffffu;
+    }
+    map[blk[0]] = 0;
+    count = 1;
+    for(s = 1; s < n; s++){
+        if(map[blk[s]] == 0xffffffffu){
+            map[blk[s]] = count++;
+        }
+    }
+    if((dfa = calloc(1, sizeof(*dfa))) == NULL){
+        goto out;
+    }
+    dfa->next = malloc((size_t)count * C * sizeof(*dfa->next));
+    dfa->accept = malloc(count * sizeof(*dfa->accept));
+    if(dfa->next == NULL || dfa->accept == NULL){
+        wl_dfa_free(dfa);
+        dfa = NULL;
+        goto out;
+    }
+    for(s = 0; s < n; s++){
+        const unsigned int id = map[blk[s]];
+        for(c = 0; c < C; c++){
+            dfa->next[(size_t)id * C + c] = map[blk[b->next[(size_t)s * C + c]]];
+        }
+        dfa->accept[id] = b->accept[s];
+    }
+    memcpy(dfa->cls, b->cls, sizeof(dfa->cls));
+    dfa->nclasses = C;
+    dfa->nstates = count;
+    dfa->start = map[blk[start]];
+out:
+    free(blk);
+    free(nblk);
+    free(slot);
+    free(map);
+    return dfa;
+}
+
+// Let byte c (or any byte, c == -1) through at name position j for the entries in bucket bit.
+static void wl_pf_set(struct wl_dfa *dfa, int j, int c, unsigned char bit){
+    int k;
+    for(; j < 3; j++){
+        if(c != -1){
+            dfa->pf_lo[j][c & 0x0f] |= bit;
+            dfa->pf_hi[j][c >> 4] |= bit;
+            return;
+        }
+        for(k = 0; k < 16; k++){ // any byte here, and (since we can't tell) at every later position
+            dfa->pf_lo[j][k] |= bit;
+            dfa->pf_hi[j][k] |= bit;
+        }
+    }
+}
+
+// Fill the prefilter masks: which bytes each admitted substring or glob entry allows at a name's
+// positions 0..2.
+// Entries are spread over 8 buckets; positions an entry can't pin down let every byte through.
+static void wl_prefilter(struct wl_dfa *dfa, const struct wl_rules *wl, const unsigned char *admit){
+    size_t i, k, j, used;
+    for(i = 0; i < wl->nrules; i++){
+        const struct wl_rule *r = &wl->rule[i];
+        const unsigned char *t = (const unsigned char *)wl->arena + r->off;
+        const unsigned char bit = 1 << (i & 7);
+        if(!admit[i]){
+            continue;
+        }
+        switch(r->kind){
+        case WL_EXE:
+        case WL_EXE_DIR:
+            break; // never matched against names
+        case WL_EXACT:
+        case WL_PREFIX:
+        case WL_SUFFIX:
+            break; // the Bloom filter's
+        case WL_GLOB:
+            for(k = j = 0; j < 3; j++, k += used){
+                unsigned char set[32];
+                int c;
+                used = 1;
+                memset(set, 0, sizeof(set));
+                if(k >= r->len || t[k] == '*'){
+                    wl_pf_set(dfa, j, -1, bit);
+                    break;
+                } else if(t[k] == '?'){
+                    wl_pf_set(dfa, j, -1, bit);
+                } else if(t[k] == '[' && (used = wl_glob_class(t + k, r->len - k, set)) > 0){
+                    for(c = 0; c < 256; c++){
+                        if(SET_HAS(set, c)){
+                            wl_pf_set(dfa, j, c, bit);
+                        }
+                    }
+                } else {
+                    used = (t[k] == '\\' && k + 1 < r->len) ? 2 : 1;
+                    wl_pf_set(dfa, j, t[k + used - 1], bit);
+                }
+            }
+            break;
+        default:
+            // a substring may start anywhere in the entry
+            for(k = 0; k < r->len; k++){
+                for(j = 0; j < 3; j++){
+                    wl_pf_set(dfa, j, k + j < r->len ? t[k + j] : -1, bit);
+                    if(k + j >= r->len){
+                        break;
+                    }
+                }
+            }
+            break;
+        }
+    }
+}
+
+static int wl_len_add(unsigned int *lens, unsigned char *n, unsigned int len){
+    unsigned int i;
+    for(i = 0; i < *n && lens[i] < len; i++){
+    }
+    if(i < *n && lens[i] == len){
+        return(1);
+    }
+    if(*n == WL_BLOOM_LENS){
+        return(0);
+    }
+    memmove(lens + i + 1, lens + i, (*n - i) * sizeof(*lens));
+    lens[i] = len;
+    (*n)++;
+    return(1);
+}
+
+// Build the Bloom filter over the admitted exact and anchored entries, and measure its false
+// positive rate on a few thousand random keys.
+static void wl_bloom_build(struct wl_dfa *dfa, const struct wl_rules *wl, const unsigned char *admit){
+    uint64_t x = 0x2545f4914f6cdd1dull;
+    size_t i, k;
+    unsigned int fp = 0;
+    dfa->bloom_mode = 0;
+    for(i = 0; i < wl->nrules; i++){
+        const struct wl_rule *r = &wl->rule[i];
+        if(!admit[i] || !WL_BLOOM_KIND(r->kind)){
+            continue;
+        }
+        dfa->bloom_keys++;
+        dfa->bloom_exact |= r->kind == WL_EXACT;
+        if((r->kind == WL_PREFIX && !wl_len_add(dfa->pre_len, &dfa->npre, r->len)) ||
+           (r->kind == WL_SUFFIX && !wl_len_add(dfa->suf_len, &dfa->nsuf, r->len))){
+            dfa->bloom_mode = 2;
+            return;
+        }
+    }
+    if(dfa->bloom_keys == 0){
+        return;
+    }
+    dfa->bloom_blocks = (dfa->bloom_keys * WL_BLOOM_BITS_PER_KEY + 511) / 512;
+    if((dfa->bloom = calloc(dfa->bloom_blocks * 8, sizeof(*dfa->bloom))) == NULL){
+        dfa->bloom_mode = 2;
+        return;
+    }
+    for(i = 0; i < wl->nrules; i++){
+        const struct wl_rule *r = &wl->rule[i];
+        const unsigned char *t = (const unsigned char *)wl->arena + r->off;
+        uint64_t h = WL_FNV_BASIS;
+        if(!admit[i] || !WL_BLOOM_KIND(r->kind)){
+            continue;
+        }
+        for(k = 0; k < r->len; k++){ // suffixes are hashed back to front, like wl_bloom_maybe() does
+            h = WL_FNV_STEP(h, t[r->kind == WL_SUFFIX ? r->len - 1 - k : k]);
+        }
+        wl_bloom_insert(dfa, wl_bloom_mix(h, r->kind));
+    }
+    for(i = 0; i < 4096; i++){
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        fp += wl_bloom_probe(dfa, wl_bloom_mix(x, WL_EXACT));
+    }
+    dfa->bloom_fpr = fp * 10000 / 4096;
+    dfa->bloom_mode = 1;
+}
+
+// Compile the admitted rules (admit[i] != 0) into one minimized DFA.  Returns NULL if that needs
+// more than WL_DFA_MAX_CELLS table cells or memory runs out.
+static struct wl_dfa *wl_compile_set(const struct wl_rules *wl, const unsigned char *admit){
+    struct wl_build b;
+    struct wl_dfa *dfa = NULL;
+    unsigned int s, c, i;
+    long start, t;
+
+    memset(&b, 0, sizeof(b));
+    b.wl = wl;
+    for(i = 0; i < wl->nrules; i++){
+        if(admit[i] && wl_nfa_rule(&b, i) == -1){
+            goto out;
+        }
+    }
+    wl_byte_classes(&b);
+    b.states_cap = 64;
+    b.pool_cap = 256;
+    b.nslots = 128;
+    b.sub_off = malloc(b.states_cap * sizeof(*b.sub_off));
+    b.sub_len = malloc(b.states_cap * sizeof(*b.sub_len));
+    b.next = malloc((size_t)b.states_cap * b.nclasses * sizeof(*b.next));
+    b.accept = malloc(b.states_cap * sizeof(*b.accept));
+    b.pool = malloc(b.pool_cap * sizeof(*b.pool));
+    b.slot = calloc(b.nslots, sizeof(*b.slot));
+    b.mark = calloc(b.nnfa + 1, sizeof(*b.mark));
+    b.tmp = malloc((b.nnfa + 1) * sizeof(*b.tmp));
+    if(!b.sub_off || !b.sub_len || !b.next || !b.accept || !b.pool || !b.slot || !b.mark || !b.tmp){
+        goto out;
+    }
+    b.ntmp = 0;
+    wl_subset_state(&b); // the dead state, always 0
+    b.gen++;
+    for(i = 0; i < (unsigned int)b.nentry; i++){
+        wl_subset_add(&b, b.entry[i]);
+    }
+    if((start = wl_subset_state(&b)) == -1){
+        goto out;
+    }
+    // states are appended as they're discovered, so walking the array is the worklist
+    for(s = 1; s < b.nstates; s++){
+        for(c = 0; c < b.nclasses; c++){
+            const unsigned char byte = b.rep[c];
+            b.gen++;
+            b.ntmp = 0;
+            for(i = 0; i < b.sub_len[s]; i++){
+                const struct nfa_state *q = &b.nfa[b.pool[b.sub_off[s] + i]];
+                if(q->next != -1 && SET_HAS(q->set, byte)){
+                    wl_subset_add(&b, q->next);
+                }
+            }
+            if((t = wl_subset_state(&b)) == -1){
+                goto out;
+            }
+            b.next[(size_t)s * b.nclasses + c] = t;
+        }
+    }
+    if((dfa = wl_minimize(&b, start)) != NULL){
+        wl_prefilter(dfa, wl, admit);
+        wl_bloom_build(dfa, wl, admit);
+    }
+out:
+    free(b.nfa);
+    free(b.entry);
+    free(b.pool);
+    free(b.sub_off);
+    free(b.sub_len);
+    free(b.next);
+    free(b.accept);
+    free(b.slot);
+    free(b.mark);
+    free(b.tmp);
+    return dfa;
+}
+
+// Admit rules lo..hi-1 if the DFA still fits with them, otherwise split the range and try the
+// halves, down to single rules which are then rejected.  Cheap when nothing (or little) is rejected.
+static struct wl_dfa *wl_compile_range(const struct wl_rules *wl, unsigned char *admit, size_t lo, size_t hi, struct wl_dfa *dfa){
+    struct wl_dfa *next;
+    size_t i;
+    if(lo >= hi){
+        return dfa;
+    }
+    for(i = lo; i < hi; i++){
+        admit[i] = wl->rule[i].active;
+    }
+    if((next = wl_compile_set(wl, admit)) != NULL){
+        wl_dfa_free(dfa);
+        return next;
+    }
+    memset(admit + lo, 0, hi - lo);
+    if(hi - lo == 1){
+        shim_log("/tmp/shim_forks_wl.log", "whitelist entry [%s] ignored: compiled whitelist would exceed %d table cells\n", wl->arena + wl->rule[lo].off, WL_DFA_MAX_CELLS);
+        return dfa;
+    }
+    i = lo + (hi - lo) / 2;
+    dfa = wl_compile_range(wl, admit, lo, i, dfa);
+    return wl_compile_range(wl, admit, i, hi, dfa);
+}
+
+// Compile every rule of the merged index into one minimized DFA.  Matching is then a single table
+// walk per name whatever the rules are, so the time spent at fork() is linear in the command line.
+// To keep that a guarantee, entries that would blow the table budget (glob soup like '~*a*b*c*d?')
+// are rejected here, at load time, rather than falling back to backtracking matches per fork.
+// Returns NULL only when memory runs out; check_wl_config() then scans the rules.
+struct wl_dfa *wl_compile(const struct wl_rules *wl){
+    unsigned char *admit = malloc(wl->nrules + 1);
+    struct wl_dfa *dfa;
+    size_t i;
+    if(admit == NULL){
+        return NULL;
+    }
+    for(i = 0; i < wl->nrules; i++){
+        admit[i] = wl->rule[i].active; // entries whose conditions don't hold here never match
+    }
+    if((dfa = wl_compile_set(wl, admit)) == NULL && wl->nrules > 0){
+        // Literal entries grow the DFA linearly; globs are what multiply states.  Settle the
+        // literal entries first, then try the globs one at a time, in file order.
+        size_t lo;
+        for(i = 0; i < wl->nrules; i++){
+            admit[i] = 0;
+        }
+        if((dfa = wl_compile_set(wl, admit)) != NULL){ // the empty DFA, so there is always one to fall back to
+            for(lo = i = 0; i <= wl->nrules; i++){
+                if(i == wl->nrules || wl->rule[i].kind == WL_GLOB){
+                    dfa = wl_compile_range(wl, admit, lo, i, dfa);
+                    lo = i + 1;
+                }
+            }
+            for(i = 0; i < wl->nrules; i++){
+                if(wl->rule[i].kind == WL_GLOB){
+                    dfa = wl_compile_range(wl, admit, i, i + 1, dfa);
+                }
+            }
+        }
+    }
+    free(admit);
+    return dfa;
+}
+
+void wl_dfa_free(struct wl_dfa *dfa){
+    if(dfa != NULL){
+        free(dfa->bloom);
+        free(dfa->next);
+        free(dfa->accept);
+        free(dfa);
+    }
+}
+
+#ifdef FORKSHIMD
+// forkshimd: the whitelist engine, run once for everybody.  Shims send a record per fork (see
+// shim_daemon_send()); they're taken off each connection FORKSHIMD_BATCH at a time, classified against
+// one index (or, with 'parent:'/'lineage:' entries around, one merged for the sender) and scored.
+// With -n it also follows every fork, exec and exit on the host through the netlink process
+// connector, and classifies each exec the way the shim's exec*() would have.
+
+// A record as received, and what came with it.
+struct forkshimd_job {
+    struct forkshimd_record rec;
+    char data[FORKSHIMD_ARGV_MAX + PATH_MAX + SHIM_LINEAGE_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } ctl;
+    int pidfd;                 // -1 = no (valid) record
+    struct ucred cred;         // the sender, as the kernel has it
+};
+
+static struct forkshimd_job forkshimd_jobs[FORKSHIMD_BATCH];
+
+// Indexes merged for particular senders: 'parent:' and 'lineage:' are settled at merge time, so
+// senders need their own unless the same conditional entries apply to them.  That set (a bit per
+// conditional entry of the global index) is what they're kept by, so every shell below puppet
+// shares one.  FORKSHIMD_CONTEXT_WAYS-way set associative, least recently used out first.
+static struct {
+    uint64_t key;              // hash of mask, 0 = empty
+    unsigned int gen;          // wl_epoch() + 1 it was merged at
+    unsigned long used;        // forkshimd_ctx_clock when last handed out
+    uint64_t *mask;            // the conditional entries that apply
+    struct wl_rules index;
+} forkshimd_ctx[FORKSHIMD_CONTEXTS];
+
+static unsigned long forkshimd_ctx_clock;
+
+// Decisions already made, by command line (plus executable, and sender, when those matter).
+static struct {
+    uint64_t key;
+    unsigned int gen;          // wl_epoch() + 1 it was made at, 0 = empty
+    int best;                  // most specific rule matched, -1 = none
+} forkshimd_cache[FORKSHIMD_CACHE];
+
+// Key for a sender's identity, as far as 'parent:' and 'lineage:' go; never 0.
+static uint64_t forkshimd_ctx_key(const char *exe, size_t exeLen, const char *comm, const char *lineage, size_t lineageLen){
+    return shim_l1_hash(shim_l1_hash(shim_l1_hash(0, exe, exeLen), comm, strnlen(comm, 16)), lineage, lineageLen) | 1;
+}
+
+// The index for a sender's children, out of global's generation gen: merged on first use by any
+// sender the same conditional entries apply to, NULL if that fails.  *ctx is set to a key for it
+// (0 with NULL), to keep decisions made with different indexes apart.
+static const struct wl_rules *forkshimd_context(const struct wl_rules *global, const char *exe, size_t exeLen, const char *comm,
+                                                const char *lineage, size_t lineageLen, unsigned int gen, uint64_t *ctx){
+    static uint64_t *mask;
+    static size_t cap;
+    char exeBuf[PATH_MAX], commBuf[16], lineageBuf[SHIM_LINEAGE_MAX];
+    struct shim_who who = { exeBuf, exeBuf, commBuf, lineageBuf };
+    size_t i, c, words = global->nconditional / 64 + 1, total, set, slot;
+    uint64_t key;
+    *ctx = 0;
+    if(words > cap){
+        free(mask);
+        if((mask = malloc(words * sizeof(*mask))) == NULL){
+            cap = 0;
+            return NULL;
+        }
+        cap = words;
+    }
+    exeLen = exeLen < sizeof(exeBuf) ? exeLen : sizeof(exeBuf) - 1;
+    memcpy(exeBuf, exe, exeLen);
+    exeBuf[exeLen] = 0x00;
+    who.base = strrchr(exeBuf, '/') ? strrchr(exeBuf, '/') + 1 : exeBuf;
+    memcpy(commBuf, comm, sizeof(commBuf));
+    commBuf[sizeof(commBuf) - 1] = 0x00;
+    lineageLen = lineageLen < sizeof(lineageBuf) ? lineageLen : sizeof(lineageBuf) - 1;
+    memcpy(lineageBuf, lineage, lineageLen);
+    lineageBuf[lineageLen] = 0x00;
+    memset(mask, 0, words * sizeof(*mask));
+    for(i = 0, c = 0; i < global->nrules; i++){
+        const struct wl_rule *r = &global->rule[i];
+        if(r->opt[WL_OPT_PARENT] != WL_NONE || r->opt[WL_OPT_LINEAGE] != WL_NONE){
+            mask[c / 64] |= (uint64_t)wl_rule_applies(global, r, &who) << (c % 64);
+            c++;
+        }
+    }
+    key = shim_l1_hash(0, (const char *)mask, words * sizeof(*mask)) | 1;
+    set = key % (FORKSHIMD_CONTEXTS / FORKSHIMD_CONTEXT_WAYS) * FORKSHIMD_CONTEXT_WAYS;
+    for(slot = set, i = set; i < set + FORKSHIMD_CONTEXT_WAYS; i++){
+        if(forkshimd_ctx[i].key == key && forkshimd_ctx[i].gen == gen && !memcmp(forkshimd_ctx[i].mask, mask, words * sizeof(*mask))){
+            forkshimd_ctx[i].used = ++forkshimd_ctx_clock;
+            *ctx = key;
+            return &forkshimd_ctx[i].index;
+        }
+        // the way to reuse: an empty one, else one from an older generation, else the least recently used
+        if(forkshimd_ctx[slot].key != 0 && (forkshimd_ctx[i].key == 0 || (forkshimd_ctx[slot].gen == gen &&
+           (forkshimd_ctx[i].gen != gen || forkshimd_ctx[i].used < forkshimd_ctx[slot].used)))){
+            slot = i;
+        }
+    }
+    if(forkshimd_ctx[slot].key != 0){
+        wl_free(&forkshimd_ctx[slot].index);
+        free(forkshimd_ctx[slot].mask);
+        forkshimd_ctx[slot].key = 0;
+    }
+    if((forkshimd_ctx[slot].mask = malloc(words * sizeof(*mask))) == NULL){
+        return NULL;
+    }
+    if(wl_merge(&forkshimd_ctx[slot].index, &total, &who) == -1){
+        free(forkshimd_ctx[slot].mask);
+        return NULL;
+    }
+    memcpy(forkshimd_ctx[slot].mask, mask, words * sizeof(*mask));
+    forkshimd_ctx[slot].key = key;
+    forkshimd_ctx[slot].gen = gen;
+    forkshimd_ctx[slot].used = ++forkshimd_ctx_clock;
+    *ctx = key;
+    return &forkshimd_ctx[slot].index;
+}
+
+// j's child's oom_score_adj, opened if it's still the process the pidfd is for and the sender could
+// have set it itself (root anything, anyone else only their own processes); -1 otherwise.  Once
+// open, the file stays that process's however late it's written to.
+static int forkshimd_open(const struct forkshimd_job *j){
+    char fileName[sizeof("/proc//oom_score_adj") + 10];
+    struct pollfd pfd = { .fd = j->pidfd, .events = POLLIN };
+    struct stat st;
+    int fd;
+    shim_format(fileName, sizeof(fileName), "/proc/%d/oom_score_adj", j->rec.pid);
+    if((fd = open(fileName, O_RDWR | O_CLOEXEC)) == -1){
+        return(-1);
+    }
+    // opened while the pidfd's process is still alive, so the pid can't have been reused
+    if(poll(&pfd, 1, 0) != 0 || fstat(fd, &st) == -1 || (j->cred.uid != 0 && st.st_uid != j->cred.uid)){
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+// Set a non-root sender's child's score through fd (from forkshimd_open(), closed here), never
+// lower than it is: that takes CAP_SYS_RESOURCE, which the sender doesn't have.
+static int forkshimd_apply(int fd, int score){
+    char buf[16];
+    ssize_t n;
+    int len, ok;
+    if((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0){
+        buf[n] = 0x00;
+        if(score < atoi(buf)){
+            close(fd);
+            return(0);
+        }
+    }
+    len = shim_format(buf, sizeof(buf), "%d\n", score);
+    ok = pwrite(fd, buf, len, 0) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// The most specific rule in wl for a command line (cut up in place) and executable (exeLen <= 0 for
+// none), remembered under key for the rest of this generation.
+static int forkshimd_classify(const struct wl_rules *wl, uint64_t key, unsigned int gen, char *cmdBuf, size_t cmdLen, const char *exe, ssize_t exeLen){
+    static long worst_ns;
+    struct timespec t0, t1;
+    int best, slot = key % FORKSHIMD_CACHE;
+    if(forkshimd_cache[slot].gen == gen && forkshimd_cache[slot].key == key){
+        return forkshimd_cache[slot].best;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    best = classify_cmdline(wl, cmdBuf, cmdLen);
+    if(exeLen > 0){
+        best = wl_pick(wl, best, check_wl_exe(wl, exe, exeLen));
+    }
+    forkshimd_cache[slot].key = key;
+    forkshimd_cache[slot].gen = gen;
+    forkshimd_cache[slot].best = best;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if((t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec) > worst_ns){
+        worst_ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: worst classification so far %ld ns (%u DFA states)\n", worst_ns, wl->dfa ? wl->dfa->nstates : 0);
+    }
+    return best;
+}
+
+// Classify and score the first n jobs.  By now the child may have exec'd (and scored itself
+// already), so it's classified by the command line it has now, like the inline path does; when
+// that's still the one in the record, the record's hash finds earlier decisions for it.
+// Scores queued by forkshimd_score(), written by forkshimd_flush(): through an io_uring, as one
+// write/close chain per process and one io_uring_enter() for up to FORKSHIMD_RING of them, or with
+// plain syscalls where there's no io_uring (io_uring_disabled, seccomp).  The files are opened
+// before they're queued, while the process is known to be the one classified; only the writes wait.
+static struct {
+    int fd;                    // the ring, -1 = plain syscalls
+    unsigned int *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    void *sq_map, *sqe_map;
+    size_t sq_size, sqe_size;
+    unsigned int n, done;      // queued, written since the last forkshimd_flush()
+    struct {
+        int fd;                // the process's oom_score_adj, closed once written
+        char buf[16];
+        int len;
+    } op[FORKSHIMD_RING];
+} forkshimd_ring = { .fd = -1 };
+
+static void forkshimd_ring_off(void){
+    if(forkshimd_ring.fd != -1){
+        munmap(forkshimd_ring.sqe_map, forkshimd_ring.sqe_size);
+        munmap(forkshimd_ring.sq_map, forkshimd_ring.sq_size);
+        close(forkshimd_ring.fd);
+        forkshimd_ring.fd = -1;
+    }
+}
+
+// Count the completions already in, or, with wait, at least one; how many there were.
+static unsigned int forkshimd_ring_reap(int wait){
+    unsigned int head = *forkshimd_ring.cq_head, got = 0;
+    for(;;){
+        for(; head != __atomic_load_n(forkshimd_ring.cq_tail, __ATOMIC_ACQUIRE); head++, got++){
+            struct io_uring_cqe *c = &forkshimd_ring.cqe[head & *forkshimd_ring.cq_mask];
+            forkshimd_ring.done += c->user_data % 2 == 0 && c->res == forkshimd_ring.op[c->user_data / 2].len;
+        }
+        __atomic_store_n(forkshimd_ring.cq_head, head, __ATOMIC_RELEASE);
+        if(got > 0 || !wait || (syscall(__NR_io_uring_enter, forkshimd_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)){
+            return got;
+        }
+    }
+}
+
+static void forkshimd_ring_submit(void){
+    unsigned int i, tail, sent = 0, got = 0, n = forkshimd_ring.n, mask;
+    struct io_uring_sqe *e;
+    long r = 0;
+    forkshimd_ring.n = 0;
+    if(forkshimd_ring.fd == -1){
+        for(i = 0; i < n; i++){
+            forkshimd_ring.done += pwrite(forkshimd_ring.op[i].fd, forkshimd_ring.op[i].buf, forkshimd_ring.op[i].len, 0) == forkshimd_ring.op[i].len;
+            close(forkshimd_ring.op[i].fd);
+        }
+        return;
+    }
+    mask = *forkshimd_ring.sq_mask;
+    tail = *forkshimd_ring.sq_tail; // ours alone
+    for(i = 0; i < 2 * n; i++, tail++){
+        e = &forkshimd_ring.sqe[tail & mask];
+        memset(e, 0, sizeof(*e));
+        e->user_data = i;
+        e->fd = forkshimd_ring.op[i / 2].fd;
+        if(i % 2 == 0){
+            e->opcode = IORING_OP_WRITE;
+            e->addr = (uintptr_t)forkshimd_ring.op[i / 2].buf;
+            e->len = forkshimd_ring.op[i / 2].len;
+            e->flags = IOSQE_IO_HARDLINK; // the file is closed whatever the write does
+        } else {
+            e->opcode = IORING_OP_CLOSE;
+        }
+        forkshimd_ring.sq_array[tail & mask] = tail & mask;
+    }
+    __atomic_store_n(forkshimd_ring.sq_tail, tail, __ATOMIC_RELEASE);
+    // The kernel may take fewer than asked (out of memory, a full completion queue): give it the
+    // rest, making room first when it took none.  Only what it took is waited for.
+    while(sent < 2 * n){
+        if((r = syscall(__NR_io_uring_enter, forkshimd_ring.fd, 2 * n - sent, 0, 0, NULL, 0)) > 0){
+            sent += r;
+        } else if(r == -1 && errno == EINTR){
+            continue;
+        } else if((r == 0 || errno == EAGAIN || errno == EBUSY) && got < sent){
+            got += forkshimd_ring_reap(1);
+        } else {
+            break;
+        }
+    }
+    while(got < sent){
+        got += forkshimd_ring_reap(1);
+    }
+    if(sent < 2 * n){
+        // what it never took goes with the ring; a write taken without its close is closed here
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: io_uring_enter() failed, writing scores without it\n");
+        forkshimd_ring_off();
+        if(sent % 2 == 1){
+            close(forkshimd_ring.op[sent / 2].fd);
+        }
+        memmove(forkshimd_ring.op, forkshimd_ring.op + (sent + 1) / 2, (n - (sent + 1) / 2) * sizeof(forkshimd_ring.op[0]));
+        forkshimd_ring.n = n - (sent + 1) / 2;
+        forkshimd_ring_submit();
+    }
+}
+
+// Queue score to be written to fd, an oom_score_adj opened for it, which is closed afterwards.
+static void forkshimd_score(int fd, int score){
+    if(forkshimd_ring.n == FORKSHIMD_RING){
+        forkshimd_ring_submit();
+    }
+    forkshimd_ring.op[forkshimd_ring.n].fd = fd;
+    forkshimd_ring.op[forkshimd_ring.n].len = shim_format(forkshimd_ring.op[forkshimd_ring.n].buf, sizeof(forkshimd_ring.op[0].buf), "%d\n", score);
+    forkshimd_ring.n++;
+}
+
+// Writes whatever is queued; how many scores were written since the last call.
+static unsigned int forkshimd_flush(void){
+    unsigned int done;
+    forkshimd_ring_submit();
+    done = forkshimd_ring.done;
+    forkshimd_ring.done = 0;
+    return done;
+}
+
+// Set the ring up, and try it on our own score: anything short of a full chain that works (no
+// IORING_OP_CLOSE before 5.6) and the plain syscalls are used instead.
+static void forkshimd_ring_init(void){
+    struct io_uring_params p;
+    char buf[16];
+    int fd;
+    ssize_t n = -1;
+    memset(&p, 0, sizeof(p));
+    if((forkshimd_ring.fd = syscall(__NR_io_uring_setup, 4 * FORKSHIMD_RING, &p)) == -1){
+        return;
+    }
+    forkshimd_ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if(p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > forkshimd_ring.sq_size){
+        forkshimd_ring.sq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    forkshimd_ring.sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    forkshimd_ring.sq_map = mmap(NULL, forkshimd_ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, forkshimd_ring.fd, IORING_OFF_SQ_RING);
+    forkshimd_ring.sqe_map = mmap(NULL, forkshimd_ring.sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, forkshimd_ring.fd, IORING_OFF_SQES);
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || forkshimd_ring.sq_map == MAP_FAILED || forkshimd_ring.sqe_map == MAP_FAILED){
+        if(forkshimd_ring.sq_map != MAP_FAILED){
+            munmap(forkshimd_ring.sq_map, forkshimd_ring.sq_size);
+        }
+        if(forkshimd_ring.sqe_map != MAP_FAILED){
+            munmap(forkshimd_ring.sqe_map, forkshimd_ring.sqe_size);
+        }
+        close(forkshimd_ring.fd);
+        forkshimd_ring.fd = -1;
+        return;
+    }
+    forkshimd_ring.sq_tail = (unsigned int *)((char *)forkshimd_ring.sq_map + p.sq_off.tail);
+    forkshimd_ring.sq_mask = (unsigned int *)((char *)forkshimd_ring.sq_map + p.sq_off.ring_mask);
+    forkshimd_ring.sq_array = (unsigned int *)((char *)forkshimd_ring.sq_map + p.sq_off.array);
+    forkshimd_ring.cq_head = (unsigned int *)((char *)forkshimd_ring.sq_map + p.cq_off.head);
+    forkshimd_ring.cq_tail = (unsigned int *)((char *)forkshimd_ring.sq_map + p.cq_off.tail);
+    forkshimd_ring.cq_mask = (unsigned int *)((char *)forkshimd_ring.sq_map + p.cq_off.ring_mask);
+    forkshimd_ring.cqe = (struct io_uring_cqe *)((char *)forkshimd_ring.sq_map + p.cq_off.cqes);
+    forkshimd_ring.sqe = forkshimd_ring.sqe_map;
+    if((fd = open("/proc/self/oom_score_adj", O_RDWR | O_CLOEXEC)) != -1 && (n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0){
+        buf[n] = 0x00;
+        forkshimd_score(fd, atoi(buf));
+    } else if(fd != -1){
+        close(fd);
+    }
+    if(forkshimd_flush() != 1){
+        forkshimd_ring_off();
+    }
+}
+
+static void forkshimd_batch(int n){
+    char log[4096], cmdFileName[sizeof("/proc//cmdline") + 10], exeFileName[sizeof("/proc//exe") + 10], exe[PATH_MAX];
+    size_t logLen = 0, cmdLen;
+    unsigned int ticket, gen;
+    const struct wl_rules *global, *wl;
+    int i;
+    wl_refresh(1);
+    global = wl_enter(&ticket);
+    gen = ticket + 1;
+    for(i = 0; i < n; i++){
+        struct forkshimd_job *j = &forkshimd_jobs[i];
+        uint64_t key, ctx = 0;
+        ssize_t exeLen = -1;
+        char *cmdBuf;
+        int best, fd;
+        if(j->pidfd == -1){
+            continue;
+        }
+        if(logLen < sizeof(log) - 32){
+            logLen += shim_format(log + logLen, sizeof(log) - logLen, "pid = %i\n", j->rec.pid);
+        }
+        shim_format(cmdFileName, sizeof(cmdFileName), "/proc/%d/cmdline", j->rec.pid);
+        shim_format(exeFileName, sizeof(exeFileName), "/proc/%d/exe", j->rec.pid);
+        if((cmdBuf = read_cmdline(cmdFileName, &cmdLen)) == NULL){
+            close(j->pidfd); // came and went
+            continue;
+        }
+        wl = global;
+        if(global->nconditional > 0){
+            const char *sender = j->data + j->rec.argv_len, *lineage = sender + j->rec.exe_len;
+            if((wl = forkshimd_context(global, sender, j->rec.exe_len, j->rec.comm, lineage, j->rec.lineage_len, gen, &ctx)) == NULL){
+                wl = global;
+            }
+        }
+        if(wl->nexe > 0 && (exeLen = readlinkat(AT_FDCWD, exeFileName, exe, sizeof(exe) - 1)) > 0){
+            exe[exeLen] = 0x00;
+        }
+        key = cmdLen == j->rec.argv_len && !memcmp(cmdBuf, j->data, cmdLen) ? j->rec.argv_hash : shim_l1_hash(0, cmdBuf, cmdLen);
+        key = exeLen > 0 ? shim_l1_hash(key ^ ctx, exe, exeLen) : key ^ ctx;
+        best = forkshimd_classify(wl, key, gen, cmdBuf, cmdLen, exe, exeLen);
+        free(cmdBuf);
+        if((fd = forkshimd_open(j)) == -1){
+            // gone, or not the sender's to set
+        } else if(j->cred.uid == 0){
+            forkshimd_score(fd, best == -1 ? wl->default_score : wl->rule[best].score); // root may set anything
+            shim_cgroup_move(shim_cgroup_of(wl, best), j->rec.pid); // placement only for root's forks, same reason
+        } else if(forkshimd_apply(fd, best == -1 ? wl->default_score : wl->rule[best].score) == 0){
+            SHIM_COUNT(forks_classified);
+        }
+        close(j->pidfd);
+    }
+    SHIM_COUNT_N(forks_classified, forkshimd_flush());
+    wl_release(ticket);
+    if(logLen > 0){
+        shim_log("/tmp/shim_forks.log", "%s", log); // one write for the whole batch
+    }
+}
+
+// Take up to FORKSHIMD_BATCH records off a connection and deal with them.  -1 once the shim(s) on
+// the other end are gone.  Records without a pidfd or credentials, or that don't add up, are dropped.
+static int forkshimd_recv(int fd){
+    struct mmsghdr mm[FORKSHIMD_BATCH];
+    struct iovec iov[FORKSHIMD_BATCH][2];
+    struct cmsghdr *cm;
+    int i, k, n, gone = 0;
+    memset(mm, 0, sizeof(mm));
+    for(i = 0; i < FORKSHIMD_BATCH; i++){
+        iov[i][0] = (struct iovec){ &forkshimd_jobs[i].rec, sizeof(forkshimd_jobs[i].rec) };
+        iov[i][1] = (struct iovec){ forkshimd_jobs[i].data, sizeof(forkshimd_jobs[i].data) };
+        mm[i].msg_hdr.msg_iov = iov[i];
+        mm[i].msg_hdr.msg_iovlen = 2;
+        mm[i].msg_hdr.msg_control = forkshimd_jobs[i].ctl.buf;
+        mm[i].msg_hdr.msg_controllen = sizeof(forkshimd_jobs[i].ctl.buf);
+    }
+    if((n = recvmmsg(fd, mm, FORKSHIMD_BATCH, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL)) == -1){
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    for(i = 0; i < n; i++){
+        struct forkshimd_job *j = &forkshimd_jobs[i];
+        const struct forkshimd_record *r = &j->rec;
+        int creds = 0;
+        j->pidfd = -1;
+        for(cm = CMSG_FIRSTHDR(&mm[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&mm[i].msg_hdr, cm)){
+            if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS){
+                for(k = 0; CMSG_LEN((k + 1) * sizeof(int)) <= cm->cmsg_len; k++){
+                    int pfd;
+                    memcpy(&pfd, CMSG_DATA(cm) + k * sizeof(int), sizeof(int));
+                    if(j->pidfd == -1){
+                        j->pidfd = pfd;
+                    } else {
+                        close(pfd); // one per record
+                    }
+                }
+            } else if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_CREDENTIALS){
+                memcpy(&j->cred, CMSG_DATA(cm), sizeof(j->cred));
+                creds = 1;
+            }
+        }
+        if(mm[i].msg_len == 0){
+            gone = 1;
+        }
+        if(j->pidfd != -1 && (!creds || (mm[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || mm[i].msg_len < sizeof(*r) ||
+           r->magic != FORKSHIMD_MAGIC || r->argv_len > FORKSHIMD_ARGV_MAX || r->exe_len >= PATH_MAX || r->lineage_len >= SHIM_LINEAGE_MAX ||
+           mm[i].msg_len != sizeof(*r) + r->argv_len + r->exe_len + r->lineage_len)){
+            close(j->pidfd);
+            j->pidfd = -1;
+        }
+    }
+    forkshimd_batch(n);
+    return gone ? -1 : n;
+}
+
+// The /proc scanner, for everything forkshimd reads about other processes: /proc is opened once,
+// files are read relative to it with one pread() each into buffers that are already there, and
+// parsed by hand.
+static int forkshimd_procfd = -1;
+
+// A snapshot of every process, one array per field (those scanned for are filled in).  Kept from
+// scan to scan, so it's only allocated again when there are more processes than ever before.
+struct forkshimd_procs {
+    size_t n, cap;
+    pid_t *pid;
+    pid_t *ppid;               // FORKSHIMD_SCAN_STAT
+    char *state;               // FORKSHIMD_SCAN_STAT: 'R', 'S', 'D', 'Z'...
+    unsigned long long *start; // FORKSHIMD_SCAN_STAT: clock ticks after boot
+    unsigned long *rss;        // FORKSHIMD_SCAN_STATM: pages
+    short *score;              // FORKSHIMD_SCAN_SCORE
+    uint32_t *cmd, *cmdLen;    // FORKSHIMD_SCAN_CMDLINE: where in cmdBuf, empty for kernel threads
+    char *cmdBuf;              // each followed by SHIM_SCAN_PAD zeroes
+    size_t cmdUsed, cmdCap;
+};
+
+static int forkshimd_proc_open(void){
+    if(forkshimd_procfd == -1){
+        forkshimd_procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return forkshimd_procfd;
+}
+
+// name ("<pid>/stat" and the like) read with a single pread() into buf, NUL terminated; its
+// length, or -1.
+static ssize_t forkshimd_read_at(const char *name, char *buf, size_t size){
+    ssize_t n;
+    int fd;
+    if(forkshimd_proc_open() == -1 || (fd = openat(forkshimd_procfd, name, O_RDONLY | O_CLOEXEC)) == -1){
+        return(-1);
+    }
+    n = pread(fd, buf, size - 1, 0);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0x00;
+    return n;
+}
+
+// The number at *p (after any spaces), leaving *p after it.
+static unsigned long long forkshimd_parse_u(const char **p){
+    unsigned long long v = 0;
+    const char *s = *p;
+    while(*s == ' '){
+        s++;
+    }
+    for(; *s >= '0' && *s <= '9'; s++){
+        v = v * 10 + (*s - '0');
+    }
+    *p = s;
+    return v;
+}
+
+static long long forkshimd_parse_i(const char **p){
+    while(**p == ' '){
+        (*p)++;
+    }
+    if(**p == '-'){
+        (*p)++;
+        return -(long long)forkshimd_parse_u(p);
+    }
+    return forkshimd_parse_u(p);
+}
+
+// ppid, state and start time out of a /proc/<pid>/stat; -1 if it isn't one.
+static int forkshimd_parse_stat(const char *buf, pid_t *ppid, char *state, unsigned long long *start){
+    const char *p = strrchr(buf, ')'); // the name can hold anything, ')' and spaces included
+    int field;
+    if(p == NULL || p[1] != ' ' || p[2] == 0x00){
+        return(-1);
+    }
+    *state = p[2];
+    p += 3;
+    *ppid = forkshimd_parse_u(&p);
+    for(field = 4; *p && field < 22; p++){ // on to starttime, field 22
+        field += *p == ' ';
+    }
+    if(field != 22){
+        return(-1);
+    }
+    *start = forkshimd_parse_u(&p);
+    return(0);
+}
+
+// The parent and start time of pid's process.
+static int forkshimd_stat(pid_t pid, pid_t *ppid, unsigned long long *start){
+    char name[sizeof("/stat") + 10], buf[1024], state;
+    *ppid = 0;
+    shim_format(name, sizeof(name), "%d/stat", pid);
+    if(forkshimd_read_at(name, buf, sizeof(buf)) <= 0){
+        return(-1);
+    }
+    return forkshimd_parse_stat(buf, ppid, &state, start);
+}
+
+static int forkshimd_procs_grow(struct forkshimd_procs *ps){
+    size_t cap = ps->cap ? ps->cap * 2 : 1024;
+#define FORKSHIMD_GROW(a) do { void *g_ = realloc(ps->a, cap * sizeof(*ps->a)); if(g_ == NULL){ return(-1); } ps->a = g_; } while(0)
+    FORKSHIMD_GROW(pid);
+    FORKSHIMD_GROW(ppid);
+    FORKSHIMD_GROW(state);
+    FORKSHIMD_GROW(start);
+    FORKSHIMD_GROW(rss);
+    FORKSHIMD_GROW(score);
+    FORKSHIMD_GROW(cmd);
+    FORKSHIMD_GROW(cmdLen);
+#undef FORKSHIMD_GROW
+    ps->cap = cap;
+    return(0);
+}
+
+// Fill ps with every process there is, and what's asked for about each; -1 if /proc can't be
+// read.  Processes that go away halfway through are left out.
+static int forkshimd_scan(struct forkshimd_procs *ps, unsigned int what){
+    char dents[8192], buf[1024], name[sizeof("/oom_score_adj") + 10], *grown;
+    const char *p;
+    ssize_t got, off, n;
+    size_t i;
+    pid_t pid;
+    if(forkshimd_proc_open() == -1 || lseek(forkshimd_procfd, 0, SEEK_SET) == -1){
+        return(-1);
+    }
+    ps->n = 0;
+    ps->cmdUsed = 0;
+    while((got = syscall(SYS_getdents64, forkshimd_procfd, dents, sizeof(dents))) > 0){
+        for(off = 0; off < got; off += ((struct dirent64 *)(dents + off))->d_reclen){
+            p = ((struct dirent64 *)(dents + off))->d_name;
+            if((pid = forkshimd_parse_u(&p)) == 0 || *p != 0x00){
+                continue; // not a process
+            }
+            if(ps->n == ps->cap && forkshimd_procs_grow(ps) == -1){
+                return(-1);
+            }
+            i = ps->n;
+            ps->pid[i] = pid;
+            if(what & FORKSHIMD_SCAN_STAT){
+                shim_format(name, sizeof(name), "%d/stat", pid);
+                if(forkshimd_read_at(name, buf, sizeof(buf)) <= 0 || forkshimd_parse_stat(buf, &ps->ppid[i], &ps->state[i], &ps->start[i]) == -1){
+                    continue;
+                }
+            }
+            if(what & FORKSHIMD_SCAN_STATM){
+                shim_format(name, sizeof(name), "%d/statm", pid);
+                if(forkshimd_read_at(name, buf, sizeof(buf)) <= 0){
+                    continue;
+                }
+                p = buf;
+                forkshimd_parse_u(&p); // size, then resident
+                ps->rss[i] = forkshimd_parse_u(&p);
+            }
+            if(what & FORKSHIMD_SCAN_SCORE){
+                shim_format(name, sizeof(name), "%d/oom_score_adj", pid);
+                if(forkshimd_read_at(name, buf, sizeof(buf)) <= 0){
+                    continue;
+                }
+                p = buf;
+                ps->score[i] = forkshimd_parse_i(&p);
+            }
+            if(what & FORKSHIMD_SCAN_CMDLINE){
+                if(ps->cmdCap - ps->cmdUsed < FORKSHIMD_SWEEP_ARGV + 1 + SHIM_SCAN_PAD){
+                    if((grown = realloc(ps->cmdBuf, ps->cmdCap * 2 + FORKSHIMD_SWEEP_ARGV + 1 + SHIM_SCAN_PAD)) == NULL){
+                        return(-1);
+                    }
+                    ps->cmdBuf = grown;
+                    ps->cmdCap = ps->cmdCap * 2 + FORKSHIMD_SWEEP_ARGV + 1 + SHIM_SCAN_PAD;
+                }
+                shim_format(name, sizeof(name), "%d/cmdline", pid);
+                if((n = forkshimd_read_at(name, ps->cmdBuf + ps->cmdUsed, FORKSHIMD_SWEEP_ARGV + 1)) < 0){
+                    continue;
+                }
+                memset(ps->cmdBuf + ps->cmdUsed + n, 0, SHIM_SCAN_PAD);
+                ps->cmd[i] = ps->cmdUsed;
+                ps->cmdLen[i] = n;
+                ps->cmdUsed += n + SHIM_SCAN_PAD;
+            }
+            ps->n++;
+        }
+    }
+    return(0);
+}
+
+// -n: what each process is, as far as 'parent:' and 'lineage:' go for whatever it execs next: its
+// program and the lineage it was given.  Interned; processes refer to one by number (or to
+// FORKSHIMD_IMAGE_NONE/FORKSHIMD_IMAGE_IMMUNE), inherited on fork and replaced on exec.
+struct forkshimd_image {
+    uint64_t key;              // forkshimd_ctx_key()
+    char comm[16];
+    char *exe, *lineage;       // one allocation
+};
+
+static struct {
+    struct forkshimd_image *img; // FORKSHIMD_IMAGES, the first two unused
+    uint32_t nimg;
+    uint32_t *slot;            // 2 * FORKSHIMD_IMAGES: image by key, 0 = empty
+    uint32_t *pid;             // image of each pid, pid_max + 1 of them
+    unsigned long long *start; // -s: when each pid's process started (pids get reused)
+    pid_t pid_max;
+    unsigned long overruns;
+} forkshimd_proc;
+
+static uint32_t forkshimd_image(const char *exe, size_t exeLen, const char *comm, const char *lineage, size_t lineageLen){
+    uint64_t key = forkshimd_ctx_key(exe, exeLen, comm, lineage, lineageLen);
+    uint32_t mask = 2 * FORKSHIMD_IMAGES - 1, h = key & mask, i;
+    struct forkshimd_image *m;
+    pid_t p;
+    while((i = forkshimd_proc.slot[h]) != 0){
+        if(forkshimd_proc.img[i].key == key){
+            return i;
+        }
+        h = (h + 1) & mask;
+    }
+    if(forkshimd_proc.nimg == FORKSHIMD_IMAGES){
+        // full: start over; processes we knew look like ones that were running before we started
+        for(i = 2; i < forkshimd_proc.nimg; i++){
+            free(forkshimd_proc.img[i].exe);
+        }
+        for(p = 0; p <= forkshimd_proc.pid_max; p++){
+            forkshimd_proc.pid[p] = forkshimd_proc.pid[p] == FORKSHIMD_IMAGE_IMMUNE ? FORKSHIMD_IMAGE_IMMUNE : FORKSHIMD_IMAGE_NONE;
+        }
+        memset(forkshimd_proc.slot, 0, 2 * FORKSHIMD_IMAGES * sizeof(*forkshimd_proc.slot));
+        forkshimd_proc.nimg = 2;
+        h = key & mask;
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: %u programs seen, forgetting them\n", FORKSHIMD_IMAGES);
+    }
+    m = &forkshimd_proc.img[forkshimd_proc.nimg];
+    if((m->exe = malloc(exeLen + lineageLen + 2)) == NULL){
+        return FORKSHIMD_IMAGE_NONE;
+    }
+    memcpy(m->exe, exe, exeLen);
+    m->exe[exeLen] = 0x00;
+    m->lineage = m->exe + exeLen + 1;
+    memcpy(m->lineage, lineage, lineageLen);
+    m->lineage[lineageLen] = 0x00;
+    memcpy(m->comm, comm, sizeof(m->comm));
+    m->key = key;
+    forkshimd_proc.slot[h] = forkshimd_proc.nimg;
+    return forkshimd_proc.nimg++;
+}
+
+static void forkshimd_comm(pid_t pid, char comm[16]){
+    char name[sizeof("/comm") + 10], buf[17];
+    ssize_t n;
+    shim_format(name, sizeof(name), "%d/comm", pid);
+    n = forkshimd_read_at(name, buf, sizeof(buf));
+    n = n > 0 && buf[n - 1] == '\n' ? n - 1 : n;
+    memset(comm, 0, 16);
+    memcpy(comm, buf, n > 0 ? n : 0);
+}
+
+// Is pid never-kill already?  What it starts inherits that, and is left alone like the shim leaves
+// what a never-kill process starts.
+static int forkshimd_immune(pid_t pid){
+    char name[sizeof("/oom_score_adj") + 10], num[16];
+    shim_format(name, sizeof(name), "%d/oom_score_adj", pid);
+    return forkshimd_read_at(name, num, sizeof(num)) > 0 && atoi(num) == WL_SCORE_NEVER_KILL;
+}
+
+// The image of a process that was running before we started: what it is now, without a lineage
+// (or FORKSHIMD_IMAGE_IMMUNE).
+static uint32_t forkshimd_image_of(pid_t pid){
+    char fileName[sizeof("/proc//exe") + 10], exe[PATH_MAX], comm[16];
+    ssize_t exeLen;
+    if(forkshimd_immune(pid)){
+        return FORKSHIMD_IMAGE_IMMUNE; // made never-kill before we knew it: its children inherit that
+    }
+    shim_format(fileName, sizeof(fileName), "/proc/%d/exe", pid);
+    if((exeLen = readlinkat(AT_FDCWD, fileName, exe, sizeof(exe) - 1)) < 0){
+        exeLen = 0; // kernel threads have none
+    }
+    forkshimd_comm(pid, comm);
+    return forkshimd_image(exe, exeLen, comm, "", 0);
+}
+
+// A process has exec'd: classify it as the shim's exec*() would have, with the program it was until
+// now as the 'parent:' and its lineage as the 'lineage:', and work out what its children inherit.
+static void forkshimd_proc_exec(pid_t pid, const struct wl_rules *global, unsigned int gen){
+    static const char nocomm[16];
+    char fileName[sizeof("/proc//oom_score_adj") + 10], exe[PATH_MAX], comm[16], lineage[SHIM_LINEAGE_MAX];
+    const struct forkshimd_image *from = NULL;
+    const struct wl_rules *wl = global;
+    uint32_t cur = pid <= forkshimd_proc.pid_max ? forkshimd_proc.pid[pid] : FORKSHIMD_IMAGE_NONE, next = FORKSHIMD_IMAGE_NONE;
+    uint64_t key, ctx = 0;
+    ssize_t exeLen = -1;
+    size_t cmdLen, len = 0, n;
+    char *cmdBuf;
+    int best, score, fd;
+    if(cur == FORKSHIMD_IMAGE_NONE && forkshimd_immune(pid)){
+        cur = FORKSHIMD_IMAGE_IMMUNE; // started before we were, or by something we don't know, at -1000
+        if(pid <= forkshimd_proc.pid_max){
+            forkshimd_proc.pid[pid] = cur;
+        }
+    }
+    if(cur == FORKSHIMD_IMAGE_IMMUNE){
+        SHIM_COUNT(execs_immune); // inherited -1000, and nothing below it is classified
+        return;
+    }
+    shim_format(fileName, sizeof(fileName), "/proc/%d/cmdline", pid);
+    if((cmdBuf = read_cmdline(fileName, &cmdLen)) == NULL){
+        return; // came and went
+    }
+    if(global->nconditional > 0){
+        from = cur != FORKSHIMD_IMAGE_NONE ? &forkshimd_proc.img[cur] : NULL;
+        wl = from ? forkshimd_context(global, from->exe, strlen(from->exe), from->comm, from->lineage, strlen(from->lineage), gen, &ctx) :
+                    forkshimd_context(global, "", 0, nocomm, "", 0, gen, &ctx);
+        wl = wl != NULL ? wl : global;
+    }
+    if(wl->nexe > 0 || global->nconditional > 0){
+        shim_format(fileName, sizeof(fileName), "/proc/%d/exe", pid);
+        if((exeLen = readlinkat(AT_FDCWD, fileName, exe, sizeof(exe) - 1)) > 0){
+            exe[exeLen] = 0x00;
+        }
+    }
+    key = shim_l1_hash(0, cmdBuf, cmdLen);
+    key = wl->nexe > 0 && exeLen > 0 ? shim_l1_hash(key ^ ctx, exe, exeLen) : key ^ ctx;
+    best = forkshimd_classify(wl, key, gen, cmdBuf, cmdLen, exe, wl->nexe > 0 ? exeLen : -1);
+    free(cmdBuf);
+    score = best == -1 ? wl->default_score : wl->rule[best].score;
+    shim_format(fileName, sizeof(fileName), "/proc/%d/oom_score_adj", pid);
+    if((fd = open(fileName, O_WRONLY | O_CLOEXEC)) != -1){
+        forkshimd_score(fd, score); // written with the rest of the batch
+    }
+    shim_cgroup_move(shim_cgroup_of(wl, best), pid);
+    if(score == WL_SCORE_NEVER_KILL){
+        next = FORKSHIMD_IMAGE_IMMUNE;
+    } else if(global->nconditional > 0){
+        // the lineage it was started with, plus the winner's tag
+        if(from != NULL){
+            len = strlen(from->lineage);
+            memcpy(lineage, from->lineage, len);
+        }
+        lineage[len] = 0x00;
+        if(best != -1 && wl->rule[best].opt[WL_OPT_TAG] != WL_NONE){
+            const char *tag = wl->arena + wl->rule[best].opt[WL_OPT_TAG];
+            if(!shim_lineage_has(lineage, tag, n = strlen(tag)) && len + n + 2 <= sizeof(lineage)){
+                if(len > 0){
+                    lineage[len++] = ':';
+                }
+                memcpy(lineage + len, tag, n + 1);
+                len += n;
+            }
+        }
+        forkshimd_comm(pid, comm);
+        next = forkshimd_image(exe, exeLen > 0 ? exeLen : 0, comm, lineage, len);
+    }
+    if(pid <= forkshimd_proc.pid_max){
+        forkshimd_proc.pid[pid] = next;
+    }
+}
+
+// The image tables, for -n and -s.
+static int forkshimd_proc_init(void){
+    char num[16];
+    ssize_t n;
+    int fd;
+    forkshimd_proc.pid_max = 4194304; // the most there can be
+    if((fd = open("/proc/sys/kernel/pid_max", O_RDONLY | O_CLOEXEC)) != -1){
+        if((n = read(fd, num, sizeof(num) - 1)) > 0){
+            num[n] = 0x00;
+            forkshimd_proc.pid_max = atoi(num) > 0 ? atoi(num) : forkshimd_proc.pid_max;
+        }
+        close(fd);
+    }
+    forkshimd_proc.nimg = 2;
+    forkshimd_proc.img = calloc(FORKSHIMD_IMAGES, sizeof(*forkshimd_proc.img));
+    forkshimd_proc.slot = calloc(2 * FORKSHIMD_IMAGES, sizeof(*forkshimd_proc.slot));
+    forkshimd_proc.pid = calloc(forkshimd_proc.pid_max + 1, sizeof(*forkshimd_proc.pid)); // untouched pages cost nothing
+    return forkshimd_proc.img == NULL || forkshimd_proc.slot == NULL || forkshimd_proc.pid == NULL ? -1 : 0;
+}
+
+// Subscribe to the process connector's fork, exec and exit events; -1 if that can't be done (not
+// root, no CONFIG_PROC_EVENTS, not in the initial network namespace).
+static int forkshimd_proc_listen(void){
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+    char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    struct nlmsghdr *nl = (struct nlmsghdr *)buf;
+    struct cn_msg *cn = NLMSG_DATA(nl);
+    enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+    int fd, size = FORKSHIMD_RCVBUF;
+    if(forkshimd_proc_init() == -1 ||
+       (fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR)) == -1){
+        return(-1);
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1){
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)); // capped by net.core.rmem_max
+    }
+    memset(buf, 0, sizeof(buf));
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(op));
+    nl->nlmsg_type = NLMSG_DONE;
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(op);
+    memcpy(cn->data, &op, sizeof(op));
+    if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || send(fd, buf, nl->nlmsg_len, 0) == -1){
+        close(fd);
+        return(-1);
+    }
+    return fd;
+}
+
+// The kernel dropped process events: the execs among them went by unclassified.  Logged at most
+// once a second.
+static void forkshimd_proc_overrun(void){
+    static time_t last;
+    struct timespec now;
+    forkshimd_proc.overruns++;
+    SHIM_COUNT(proc_overruns);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(now.tv_sec != last){
+        last = now.tv_sec;
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: process events dropped (ENOBUFS), %lu times so far\n", forkshimd_proc.overruns);
+    }
+}
+
+// Deal with what the process connector has queued, FORKSHIMD_BATCH events at a time; a few batches
+// at most, so shims' records don't wait behind a fork storm.  Only the kernel's events count.
+static void forkshimd_proc_recv(int fd){
+    static char buf[FORKSHIMD_BATCH][256];
+    struct mmsghdr mm[FORKSHIMD_BATCH];
+    struct iovec iov[FORKSHIMD_BATCH];
+    struct sockaddr_nl from[FORKSHIMD_BATCH];
+    const size_t min = NLMSG_LENGTH(sizeof(struct cn_msg) + offsetof(struct proc_event, event_data) + sizeof(((struct proc_event *)0)->event_data.fork));
+    char log[4096];
+    size_t logLen = 0;
+    const struct wl_rules *global;
+    unsigned int ticket;
+    int i, n, round;
+    for(round = 0; round < 16; round++){
+        memset(mm, 0, sizeof(mm));
+        for(i = 0; i < FORKSHIMD_BATCH; i++){
+            iov[i] = (struct iovec){ buf[i], sizeof(buf[i]) };
+            mm[i].msg_hdr.msg_iov = &iov[i];
+            mm[i].msg_hdr.msg_iovlen = 1;
+            mm[i].msg_hdr.msg_name = &from[i];
+            mm[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        if((n = recvmmsg(fd, mm, FORKSHIMD_BATCH, MSG_DONTWAIT, NULL)) == -1){
+            if(errno == ENOBUFS){
+                forkshimd_proc_overrun();
+                continue;
+            }
+            break;
+        }
+        wl_refresh(1);
+        global = wl_enter(&ticket);
+        for(i = 0; i < n; i++){
+            const struct cn_msg *cn = NLMSG_DATA((struct nlmsghdr *)buf[i]);
+            const struct proc_event *ev = (const struct proc_event *)cn->data;
+            if(mm[i].msg_len < min || from[i].nl_pid != 0 || cn->id.idx != CN_IDX_PROC){
+                continue;
+            }
+            switch(ev->what){
+            case PROC_EVENT_FORK:
+                if(ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid && ev->event_data.fork.parent_tgid <= forkshimd_proc.pid_max &&
+                   ev->event_data.fork.child_tgid <= forkshimd_proc.pid_max){ // a process, not a thread
+                    uint32_t *img = &forkshimd_proc.pid[ev->event_data.fork.parent_tgid];
+                    if(*img == FORKSHIMD_IMAGE_NONE && global->nconditional > 0){
+                        *img = forkshimd_image_of(ev->event_data.fork.parent_tgid);
+                    }
+                    forkshimd_proc.pid[ev->event_data.fork.child_tgid] = *img;
+                }
+                break;
+            case PROC_EVENT_EXEC:
+                if(logLen < sizeof(log) - 32){
+                    logLen += shim_format(log + logLen, sizeof(log) - logLen, "pid = %i\n", ev->event_data.exec.process_tgid);
+                }
+                forkshimd_proc_exec(ev->event_data.exec.process_tgid, global, ticket + 1);
+                break;
+            case PROC_EVENT_EXIT:
+                if(ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid && ev->event_data.exit.process_tgid <= forkshimd_proc.pid_max){
+                    forkshimd_proc.pid[ev->event_data.exit.process_tgid] = FORKSHIMD_IMAGE_NONE;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        SHIM_COUNT_N(execs_classified, forkshimd_flush());
+        wl_release(ticket);
+        if(n < FORKSHIMD_BATCH){
+            break;
+        }
+    }
+    if(logLen > 0){
+        shim_log("/tmp/shim_forks.log", "%s", log);
+    }
+}
+
+#if defined(FORKSHIMD_AUDIT_ARCH) && defined(SECCOMP_IOCTL_NOTIF_RECV)
+// -s: the lineage pid was given: that of the nearest of it and its ancestors that exec'd under us.
+// Also pid's own start time, 0 if it's gone.
+static const char *forkshimd_lineage_of(pid_t pid, unsigned long long *start){
+    unsigned long long t;
+    pid_t ppid;
+    int depth;
+    *start = 0;
+    for(depth = 0; depth < 64 && pid > 1 && pid <= forkshimd_proc.pid_max; depth++, pid = ppid){
+        if(forkshimd_stat(pid, &ppid, &t) == -1){
+            break;
+        }
+        *start = depth == 0 ? t : *start;
+        if(forkshimd_proc.pid[pid] != FORKSHIMD_IMAGE_NONE && forkshimd_proc.start[pid] == t){
+            return forkshimd_proc.img[forkshimd_proc.pid[pid]].lineage;
+        }
+    }
+    return "";
+}
+
+// -s: copy a string out of pid's memory into buf (size bytes at most, NUL included); its length,
+// or -1.  Read a page at a time: the one after the string may not be there.
+static ssize_t forkshimd_peek_str(pid_t pid, uintptr_t addr, char *buf, size_t size){
+    struct iovec local, remote;
+    size_t len = 0, n;
+    char *nul;
+    while(len < size){
+        n = 4096 - ((addr + len) & 4095);
+        n = n < size - len ? n : size - len;
+        local = (struct iovec){ buf + len, n };
+        remote = (struct iovec){ (void *)(addr + len), n };
+        if(process_vm_readv(pid, &local, 1, &remote, 1, 0) != (ssize_t)n){
+            return(-1);
+        }
+        if((nul = memchr(buf + len, 0x00, n)) != NULL){
+            return nul - buf;
+        }
+        len += n;
+    }
+    return(-1);
+}
+
+// -s: pid's exec argv as a command line, the way /proc/<pid>/cmdline would have it; whatever
+// doesn't fit in size is left out.  Its length, or -1.
+static ssize_t forkshimd_peek_argv(pid_t pid, uintptr_t argv, char *buf, size_t size){
+    uintptr_t ptr[64];
+    struct iovec local, remote;
+    size_t len = 0, n, i;
+    ssize_t m;
+    for(;;){
+        n = (4096 - (argv & 4095)) / sizeof(*ptr);
+        n = n < 64 ? n : 64;
+        local = (struct iovec){ ptr, n * sizeof(*ptr) };
+        remote = (struct iovec){ (void *)argv, n * sizeof(*ptr) };
+        if(process_vm_readv(pid, &local, 1, &remote, 1, 0) != (ssize_t)(n * sizeof(*ptr))){
+            return len > 0 ? (ssize_t)len : -1;
+        }
+        for(i = 0; i < n; i++){
+            if(ptr[i] == 0 || len >= size || (m = forkshimd_peek_str(pid, ptr[i], buf + len, size - len)) == -1){
+                return len;
+            }
+            len += m + 1;
+        }
+        argv += n * sizeof(*ptr);
+    }
+}
+
+// -s: the file an execve()/execveat() is about to run, made absolute against the caller's working
+// directory or dirfd (not looked up along $PATH: the kernel never does).  Its length, or -1.
+static ssize_t forkshimd_exec_target(pid_t pid, const struct seccomp_notif *req, char *exe, size_t size){
+    char path[PATH_MAX], dir[sizeof("/proc//fd/") + 21];
+    int at = req->data.nr == __NR_execveat, dirfd = at ? (int)req->data.args[0] : AT_FDCWD;
+    ssize_t n = forkshimd_peek_str(pid, req->data.args[at ? 1 : 0], path, sizeof(path)), d;
+    if(n < 0){
+        return(-1);
+    }
+    if(path[0] == '/'){
+        memcpy(exe, path, n + 1);
+        return n;
+    }
+    if(dirfd == AT_FDCWD){
+        shim_format(dir, sizeof(dir), "/proc/%d/cwd", pid);
+    } else {
+        shim_format(dir, sizeof(dir), "/proc/%d/fd/%d", pid, dirfd);
+    }
+    if((d = readlinkat(AT_FDCWD, dir, exe, size - 1)) <= 0 || (size_t)(d + n + 2) > size){
+        return(-1);
+    }
+    if(n == 0){ // AT_EMPTY_PATH: dirfd is the file
+        exe[d] = 0x00;
+        return d;
+    }
+    exe[d] = '/';
+    memcpy(exe + d + 1, path, n + 1);
+    return d + 1 + n;
+}
+
+// -s: a supervised process is about to exec.  Score it from the argv and path it passed, as the
+// shim's exec*() would have, with its current program as the 'parent:', then let the call go on.
+// Whatever goes wrong, the exec goes ahead.
+static void forkshimd_notified(int nfd){
+    static const char nocomm[16];
+    struct seccomp_notif req;
+    struct seccomp_notif_resp resp;
+    char fileName[sizeof("/proc//oom_score_adj") + 10], cmdBuf[FORKSHIMD_ARGV_MAX + SHIM_SCAN_PAD], exe[PATH_MAX], self[PATH_MAX], comm[16];
+    char lineage[SHIM_LINEAGE_MAX], num[16];
+    const struct wl_rules *global, *wl;
+    const char *lin = "";
+    unsigned long long start = 0;
+    unsigned int ticket;
+    uint64_t key, ctx = 0;
+    ssize_t cmdLen, exeLen = -1, selfLen = 0;
+    size_t len, tagLen;
+    int best, score, at;
+    pid_t pid;
+    memset(&req, 0, sizeof(req));
+    if(ioctl(nfd, SECCOMP_IOCTL_NOTIF_RECV, &req) == -1){
+        return; // interrupted, or the caller is gone already
+    }
+    pid = req.pid;
+    at = req.data.nr == __NR_execveat;
+    shim_format(fileName, sizeof(fileName), "/proc/%d/oom_score_adj", pid);
+    if(forkshimd_read_at(fileName + sizeof("/proc/") - 1, num, sizeof(num)) > 0 && atoi(num) == WL_SCORE_NEVER_KILL){
+        SHIM_COUNT(execs_immune); // below a never-kill program, which nothing is classified again
+    } else if((cmdLen = forkshimd_peek_argv(pid, req.data.args[at ? 2 : 1], cmdBuf, FORKSHIMD_ARGV_MAX)) >= 0){
+        memset(cmdBuf + cmdLen, 0, SHIM_SCAN_PAD);
+        wl_refresh(1);
+        global = wl = wl_enter(&ticket);
+        if(global->nconditional > 0){
+            shim_format(exe, sizeof(exe), "/proc/%d/exe", pid);
+            if((selfLen = readlinkat(AT_FDCWD, exe, self, sizeof(self) - 1)) < 0){
+                selfLen = 0;
+            }
+            self[selfLen] = 0x00;
+            forkshimd_comm(pid, comm);
+            lin = forkshimd_lineage_of(pid, &start);
+            wl = forkshimd_context(global, self, selfLen, comm, lin, strlen(lin), ticket + 1, &ctx);
+            wl = wl != NULL ? wl : global;
+        }
+        if(wl->nexe > 0){
+            exeLen = forkshimd_exec_target(pid, &req, exe, sizeof(exe));
+        }
+        key = shim_l1_hash(0, cmdBuf, cmdLen);
+        key = exeLen > 0 ? shim_l1_hash(key ^ ctx, exe, exeLen) : key ^ ctx;
+        best = forkshimd_classify(wl, key, ticket + 1, cmdBuf, cmdLen, exe, exeLen);
+        score = best == -1 ? wl->default_score : wl->rule[best].score;
+        if(ioctl(nfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req.id) == 0 && write_score(fileName, score) == 0){ // still that process
+            SHIM_COUNT(execs_classified);
+            shim_cgroup_move(shim_cgroup_of(wl, best), pid); // still stopped in execve(): placed before the new program runs
+            shim_log("/tmp/shim_forks.log", "pid = %i\n", pid);
+            if(global->nconditional > 0 && start != 0 && pid <= forkshimd_proc.pid_max){
+                // its lineage from here on: what it had, plus the winner's tag
+                len = strlen(lin);
+                memcpy(lineage, lin, len + 1);
+                if(best != -1 && wl->rule[best].opt[WL_OPT_TAG] != WL_NONE){
+                    const char *tag = wl->arena + wl->rule[best].opt[WL_OPT_TAG];
+                    if(!shim_lineage_has(lineage, tag, tagLen = strlen(tag)) && len + tagLen + 2 <= sizeof(lineage)){
+                        if(len > 0){
+                            lineage[len++] = ':';
+                        }
+                        memcpy(lineage + len, tag, tagLen + 1);
+                        len += tagLen;
+                    }
+                }
+                forkshimd_proc.pid[pid] = forkshimd_image("", 0, nocomm, lineage, len);
+                forkshimd_proc.start[pid] = start;
+            }
+        }
+        wl_release(ticket);
+    }
+    memset(&resp, 0, sizeof(resp));
+    resp.id = req.id;
+    resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    ioctl(nfd, SECCOMP_IOCTL_NOTIF_SEND, &resp); // ENOENT if it died meanwhile
+}
+
+// -s: in the child, before it execs the program: every execve()/execveat() from here on, in
+// this process and everything it starts, waits for forkshimd_notified().  The listener, or -1.
+static int forkshimd_seccomp(void){
+    struct sock_filter insn[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FORKSHIMD_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW), // other ABIs (i386 on x86_64) go unseen
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_execve, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_execveat, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    };
+    struct sock_fprog prog = { .len = sizeof(insn) / sizeof(insn[0]), .filter = insn };
+    int fd;
+    if((fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog)) == -1 && errno == EACCES){
+        // without CAP_SYS_ADMIN a filter takes no_new_privs: setuid programs below won't gain privileges
+        if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0){
+            fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+        }
+    }
+    return fd;
+}
+
+// -s: run argv under supervision; its exit status.  Returns once nothing supervised is left (the
+// program and everything it started, daemons included), so none of their execs is left waiting.
+// The 'cgroup:' slot argv would be classified into, for starting it there.  The command line only: where
+// execvp() finds it isn't known yet; the exec, caught like any other, settles it.
+static int forkshimd_supervise_cgroup(char **argv){
+    const struct wl_rules *wl;
+    unsigned int ticket;
+    size_t len = 0, n;
+    char *buf;
+    int i, slot = -1;
+    for(i = 0; argv[i] != NULL; i++){
+        len += strlen(argv[i]) + 1;
+    }
+    if((buf = malloc(len + SHIM_SCAN_PAD)) == NULL){
+        return(-1);
+    }
+    for(i = 0, len = 0; argv[i] != NULL; i++, len += n){
+        memcpy(buf + len, argv[i], n = strlen(argv[i]) + 1);
+    }
+    memset(buf + len, 0, SHIM_SCAN_PAD);
+    wl = wl_enter(&ticket);
+    slot = shim_cgroup_of(wl, classify_cmdline(wl, buf, len));
+    wl_release(ticket);
+    free(buf);
+    return(slot);
+}
+
+// fork(), but with the child born in the cgroup in slot (CLONE_INTO_CGROUP, cgroup v2) so nothing it
+// does before its exec is charged anywhere else.  A raw clone3(): glibc's fork handlers don't run,
+// which is fine for a single-threaded forkshimd and a child that only sets up its filter and execs.
+// Anything else (no slot, a v1 directory, an older kernel) is a plain fork().
+static pid_t forkshimd_fork_into(int slot){
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args;
+    long pid;
+    if(slot >= 0 && shim_cgroup.slot[slot].dirfd != -1){
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = (uint64_t)shim_cgroup.slot[slot].dirfd;
+        if((pid = syscall(SYS_clone3, &args, sizeof(args))) != -1){
+            return (pid_t)pid;
+        }
+    }
+#else
+    (void)slot;
+#endif
+    return fork();
+}
+
+static int forkshimd_supervise(char **argv){
+    char cbuf[CMSG_SPACE(sizeof(int))], byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cm;
+    struct pollfd pfd[2];
+    int sv[2], nfd = -1, status = 0, reaped = 0;
+    pid_t child;
+    if(forkshimd_proc_init() == -1 || (forkshimd_proc.start = calloc(forkshimd_proc.pid_max + 1, sizeof(*forkshimd_proc.start))) == NULL ||
+       socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1){
+        return(127);
+    }
+    wl_refresh(1);
+    if((child = forkshimd_fork_into(forkshimd_supervise_cgroup(argv))) == -1){
+        return(127);
+    }
+    if(child == 0){
+        close(sv[0]);
+        if((nfd = forkshimd_seccomp()) == -1){
+            shim_log("/tmp/shim_forks_wl.log", "forkshimd: can't supervise %s, running it unsupervised\n", argv[0]);
+        } else {
+            memset(cbuf, 0, sizeof(cbuf));
+            cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &nfd, sizeof(int));
+            if(sendmsg(sv[1], &msg, 0) == -1){
+                _exit(127); // our exec would wait for a supervisor that never comes
+            }
+            close(nfd);
+        }
+        close(sv[1]);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(sv[1]);
+    if(recvmsg(sv[0], &msg, MSG_CMSG_CLOEXEC) > 0 && (cm = CMSG_FIRSTHDR(&msg)) != NULL && cm->cmsg_type == SCM_RIGHTS){
+        memcpy(&nfd, CMSG_DATA(cm), sizeof(int));
+    }
+    close(sv[0]);
+    signal(SIGINT, SIG_IGN); // the program gets ^C itself; we stay until it's gone
+    pfd[0] = (struct pollfd){ .fd = nfd, .events = POLLIN };
+#ifdef SYS_pidfd_open
+    pfd[1] = (struct pollfd){ .fd = (int)syscall(SYS_pidfd_open, child, 0), .events = POLLIN };
+#else
+    pfd[1] = (struct pollfd){ .fd = -1 };
+#endif
+    while(nfd != -1){
+        if(poll(pfd, 2, pfd[1].fd == -1 && !reaped ? 1000 : -1) == -1){
+            continue;
+        }
+        if(!reaped && waitpid(child, &status, WNOHANG) == child){
+            reaped = 1; // a zombie would keep the filter, and the listener, alive
+            close(pfd[1].fd);
+            pfd[1].fd = -1;
+        }
+        if(pfd[0].revents & POLLIN){
+            forkshimd_notified(nfd);
+        } else if(pfd[0].revents & (POLLHUP | POLLERR)){
+            break; // nothing supervised is left
+        }
+    }
+    if(!reaped){
+        waitpid(child, &status, 0);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+#endif
+
+// -r: the processes a sweep goes through, and how far it got.
+static struct {
+    pid_t *pid;
+    size_t npid;
+    size_t next;               // claimed by the workers, FORKSHIMD_BATCH at a time
+    const struct wl_rules *wl;
+    unsigned int gen;          // when there are 'parent:'/'lineage:' entries (a single worker)
+    int low, high;             // only processes with a score in between
+    unsigned long scored, changed;
+} forkshimd_sweep;
+
+// The lineage pid's program runs with, from its FORK_SHIM_LINEAGE; its length.
+static size_t forkshimd_env_lineage(pid_t pid, char lineage[SHIM_LINEAGE_MAX]){
+    char fileName[sizeof("/proc//environ") + 10], *buf, *p, *end;
+    size_t len, n = 0;
+    shim_format(fileName, sizeof(fileName), "/proc/%d/environ", pid);
+    if((buf = read_cmdline(fileName, &len)) != NULL){
+        for(p = buf, end = buf + len; p < end; p += strlen(p) + 1){
+            if(!strncmp(p, SHIM_ENV_LINEAGE "=", sizeof(SHIM_ENV_LINEAGE)) && (n = strlen(p + sizeof(SHIM_ENV_LINEAGE))) < SHIM_LINEAGE_MAX){
+                memcpy(lineage, p + sizeof(SHIM_ENV_LINEAGE), n);
+                break;
+            }
+        }
+        free(buf);
+    }
+    n = n < SHIM_LINEAGE_MAX ? n : 0;
+    lineage[n] = 0x00;
+    return n;
+}
+
+// -r: classify pids off the shared list, as a fork by their parent would have been, until it's
+// done.  Never-kill processes are left alone, as is everything below them (they're never-kill too).
+static void *forkshimd_sweep_worker(void *arg){
+    char *cmdBuf = malloc(FORKSHIMD_SWEEP_ARGV + SHIM_SCAN_PAD), name[sizeof("/oom_score_adj") + 10], exe[PATH_MAX], num[16];
+    char parent[PATH_MAX], comm[16], lineage[SHIM_LINEAGE_MAX];
+    const struct wl_rules *wl;
+    unsigned long scored = 0, changed = 0;
+    unsigned long long start;
+    size_t i, end, lineageLen;
+    ssize_t cmdLen, exeLen, parentLen, n;
+    uint64_t key, ctx;
+    int fd, best, score, len;
+    pid_t pid, ppid;
+    (void)arg;
+    if(cmdBuf == NULL){
+        return NULL;
+    }
+    while((i = __atomic_fetch_add(&forkshimd_sweep.next, FORKSHIMD_BATCH, __ATOMIC_RELAXED)) < forkshimd_sweep.npid){
+        end = i + FORKSHIMD_BATCH < forkshimd_sweep.npid ? i + FORKSHIMD_BATCH : forkshimd_sweep.npid;
+        for(; i < end; i++){
+            pid = forkshimd_sweep.pid[i];
+            shim_format(name, sizeof(name), "%d/cmdline", pid);
+            if((fd = openat(forkshimd_procfd, name, O_RDONLY | O_CLOEXEC)) == -1){
+                continue; // gone
+            }
+            cmdLen = pread(fd, cmdBuf, FORKSHIMD_SWEEP_ARGV, 0); // one read, whatever fits
+            close(fd);
+            shim_format(name, sizeof(name), "%d/oom_score_adj", pid);
+            if(cmdLen <= 0 || (fd = openat(forkshimd_procfd, name, O_RDWR | O_CLOEXEC)) == -1){
+                continue; // kernel threads have no command line
+            }
+            if((n = pread(fd, num, sizeof(num) - 1, 0)) <= 0 || (num[n] = 0x00, atoi(num) == WL_SCORE_NEVER_KILL) ||
+               atoi(num) < forkshimd_sweep.low || atoi(num) > forkshimd_sweep.high){
+                close(fd);
+                continue;
+            }
+            memset(cmdBuf + cmdLen, 0, SHIM_SCAN_PAD);
+            wl = forkshimd_sweep.wl;
+            ctx = 0;
+            if(forkshimd_sweep.gen != 0 && forkshimd_stat(pid, &ppid, &start) == 0){
+                // the parent decides 'parent:', its FORK_SHIM_LINEAGE 'lineage:'
+                shim_format(name, sizeof(name), "%d/exe", ppid);
+                if((parentLen = readlinkat(forkshimd_procfd, name, parent, sizeof(parent) - 1)) < 0){
+                    parentLen = 0;
+                }
+                parent[parentLen] = 0x00;
+                forkshimd_comm(ppid, comm);
+                lineageLen = forkshimd_env_lineage(ppid, lineage);
+                wl = forkshimd_context(forkshimd_sweep.wl, parent, parentLen, comm, lineage, lineageLen, forkshimd_sweep.gen, &ctx);
+                wl = wl != NULL ? wl : forkshimd_sweep.wl;
+            }
+            exeLen = -1;
+            if(wl->nexe > 0){
+                shim_format(name, sizeof(name), "%d/exe", pid);
+                if((exeLen = readlinkat(forkshimd_procfd, name, exe, sizeof(exe) - 1)) > 0){
+                    exe[exeLen] = 0x00;
+                }
+            }
+            if(forkshimd_sweep.gen != 0){ // single worker: the shared cache is ours
+                key = shim_l1_hash(0, cmdBuf, cmdLen);
+                key = exeLen > 0 ? shim_l1_hash(key ^ ctx, exe, exeLen) : key ^ ctx;
+                best = forkshimd_classify(wl, key, forkshimd_sweep.gen, cmdBuf, cmdLen, exe, exeLen);
+            } else {
+                best = classify_cmdline(wl, cmdBuf, cmdLen);
+                best = exeLen > 0 ? wl_pick(wl, best, check_wl_exe(wl, exe, exeLen)) : best;
+            }
+            score = best == -1 ? wl->default_score : wl->rule[best].score;
+            if(score != atoi(num)){
+                len = shim_format(num, sizeof(num), "%d\n", score);
+                changed += pwrite(fd, num, len, 0) == len;
+            }
+            shim_cgroup_move(shim_cgroup_of(wl, best), pid);
+            close(fd);
+            scored++;
+        }
+    }
+    free(cmdBuf);
+    SHIM_COUNT_N(procs_swept, scored);
+    __atomic_fetch_add(&forkshimd_sweep.scored, scored, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&forkshimd_sweep.changed, changed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// -r: classify every running process again (or root and everything below it) with the whitelist
+// as it is now, e.g. after it changed, across a pool of workers.  Reports how fast it went.  Only
+// processes with a score from low to high are looked at (see forkshimd_psi_event()).
+static int forkshimd_sweep_run(pid_t root, int low, int high){
+    static struct forkshimd_procs ps;
+    pthread_t tid[FORKSHIMD_SWEEP_WORKERS];
+    struct timespec t0, t1;
+    unsigned int ticket;
+    pid_t *parent = NULL, p;
+    ssize_t n;
+    size_t i, k = 0;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN), started = 0, ms;
+    char out[160];
+    int depth;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if(forkshimd_scan(&ps, root > 0 ? FORKSHIMD_SCAN_STAT : 0) == -1){
+        return(1);
+    }
+    forkshimd_sweep.next = forkshimd_sweep.scored = forkshimd_sweep.changed = 0;
+    forkshimd_sweep.gen = 0;
+    forkshimd_sweep.low = low;
+    forkshimd_sweep.high = high;
+    forkshimd_sweep.pid = ps.pid;
+    forkshimd_sweep.npid = ps.n;
+    if(root > 0 && forkshimd_proc_init() == 0 && (parent = calloc(forkshimd_proc.pid_max + 1, sizeof(*parent))) != NULL){
+        // keep root's subtree only
+        for(i = 0; i < ps.n; i++){
+            if(ps.pid[i] <= forkshimd_proc.pid_max){
+                parent[ps.pid[i]] = ps.ppid[i];
+            }
+        }
+        for(i = 0; i < forkshimd_sweep.npid; i++){
+            for(p = forkshimd_sweep.pid[i], depth = 0; p > 0 && p != root && p <= forkshimd_proc.pid_max && depth < 4096; p = parent[p], depth++){
+            }
+            if(p == root){
+                forkshimd_sweep.pid[k++] = forkshimd_sweep.pid[i];
+            }
+        }
+        forkshimd_sweep.npid = k;
+        free(parent);
+    } else if(root > 0){
+        return(1);
+    }
+    wl_refresh(0);
+    forkshimd_sweep.wl = wl_enter(&ticket);
+    if(forkshimd_sweep.wl->nconditional > 0){
+        forkshimd_sweep.gen = ticket + 1; // the per-parent indexes aren't shared between threads
+        workers = 1;
+    }
+    workers = workers < 1 ? 1 : workers > FORKSHIMD_SWEEP_WORKERS ? FORKSHIMD_SWEEP_WORKERS : workers;
+    for(; started < workers - 1 && pthread_create(&tid[started], NULL, forkshimd_sweep_worker, NULL) == 0; started++){
+    }
+    forkshimd_sweep_worker(NULL);
+    while(started > 0){
+        pthread_join(tid[--started], NULL);
+    }
+    wl_release(ticket);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    n = shim_format(out, sizeof(out), "forkshimd: swept %lu processes (%lu changed) of %lu in %ld ms, %lu/s, %ld workers\n",
+                    forkshimd_sweep.scored, forkshimd_sweep.changed, (unsigned long)forkshimd_sweep.npid, ms,
+                    (unsigned long)(forkshimd_sweep.npid * 1000 / (ms > 0 ? ms : 1)), workers);
+    shim_log("/tmp/shim_forks_wl.log", "%s", out);
+    if(write(1, out, n) != n){
+        // it's in the log too
+    }
+    return(0);
+}
+
+static struct {
+    int fd;                    // PSI trigger, -1 = none (every fork is classified)
+    int full;                  // what it was registered with
+    unsigned int stall_ms, window_ms;
+    struct shim_pressure *map; // SHIM_PRESSURE_FILE
+    uint64_t pressed;          // ns of the last pressure event, 0 = calm
+    uint64_t ticked;           // ns of the last heartbeat
+    unsigned int armed_ms;     // the window the kernel took
+} forkshimd_psi = { .fd = -1 };
+
+// Register the '%psi' trigger on fd; what was written is left in trigger.  Without CAP_SYS_RESOURCE
+// (root in a container, say) the kernel only takes whole 2 s windows, so the window is rounded up.
+static int forkshimd_psi_arm(int fd, char *trigger, size_t size){
+    unsigned int window = forkshimd_psi.window_ms;
+    int len;
+    for(;;){
+        len = shim_format(trigger, size, "%s %u %u", forkshimd_psi.full ? "full" : "some", forkshimd_psi.stall_ms * 1000, window * 1000);
+        if(write(fd, trigger, len + 1) == len + 1){ // the kernel wants the NUL too
+            forkshimd_psi.armed_ms = window;
+            return(0);
+        }
+        if(errno != EINVAL || window % 2000 == 0){
+            return(-1);
+        }
+        window = (window + 1999) / 2000 * 2000;
+    }
+}
+
+// SHIM_PRESSURE_FILE, ours (root's) and sized before it's mapped.  One left by someone else is
+// replaced: shims only believe a file that root owns and nobody else can write.
+static struct shim_pressure *forkshimd_psi_map(void){
+    void *p = MAP_FAILED;
+    struct stat st;
+    int fd;
+    if((fd = open(SHIM_PRESSURE_FILE, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)) == -1 ||
+       fstat(fd, &st) == -1 || st.st_uid != geteuid() || !S_ISREG(st.st_mode)){
+        if(fd != -1){
+            close(fd);
+        }
+        unlink(SHIM_PRESSURE_FILE);
+        fd = open(SHIM_PRESSURE_FILE, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    }
+    if(fd != -1){
+        if(fchmod(fd, 0644) == 0 && posix_fallocate(fd, 0, sizeof(struct shim_pressure)) == 0){
+            p = mmap(NULL, sizeof(struct shim_pressure), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Follow the whitelist's '%psi' line: (re)register the trigger when it changes, and while there's
+// no pressure keep telling shims that forks only need the default score.  Called every time round
+// the event loop, does something at most every FORKSHIMD_PSI_TICK ms.
+static void forkshimd_psi_tick(int efd){
+    struct epoll_event ev = { .events = EPOLLPRI };
+    const struct wl_rules *wl;
+    unsigned int ticket;
+    uint64_t now = shim_now_ns();
+    char trigger[48] = "";
+    if(now - forkshimd_psi.ticked < FORKSHIMD_PSI_TICK * 1000000ull){
+        return;
+    }
+    forkshimd_psi.ticked = now;
+    wl_refresh(1);
+    wl = wl_enter(&ticket);
+    if(wl->psi_window_ms != forkshimd_psi.window_ms || wl->psi_stall_ms != forkshimd_psi.stall_ms || wl->psi_full != forkshimd_psi.full){
+        if(forkshimd_psi.map != NULL){
+            __atomic_store_n(&forkshimd_psi.map->calm_until, 0, __ATOMIC_RELEASE);
+        }
+        if(forkshimd_psi.fd != -1){
+            close(forkshimd_psi.fd); // and out of the epoll set
+            forkshimd_psi.fd = -1;
+        }
+        forkshimd_psi.full = wl->psi_full;
+        forkshimd_psi.stall_ms = wl->psi_stall_ms;
+        forkshimd_psi.window_ms = wl->psi_window_ms;
+        forkshimd_psi.pressed = 0;
+        if(forkshimd_psi.window_ms != 0){
+            if((forkshimd_psi.map == NULL && (forkshimd_psi.map = forkshimd_psi_map()) == NULL) ||
+               (forkshimd_psi.fd = open(FORKSHIMD_PSI_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1 ||
+               forkshimd_psi_arm(forkshimd_psi.fd, trigger, sizeof(trigger)) == -1 ||
+               (ev.data.fd = forkshimd_psi.fd, epoll_ctl(efd, EPOLL_CTL_ADD, forkshimd_psi.fd, &ev)) == -1){
+                shim_log("/tmp/shim_forks_wl.log", "forkshimd: can't watch memory pressure (%s, \"%s\"), every fork is classified\n", FORKSHIMD_PSI_FILE, trigger);
+                if(forkshimd_psi.fd != -1){
+                    close(forkshimd_psi.fd);
+                    forkshimd_psi.fd = -1;
+                }
+            } else {
+                shim_log("/tmp/shim_forks_wl.log", "forkshimd: watching memory pressure (%s), forks get %d until there is some\n", trigger, wl->default_score);
+            }
+        }
+    }
+    if(forkshimd_psi.fd != -1 && forkshimd_psi.pressed != 0 &&
+       now - forkshimd_psi.pressed >= FORKSHIMD_PSI_HOLD * forkshimd_psi.armed_ms * 1000000ull){
+        forkshimd_psi.pressed = 0;
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: no memory pressure for %u ms, forks get %d again\n", FORKSHIMD_PSI_HOLD * forkshimd_psi.armed_ms, wl->default_score);
+    }
+    if(forkshimd_psi.fd != -1 && forkshimd_psi.pressed == 0){
+        if(forkshimd_psi.map->calm_score != wl->default_score){
+            __atomic_store_n(&forkshimd_psi.map->calm_until, 0, __ATOMIC_RELEASE); // no fork takes the new score with the old deadline
+            __atomic_store_n(&forkshimd_psi.map->calm_score, wl->default_score, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&forkshimd_psi.map->calm_until, now + FORKSHIMD_PSI_CALM * 1000000000ull, __ATOMIC_RELEASE);
+    }
+    wl_release(ticket);
+}
+
+// The trigger fired: forks are classified in full from now on, and the processes forked while it
+// was calm that still have the default score (or one '%rebalance' gave them) are classified now.  Once there's been no event for
+// FORKSHIMD_PSI_HOLD windows, forkshimd_psi_tick() lets forks take the default again.
+static void forkshimd_psi_event(void){
+    int calm = forkshimd_psi.pressed == 0, low = forkshimd_psi.map->calm_score, high = low;
+    const struct wl_rules *wl;
+    unsigned int ticket;
+    __atomic_store_n(&forkshimd_psi.map->calm_until, 0, __ATOMIC_RELEASE);
+    forkshimd_psi.pressed = shim_now_ns();
+    if(calm){
+        wl = wl_enter(&ticket);
+        if(wl->rank_ms != 0){
+            low = wl->rank_low < low ? wl->rank_low : low;
+            high = wl->rank_high > high ? wl->rank_high : high;
+        }
+        wl_release(ticket);
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: memory pressure, classifying what was forked while it was calm\n");
+        forkshimd_sweep_run(0, low, high);
+    }
+}
+
+struct forkshimd_ranked {
+    pid_t pid;
+    short score;               // as last scanned
+    unsigned long rss;         // pages
+};
+
+// '%rebalance': the processes inside the band, smallest first, kept from pass to pass so a pass
+// starts from the last order and mostly finds it still right.
+static struct {
+    struct forkshimd_procs ps;
+    struct forkshimd_ranked *r;
+    size_t n, cap;
+    uint32_t *at;              // pid -> its index in ps + 1 during a pass, all 0 between passes
+    uint64_t ticked;           // ns of the last pass
+    unsigned long moved, written; // since the last log line
+} forkshimd_rank;
+
+static int forkshimd_rank_cmp(const void *a, const void *b){
+    unsigned long x = ((const struct forkshimd_ranked *)a)->rss, y = ((const struct forkshimd_ranked *)b)->rss;
+    return x < y ? -1 : x > y;
+}
+
+// Put r (in the last pass's order, with fresh sizes) in order again.  Most of it still is, so an
+// insertion sort does it in about one pass; if too much moved, sort it all instead.
+static void forkshimd_rank_sort(struct forkshimd_ranked *r, size_t n){
+    struct forkshimd_ranked t;
+    size_t i, j, budget = 8 * n + 64;
+    for(i = 1; i < n; i++){
+        for(t = r[i], j = i; j > 0 && r[j - 1].rss > t.rss; j--){
+            r[j] = r[j - 1];
+            if(--budget == 0){
+                r[j - 1] = t; // r is a permutation again; qsort() takes it from here
+                qsort(r, n, sizeof(*r), forkshimd_rank_cmp);
+                return;
+            }
+        }
+        forkshimd_rank.moved += j != i;
+        r[j] = t;
+    }
+}
+
+// Every '%rebalance' interval: scan resident sizes and scores, rank whatever scores inside the
+// band by size, and spread the band over them, the largest getting the top.  Only the scores that
+// come out different are written, so a quiet host costs one scan.  Processes joining (a fork got
+// the default) or leaving the band just shift their neighbours' ranks.
+static void forkshimd_rank_tick(void){
+    struct forkshimd_procs *ps = &forkshimd_rank.ps;
+    struct forkshimd_ranked *r;
+    const struct wl_rules *wl;
+    unsigned int ticket;
+    uint64_t now = shim_now_ns();
+    char name[sizeof("/oom_score_adj") + 10], num[16];
+    size_t i, k, n = 0;
+    int low, high, score, len, fd;
+    uint32_t at;
+    pid_t pid;
+    wl = wl_enter(&ticket);
+    low = wl->rank_low;
+    high = wl->rank_high;
+    if(wl->rank_ms == 0 || now - forkshimd_rank.ticked < wl->rank_ms * 1000000ull){
+        wl_release(ticket);
+        return;
+    }
+    wl_release(ticket);
+    forkshimd_rank.ticked = now;
+    if((forkshimd_proc.pid == NULL && forkshimd_proc_init() == -1) ||
+       (forkshimd_rank.at == NULL && (forkshimd_rank.at = calloc(forkshimd_proc.pid_max + 1, sizeof(*forkshimd_rank.at))) == NULL) ||
+       forkshimd_scan(ps, FORKSHIMD_SCAN_STATM | FORKSHIMD_SCAN_SCORE) == -1){
+        return;
+    }
+    if(forkshimd_rank.cap < ps->n && (r = realloc(forkshimd_rank.r, ps->n * sizeof(*r))) != NULL){
+        forkshimd_rank.r = r;
+        forkshimd_rank.cap = ps->n;
+    }
+    for(i = 0; i < ps->n; i++){
+        if(ps->pid[i] <= forkshimd_proc.pid_max){
+            forkshimd_rank.at[ps->pid[i]] = i + 1;
+        }
+    }
+    // those still in the band, in last pass's order, then the ones new to it
+    r = forkshimd_rank.r;
+    for(k = 0; k < forkshimd_rank.n; k++){
+        pid = r[k].pid;
+        at = pid <= forkshimd_proc.pid_max ? forkshimd_rank.at[pid] : 0;
+        if(at != 0 && at - 1 < ps->n && ps->pid[at - 1] == pid && ps->score[at - 1] >= low && ps->score[at - 1] <= high && ps->rss[at - 1] > 0){
+            r[n].pid = pid;
+            r[n].score = ps->score[at - 1];
+            r[n++].rss = ps->rss[at - 1];
+            ps->rss[at - 1] = 0; // taken
+        }
+    }
+    for(i = 0; i < ps->n && n < forkshimd_rank.cap; i++){
+        if(ps->score[i] >= low && ps->score[i] <= high && ps->rss[i] > 0){ // kernel threads have none
+            r[n].pid = ps->pid[i];
+            r[n].score = ps->score[i];
+            r[n++].rss = ps->rss[i];
+        }
+    }
+    // the map only ever describes this scan: a pid gone by the next one must not find its old slot
+    for(i = 0; i < ps->n; i++){
+        if(ps->pid[i] <= forkshimd_proc.pid_max){
+            forkshimd_rank.at[ps->pid[i]] = 0;
+        }
+    }
+    forkshimd_rank.n = n;
+    forkshimd_rank_sort(r, n);
+    for(k = 0; k < n; k++){
+        score = n == 1 ? high : low + (int)((long)(high - low) * k / (n - 1));
+        if(score == r[k].score){
+            continue;
+        }
+        shim_format(name, sizeof(name), "%d/oom_score_adj", r[k].pid);
+        if((fd = openat(forkshimd_procfd, name, O_WRONLY | O_CLOEXEC)) != -1){
+            len = shim_format(num, sizeof(num), "%d\n", score);
+            if(pwrite(fd, num, len, 0) == len){
+                r[k].score = score;
+                forkshimd_rank.written++;
+            }
+            close(fd);
+        }
+    }
+    if(forkshimd_rank.written > 0){
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: ranked %lu processes between %d and %d by size, %lu moved, %lu scores written\n",
+                 (unsigned long)n, low, high, forkshimd_rank.moved, forkshimd_rank.written);
+    }
+    forkshimd_rank.moved = forkshimd_rank.written = 0;
+}
+
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+// '%kill': the process being ended, if any.  Signals go through a pidfd, so a victim that exits
+// and has its pid reused meanwhile can't take anyone else with it.
+static struct {
+    int pidfd;                 // -1 = none
+    pid_t pid;
+    int killed;                // SIGKILL sent, not just SIGTERM
+    uint64_t sent, deadline;   // ns
+    struct forkshimd_procs ps;
+    uint32_t *member, gen;     // pid -> gen if it's in the '%kill' cgroup
+} forkshimd_kill = { .pidfd = -1 };
+
+// A cgroup file read into buf, NUL terminated; its length, or -1.
+static ssize_t forkshimd_cgroup_read(const char *dir, const char *name, char *buf, size_t size){
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+    shim_format(path, sizeof(path), "%s/%s", dir, name);
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1){
+        return(-1);
+    }
+    n = pread(fd, buf, size - 1, 0);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0x00;
+    return n;
+}
+
+// The number after "name " at the start of a line of a memory.stat (or meminfo) buf, 0 if none.
+static unsigned long long forkshimd_stat_field(const char *buf, const char *name){
+    size_t n = strlen(name);
+    const char *p;
+    for(p = buf; p != NULL && *p; p = (p = strchr(p, '\n')) != NULL ? p + 1 : NULL){
+        if(!strncmp(p, name, n) && (p[n] == ' ' || p[n] == ':')){
+            p += n + 1;
+            return forkshimd_parse_u(&p);
+        }
+    }
+    return(0);
+}
+
+// Percent of memory available: MemAvailable of MemTotal for the host; for a cgroup, what's left
+// below its limit plus its inactive page cache, of the limit (v2's memory.max, or v1's
+// limit_in_bytes).  A cgroup without a limit is as good as the host.  -1 if it can't be told.
+static int forkshimd_kill_avail(const char *cgroup){
+    unsigned long long total, avail, limit, used;
+    char buf[8192];
+    int v2;
+    if(forkshimd_read_at("meminfo", buf, sizeof(buf)) <= 0 || (total = forkshimd_stat_field(buf, "MemTotal") * 1024) == 0){
+        return(-1);
+    }
+    avail = forkshimd_stat_field(buf, "MemAvailable") * 1024;
+    if(cgroup[0] != 0x00){
+        if((v2 = forkshimd_cgroup_read(cgroup, "memory.max", buf, sizeof(buf)) > 0) == 0 &&
+           forkshimd_cgroup_read(cgroup, "memory.limit_in_bytes", buf, sizeof(buf)) <= 0){
+            return(-1);
+        }
+        if(buf[0] >= '0' && buf[0] <= '9' && (limit = strtoull(buf, NULL, 10)) > 0 && limit < total){
+            if(forkshimd_cgroup_read(cgroup, v2 ? "memory.current" : "memory.usage_in_bytes", buf, sizeof(buf)) <= 0){
+                return(-1);
+            }
+            used = strtoull(buf, NULL, 10);
+            avail = used < limit ? limit - used : 0;
+            if(forkshimd_cgroup_read(cgroup, "memory.stat", buf, sizeof(buf)) > 0){
+                avail += forkshimd_stat_field(buf, v2 ? "inactive_file" : "total_inactive_file"); // page cache it can drop
+            }
+            total = limit;
+        }
+    }
+    return (int)(avail < total ? avail * 100 / total : 100);
+}
+
+// Mark the processes in dir (a cgroup) and in the cgroups below it as members.
+static void forkshimd_kill_members(const char *dir, int depth){
+    char path[PATH_MAX], *buf = malloc(1 << 20), *p;
+    struct dirent *de;
+    unsigned long pid;
+    DIR *d;
+    if(buf == NULL){
+        return;
+    }
+    if(forkshimd_cgroup_read(dir, "cgroup.procs", buf, 1 << 20) > 0){
+        for(p = buf; *p; ){
+            pid = strtoul(p, &p, 10);
+            if(pid > 0 && pid <= (unsigned long)forkshimd_proc.pid_max){
+                forkshimd_kill.member[pid] = forkshimd_kill.gen;
+            }
+            while(*p == '\n'){
+                p++;
+            }
+            if(*p < '0' || *p > '9'){
+                break;
+            }
+        }
+    }
+    free(buf);
+    if(depth < 16 && (d = opendir(dir)) != NULL){
+        while((de = readdir(d)) != NULL){
+            if(de->d_type == DT_DIR && de->d_name[0] != '.'){
+                shim_format(path, sizeof(path), "%s/%s", dir, de->d_name);
+                forkshimd_kill_members(path, depth + 1);
+            }
+        }
+        closedir(d);
+    }
+}
+
+// Send the '%kill' victim, the process with the highest score (the lowest priority) and of those
+// the largest, a SIGTERM, or a SIGKILL if there's no grace period.  0 if there was one.
+static int forkshimd_kill_pick(const struct wl_rules *wl, int avail){
+    struct forkshimd_procs *ps = &forkshimd_kill.ps;
+    unsigned long long start;
+    size_t i, best = 0;
+    pid_t self = getpid(), ppid;
+    int sig = wl->kill_grace_ms > 0 ? SIGTERM : SIGKILL, found = 0, fd;
+    if((forkshimd_proc.pid == NULL && forkshimd_proc_init() == -1) ||
+       (forkshimd_kill.member == NULL && (forkshimd_kill.member = calloc(forkshimd_proc.pid_max + 1, sizeof(uint32_t))) == NULL) ||
+       forkshimd_scan(ps, FORKSHIMD_SCAN_STAT | FORKSHIMD_SCAN_STATM | FORKSHIMD_SCAN_SCORE) == -1){
+        return(-1);
+    }
+    if(wl->kill_cgroup[0] != 0x00){
+        forkshimd_kill.gen = forkshimd_kill.gen + 1 != 0 ? forkshimd_kill.gen + 1 : 1;
+        forkshimd_kill_members(wl->kill_cgroup, 0);
+    }
+    for(i = 0; i < ps->n; i++){
+        if(ps->pid[i] == self || ps->pid[i] == 1 || ps->score[i] < wl->kill_score || ps->rss[i] == 0 || ps->state[i] == 'Z' ||
+           (wl->kill_cgroup[0] != 0x00 && (ps->pid[i] > forkshimd_proc.pid_max || forkshimd_kill.member[ps->pid[i]] != forkshimd_kill.gen))){
+            continue;
+        }
+        if(!found || ps->score[i] > ps->score[best] || (ps->score[i] == ps->score[best] && ps->rss[i] > ps->rss[best])){
+            best = i;
+            found = 1;
+        }
+    }
+    // still the process that was scanned (not a reused pid) once there's a pidfd for it
+    if(!found || (fd = (int)syscall(SYS_pidfd_open, ps->pid[best], 0)) == -1){
+        return(-1);
+    }
+    if(forkshimd_stat(ps->pid[best], &ppid, &start) == -1 || start != ps->start[best] ||
+       syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0) == -1){
+        close(fd);
+        return(-1);
+    }
+    forkshimd_kill.pidfd = fd;
+    forkshimd_kill.pid = ps->pid[best];
+    forkshimd_kill.killed = sig == SIGKILL;
+    forkshimd_kill.sent = shim_now_ns();
+    forkshimd_kill.deadline = forkshimd_kill.sent + (wl->kill_grace_ms > 0 ? wl->kill_grace_ms : 1000) * 1000000ull;
+    shim_log("/tmp/shim_forks_wl.log", "forkshimd: %d%% of memory available%s%s, %s to %d (score %d, %lu kB)\n", avail,
+             wl->kill_cgroup[0] ? " in " : "", wl->kill_cgroup, sig == SIGKILL ? "SIGKILL" : "SIGTERM",
+             forkshimd_kill.pid, ps->score[best], ps->rss[best] * (unsigned long)(sysconf(_SC_PAGESIZE) / 1024));
+    return(0);
+}
+
+// '%kill': every FORKSHIMD_KILL_TICK ms, see whether the victim (if any) is gone or is due its
+// SIGKILL, and otherwise whether memory is short enough to pick the next one.  A '%psi' pressure
+// event doubles the percentage until it's over: reclaim is already stalling things.
+static void forkshimd_kill_tick(const struct wl_rules *wl){
+    struct pollfd pfd = { .fd = forkshimd_kill.pidfd, .events = POLLIN };
+    uint64_t now = shim_now_ns();
+    int avail;
+    if(forkshimd_kill.pidfd != -1){
+        if(poll(&pfd, 1, 0) == 1){
+            shim_log("/tmp/shim_forks_wl.log", "forkshimd: %d gone %lu ms after its %s\n", forkshimd_kill.pid,
+                     (unsigned long)((now - forkshimd_kill.sent) / 1000000), forkshimd_kill.killed ? "SIGKILL" : "SIGTERM");
+        } else if(now < forkshimd_kill.deadline){
+            return;
+        } else if(!forkshimd_kill.killed && syscall(SYS_pidfd_send_signal, forkshimd_kill.pidfd, SIGKILL, NULL, 0) == 0){
+            shim_log("/tmp/shim_forks_wl.log", "forkshimd: %d still there after %u ms, SIGKILL\n", forkshimd_kill.pid, wl->kill_grace_ms);
+            forkshimd_kill.killed = 1;
+            forkshimd_kill.sent = now;
+            forkshimd_kill.deadline = now + 1000000000ull;
+            return;
+        } else {
+            shim_log("/tmp/shim_forks_wl.log", "forkshimd: %d won't go, on to the next\n", forkshimd_kill.pid); // stuck in D, say
+        }
+        close(forkshimd_kill.pidfd);
+        forkshimd_kill.pidfd = -1;
+    }
+    if(wl->kill_pct != 0 && (avail = forkshimd_kill_avail(wl->kill_cgroup)) != -1 &&
+       (unsigned int)avail < wl->kill_pct * (forkshimd_psi.pressed != 0 ? 2 : 1)){
+        forkshimd_kill_pick(wl, avail);
+    }
+}
+#endif
+
+static volatile sig_atomic_t forkshimd_stop;
+
+// A pid given on the command line: a number, all of it, above 0; -1 otherwise.
+static pid_t forkshimd_parse_pid(const char *s){
+    char *end;
+    long v;
+    errno = 0;
+    v = strtol(s, &end, 10);
+    return errno == 0 && end != s && *end == 0x00 && v > 0 && v <= INT_MAX ? (pid_t)v : -1;
+}
+
+static void forkshimd_on_signal(int sig){
+    (void)sig;
+    forkshimd_stop = 1;
+}
+
+int main(int argc, char **argv){
+    static const char usage[] = "usage: forkshimd [-n] [-u]\n       forkshimd -s program [args...]\n       forkshimd -r [pid]\n";
+    struct sockaddr_un sa = { .sun_family = AF_UNIX, .sun_path = FORKSHIMD_SOCK };
+    struct sigaction sig = { .sa_handler = forkshimd_on_signal };
+    struct epoll_event ev = { .events = EPOLLIN }, ready[FORKSHIMD_BATCH];
+    const struct wl_rules *wl;
+    unsigned int ticket;
+    int lfd, nfd = -1, efd, fd, i, n, one = 1, procs = 0, uring = 0, timeout;
+    for(i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "-n")){
+            procs = 1;
+        } else if(!strcmp(argv[i], "-u")){
+            uring = 1;
+        } else if(!strcmp(argv[i], "-r") && (i + 1 == argc || (i + 2 == argc && forkshimd_parse_pid(argv[i + 1]) != -1))){
+            shim_init(); // the whole host only without a pid: anything else given is a usage error
+            return forkshimd_sweep_run(i + 1 < argc ? forkshimd_parse_pid(argv[i + 1]) : 0, INT_MIN, INT_MAX);
+#if defined(FORKSHIMD_AUDIT_ARCH) && defined(SECCOMP_IOCTL_NOTIF_RECV)
+        } else if(!strcmp(argv[i], "-s") && i + 1 < argc){
+            shim_init();
+            return forkshimd_supervise(argv + i + 1);
+#endif
+        } else {
+            if(write(2, usage, sizeof(usage) - 1) != sizeof(usage) - 1){
+                // nowhere else to say it
+            }
+            return(2);
+        }
+    }
+    shim_init(); // our own shim_self, for our own index
+    sigaction(SIGTERM, &sig, NULL); // no SA_RESTART: epoll_wait() returns, and the loop below winds down
+    sigaction(SIGINT, &sig, NULL);
+    if((efd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+       (lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1 ||
+       (unlink(FORKSHIMD_SOCK) == -1 && errno != ENOENT) ||
+       bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || chmod(FORKSHIMD_SOCK, 0666) == -1 ||
+       setsockopt(lfd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) == -1 || listen(lfd, SOMAXCONN) == -1){
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: can't listen on %s\n", FORKSHIMD_SOCK);
+        return(1);
+    }
+    if(procs && (nfd = forkshimd_proc_listen()) == -1){
+        shim_log("/tmp/shim_forks_wl.log", "forkshimd: can't follow process events (takes root, in the initial namespaces)\n");
+        return(1);
+    }
+    ev.data.fd = lfd;
+    epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+    if(nfd != -1){
+        ev.data.fd = nfd;
+        epoll_ctl(efd, EPOLL_CTL_ADD, nfd, &ev);
+    }
+    wl_refresh(1); // load and watch the whitelist now, not on the first record
+    if(uring){
+        forkshimd_ring_init();
+    }
+    while(!forkshimd_stop){
+        forkshimd_psi_tick(efd);
+        forkshimd_rank_tick();
+        wl = wl_enter(&ticket);
+        timeout = FORKSHIMD_PSI_TICK;
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+        forkshimd_kill_tick(wl);
+        timeout = wl->kill_pct != 0 || forkshimd_kill.pidfd != -1 ? FORKSHIMD_KILL_TICK : timeout;
+#endif
+        wl_release(ticket);
+        if((n = epoll_wait(efd, ready, FORKSHIMD_BATCH, timeout)) == -1){
+            continue; // EINTR
+        }
+        for(i = 0; i < n; i++){
+            fd = ready[i].data.fd;
+            if(fd == forkshimd_psi.fd){
+                forkshimd_psi_event();
+            } else if(fd == lfd){
+                while((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1){
+                    ev.data.fd = fd;
+                    if(setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) == -1 || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1){
+                        close(fd); // its shim falls back to classifying inline
+                    }
+                }
+            } else if(fd == nfd){
+                forkshimd_proc_recv(nfd);
+            } else if((ready[i].events & ~EPOLLIN) || forkshimd_recv(fd) == -1){
+                while(forkshimd_recv(fd) > 0){
+                    // whatever was sent before hanging up still counts
+                }
+                close(fd);
+            }
+        }
+    }
+    // New shims classify inline from here on; records already queued still get their scores,
+    // and shims still connected find out at their next send.
+    if(forkshimd_psi.map != NULL){
+        __atomic_store_n(&forkshimd_psi.map->calm_until, 0, __ATOMIC_RELEASE);
+    }
+    unlink(FORKSHIMD_SOCK);
+    close(lfd);
+    if(nfd != -1){
+        close(nfd);
+    }
+    while((n = epoll_wait(efd, ready, FORKSHIMD_BATCH, 0)) > 0){ // connections with something queued
+        for(i = 0; i < n; i++){
+            while(forkshimd_recv(ready[i].data.fd) > 0){
+                // until the queue is empty
+            }
+            close(ready[i].data.fd);
+        }
+    }
     return(0);
 }
+#endif